@@ -0,0 +1,39 @@
+#!/bin/bash
+# MIT License
+# Copyright (c) 2024 Infosystem Security s.r.l.
+# See the LICENSE file for full terms.
+#
+# Time kbw with the specialized kernels against kbw-generic (built with
+# KERNELS=0) on a few length ranges. The words are written to /dev/null,
+# the outputs are compared on the same ranges with -M capped to 7.
+# Usage: bench/kernels.sh [layout] [keys], run from the source directory
+# (make bench-kernels).
+
+LAYOUT=${1:-arrangements/ISO88591_qwerty_ita_d1.kbwp}
+KEYS=${2:-1qaz2wsx}
+LOG=${TMPDIR:-/tmp}/kbw-kernels.$$.log
+trap 'rm -f "$LOG"' EXIT
+
+# milliseconds taken by "$@"
+run() {
+    local start end
+    start=$(date +%s%N)
+    "$@" -l "$LOG" > /dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+printf "%-8s %12s %12s %8s\n" "-m -M" "generic ms" "kernels ms" "speedup"
+for range in "1 6" "1 7" "7 7" "5 8" "8 8"; do
+    set -- $range
+    max=$(( $2 < 7 ? $2 : 7 ))
+    min=$(( $1 < max ? $1 : max ))
+    if ! cmp -s <(./kbw-generic -a "$LAYOUT" -k "$KEYS" -m "$min" -M "$max" -l "$LOG") \
+                <(./kbw -a "$LAYOUT" -k "$KEYS" -m "$min" -M "$max" -l "$LOG"); then
+        echo "-m $min -M $max: the outputs differ"
+        exit 1
+    fi
+    tg=$(run ./kbw-generic -a "$LAYOUT" -k "$KEYS" -m "$1" -M "$2")
+    tk=$(run ./kbw -a "$LAYOUT" -k "$KEYS" -m "$1" -M "$2")
+    printf "%-8s %12d %12d %7.2fx\n" "$1 $2" "$tg" "$tk" "$(awk -v g="$tg" -v k="$tk" 'BEGIN { print (k > 0 ? g / k : 0) }')"
+done
@@ -0,0 +1,52 @@
+#!/bin/sh
+# MIT License
+# Copyright (c) 2024 Infosystem Security s.r.l.
+# See the LICENSE file for full terms.
+#
+# Throughput of kbw through each output sink, read by kbwread.
+# Usage: bench/sinks.sh [kbw options], run from the source directory
+# (make bench-sinks). The words of every sink are checked against the file.
+
+KBW=./kbw
+READER=./kbwread
+TMP=${TMPDIR:-/tmp}/kbw-sinks.$$
+OPTS=${*:-"-a arrangements/ISO88591_qwerty_ita_d1.kbwp -k 1qaz2wsx -m 1 -M 7"}
+
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+run() {
+    name=$1
+    shift
+    start=$(date +%s.%N)
+    "$@"
+    end=$(date +%s.%N)
+    size=$(stat -c %s "$TMP/$name.out")
+    awk -v n="$name" -v b="$size" -v t="$(echo "$start $end" | awk '{ print $2 - $1 }')" \
+        'BEGIN { printf "%s: %d bytes in %.3f s, %.1f MB/s\n", n, b, t, b / t / 1e6 }'
+    if [ "$name" != file ] && ! cmp -s "$TMP/file.out" "$TMP/$name.out"; then
+        echo "$name: output differs from the file sink"
+        exit 1
+    fi
+}
+
+file() { $KBW $OPTS -l "$TMP/log" -o "$TMP/file.out"; }
+direct() { $KBW $OPTS -l "$TMP/log" -o "file:$TMP/direct.out,direct,prealloc=256M,batch=4M"; }
+pipe() { $KBW $OPTS -l "$TMP/log" -o fd:1 | $READER -o "$TMP/pipe.out" fd:0; }
+sock() {
+    $READER -o "$TMP/unix.out" "unix:$TMP/sock" &
+    while [ ! -S "$TMP/sock" ]; do sleep 0.01; done
+    $KBW $OPTS -l "$TMP/log" -o "unix:$TMP/sock,sndbuf=4M"
+    wait
+}
+ring() {
+    $READER -o "$TMP/shm.out" "shm:kbw-bench.$$" &
+    $KBW $OPTS -l "$TMP/log" -o "shm:kbw-bench.$$,size=64M"
+    wait
+}
+
+run file file
+run direct direct
+run pipe pipe
+run unix sock
+run shm ring
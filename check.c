@@ -0,0 +1,287 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "check.h"
+#include "dryrun.h"
+#include "cmdlineopts.h"
+#include "signals.h"
+
+// a character and the key it belongs to
+typedef struct symkey {
+    sym_t sym;
+    int type; // -1 base character, >= 0 shift variant index
+    key *k;
+} symkey;
+
+// read-only state shared by the threads
+typedef struct checker {
+    symkey *bysym; // all the characters, sorted by symbol
+    int nsyms;
+    symkey direct[256]; // 8-bit encoding: indexed by the byte
+    double *startoff; // index of the first word of each key, -1 if not a start key
+    key *keyboard;
+    int minlen;
+    int depth;
+    int utf8;
+} checker;
+
+typedef struct chunk {
+    const checker *c;
+    char *in; // complete lines
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    uint64_t found;
+} chunk;
+
+static int symcmp(const void *a, const void *b)
+{
+    sym_t x = ((const symkey *)a)->sym, y = ((const symkey *)b)->sym;
+    return x < y ? -1 : x > y;
+}
+
+static const symkey *lookup(const checker *c, sym_t sym)
+{
+    symkey s;
+    const symkey *r;
+
+    if (!c->utf8) {
+        r = &c->direct[sym & 0xff];
+        return r->k != NULL ? r : NULL;
+    }
+    s.sym = sym;
+    return (const symkey *)bsearch(&s, c->bysym, c->nsyms, sizeof(symkey), symcmp);
+}
+
+// index of w (len bytes) or -1
+static double check_word(const checker *c, const char *w, size_t len)
+{
+    key *path[MAXWORDLEN];
+    int types[MAXWORDLEN];
+    char word[MAXWORDLEN * MAXSYMLEN + 1];
+    const symkey *sk;
+    int n = 0, l, j;
+    const char *p;
+    sym_t sym;
+
+    // nextsym() needs a terminated string
+    if (len > MAXWORDLEN * MAXSYMLEN) return -1;
+    memcpy(word, w, len);
+    word[len] = '\0';
+
+    for (p = word; *p != '\0'; p += l) {
+        l = nextsym(p, c->utf8, &sym);
+        if (l <= 0 || n == c->depth) return -1;
+        if ((sk = lookup(c, sym)) == NULL || sk->k->active != ACTIVE) return -1;
+        if (n > 0) {
+            // every step must follow the adjacency
+            for (j = 0; j < path[n-1]->nreach && path[n-1]->reach[j] != sk->k; j++);
+            if (j == path[n-1]->nreach) return -1;
+        } else if (c->startoff[sk->k - c->keyboard] < 0) {
+            return -1;
+        }
+        path[n] = sk->k;
+        types[n] = sk->type;
+        n++;
+    }
+    if (n < c->minlen) return -1;
+
+    return c->startoff[path[0] - c->keyboard] + word_rank(path, types, n, c->minlen, c->depth);
+}
+
+static void *check_chunk(void *arg)
+{
+    chunk *ch = (chunk *)arg;
+    char *s = ch->in, *e, *end = ch->in + ch->inlen;
+    size_t len;
+    double rank;
+    int n;
+
+    for (; s < end; s = e + 1) {
+        e = memchr(s, '\n', end - s);
+        len = e - s;
+        if (len > 0 && s[len-1] == '\r') len--;
+        rank = check_word(ch->c, s, len);
+
+        // the line, a tab and at most 320 digits
+        if (ch->outlen + len + 322 > ch->outcap) {
+            ch->outcap = 2 * ch->outcap + len + 322;
+            ch->out = (char *)realloc(ch->out, ch->outcap);
+            assert(ch->out != NULL);
+        }
+        memcpy(ch->out + ch->outlen, s, len);
+        ch->outlen += len;
+        if (rank >= 0) {
+            n = snprintf(ch->out + ch->outlen, 322, "\t%.0lf\n", rank);
+            ch->found++;
+        } else {
+            n = snprintf(ch->out + ch->outlen, 322, "\t-\n");
+        }
+        ch->outlen += n;
+    }
+
+    return NULL;
+}
+
+// process the complete lines in buf[0, len) with nthreads threads
+static uint64_t check_batch(const checker *c, char *buf, size_t len, chunk *chunks, int nthreads, outbuf *o)
+{
+    pthread_t tid[CZ_MAXTHREADS];
+    size_t start = 0, stop, n, w;
+    uint64_t found = 0;
+    int i, nrun = 0;
+    sigset_t set, oldset;
+    char *p;
+
+    // split on line boundaries
+    for (i = 0; i < nthreads && start < len; i++) {
+        stop = start + (len - start) / (nthreads - i);
+        if (stop < start + 1) stop = start + 1;
+        p = memchr(buf + stop - 1, '\n', len - (stop - 1));
+        stop = p - buf + 1;
+        chunks[i].c = c;
+        chunks[i].in = buf + start;
+        chunks[i].inlen = stop - start;
+        chunks[i].outlen = 0;
+        chunks[i].found = 0;
+        start = stop;
+        nrun++;
+    }
+
+    // the signals are for the main thread
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    for (i = 1; i < nrun; i++) {
+        if (pthread_create(&tid[i], NULL, check_chunk, &chunks[i]) != 0) {
+            fprintf(stderr, "pthread_create() error\n");
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    check_chunk(&chunks[0]);
+    for (i = 1; i < nrun; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // write in input order
+    for (i = 0; i < nrun; i++) {
+        for (w = 0; w < chunks[i].outlen; w += n) {
+            n = chunks[i].outlen - w;
+            if (n > o->cap) n = o->cap;
+            p = out_reserve(o, n);
+            memcpy(p, chunks[i].out + w, n);
+            o->len += n;
+        }
+        found += chunks[i].found;
+    }
+
+    return found;
+}
+
+uint64_t check_words(int fd, key *keyboard, int numkeys, key **startkeys, int lenkeys, int minlen, int depth, int utf8, int nthreads, outbuf *o)
+{
+    checker c;
+    chunk chunks[CZ_MAXTHREADS];
+    char *buf;
+    size_t cap = CHECKBATCH, len = 0, done;
+    ssize_t r;
+    uint64_t found = 0;
+    double off = 0;
+    int i, j, eof = 0, err;
+
+    assert(keyboard != NULL && startkeys != NULL && o != NULL);
+    assert(nthreads > 0 && nthreads <= CZ_MAXTHREADS);
+
+    memset(&c, 0, sizeof(c));
+    c.keyboard = keyboard;
+    c.minlen = minlen;
+    c.depth = depth;
+    c.utf8 = utf8;
+
+    for (i = 0; i < numkeys; i++) c.nsyms += 1 + keyboard[i].lensv;
+    c.bysym = (symkey *)malloc(c.nsyms * sizeof(symkey));
+    c.startoff = (double *)malloc(numkeys * sizeof(double));
+    buf = (char *)malloc(cap + 1);
+    if (c.bysym == NULL || c.startoff == NULL || buf == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0, c.nsyms = 0; i < numkeys; i++) {
+        c.startoff[i] = -1;
+        for (j = 0; j <= keyboard[i].lensv; j++) {
+            c.bysym[c.nsyms].sym = keyboard[i].sym[j];
+            c.bysym[c.nsyms].type = j-1;
+            c.bysym[c.nsyms].k = &keyboard[i];
+            if (!utf8) c.direct[keyboard[i].sym[j] & 0xff] = c.bysym[c.nsyms];
+            c.nsyms++;
+        }
+    }
+    qsort(c.bysym, c.nsyms, sizeof(symkey), symcmp);
+
+    // the words of a start key follow the ones of the keys before it
+    for (i = 0; i < lenkeys; i++) {
+        c.startoff[startkeys[i] - keyboard] = off;
+        off += count_words(startkeys[i], minlen, depth);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        chunks[i].out = NULL;
+        chunks[i].outcap = 0;
+    }
+
+    while (!eof && !stop_signal) {
+        // fill the buffer, a line longer than the buffer makes it grow
+        while (len < cap) {
+            r = read(fd, buf + len, cap - len);
+            if (r < 0 && errno == EINTR) {
+                if (stop_signal) break;
+                continue;
+            }
+            if (r < 0) {
+                err = errno;
+                fprintf(stderr, "read() failed: %s\n", strerror(err));
+                exit(1);
+            }
+            if (r == 0) {
+                eof = 1;
+                break;
+            }
+            len += r;
+        }
+        if (eof && len > 0 && buf[len-1] != '\n') buf[len++] = '\n'; // last line
+        for (done = len; done > 0 && buf[done-1] != '\n'; done--);
+        if (done == 0) {
+            if (eof || stop_signal) break;
+            cap *= 2;
+            buf = (char *)realloc(buf, cap + 1);
+            assert(buf != NULL);
+            continue;
+        }
+
+        found += check_batch(&c, buf, done, chunks, nthreads, o);
+
+        memmove(buf, buf + done, len - done);
+        len -= done;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        free(chunks[i].out);
+    }
+    free(buf);
+    free(c.bysym);
+    free(c.startoff);
+
+    return found;
+}
@@ -0,0 +1,28 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWCHECK__
+#define __KBWCHECK__
+
+#include "keyboard.h"
+#include "output.h"
+
+// lines read and checked together, split among the threads
+#define CHECKBATCH (4 << 20)
+
+/* *
+ * Read strings from fd, one per line, and write for each of them a line with
+ * the string, a tab and its index in the output of the run with the given
+ * start keys, minlen and depth (the same numbering as the words written by
+ * dfs() one start key after the other), or "-" if the run doesn't generate
+ * it. Nothing is generated: every character is looked up, every step is
+ * checked against the neighbours and the index comes from word_rank().
+ * Lines are processed in batches by nthreads threads, the output keeps the
+ * input order. dry_run() must have been called with maxdepth >= depth.
+ * Returns the number of strings found.
+ * */
+uint64_t check_words(int fd, key *keyboard, int numkeys, key **startkeys, int lenkeys, int minlen, int depth, int utf8, int nthreads, outbuf *o);
+
+#endif
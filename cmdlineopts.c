@@ -3,21 +3,79 @@
  * Copyright (c) 2024 Infosystem Security s.r.l.
  * See the LICENSE file for full terms.
  * */
+#include <time.h>
+
 #include "cmdlineopts.h"
 #include "logging.h"
+#include "keyboard.h"
+#include "export.h"
+#include "compress.h"
+#include "numa.h"
+#include "sink.h"
+#include "sorted.h"
+#include "composite.h"
 
 void usage(const char *fname)
 {
     fprintf(stderr, "usage: %s\n\
-            -a,--arrangement    keyboard configuration file\n\
+            -a,--arrangement    keyboard configuration file, can be repeated to walk several\n\
+                                keyboards together (each word is written once)\n\
+            -b,--suffix-cache   KiB of memory for blocks of cached word tails, the last levels\n\
+                                are copied from them instead of being walked (default: 0, off)\n\
+            -c,--cache          dry-run cache directory, counters are reused across runs\n\
+            -C,--check          read candidate words from a file (\"-\" for stdin) and write\n\
+                                each of them with its index in the output, or \"-\" if\n\
+                                it is not generated, without generating the words\n\
             -d,--dryrun         dry-run count number of generated words for eack key\n\
+            -D,--daemon         serve jobs from a Unix socket path: each connection sends one\n\
+                                line of options (as on the command line), the words are\n\
+                                sent back on the connection if -o and -p are not given\n\
+            -e,--export         write masks instead of words: \"hcmask\" (hashcat) or \"john\"\n\
             -i,--infinite       pause the process before returning, waiting for a signal\n\
+            -j,--jobs           number of compression (or -C, -r, -y) threads (default: number of cpus)\n\
             -k,--keys           starting keys\n\
             -m,--min            min word length\n\
-            -M,--max            max word length\n\
+            -M,--max            max word length (at most 512)\n\
             -l,--logfile        log file path\n\
+            -n,--numa           run on the cpus and memory of a NUMA node: a node number or\n\
+                                \"auto\" to spread the -S shards over the nodes\n\
+            -o,--output         output sink (default: stdout): a file path or \"file:PATH\",\n\
+                                \"fd:N\", \"unix:PATH\" (a listening socket) or \"shm:NAME\"\n\
+                                (a ring read with kbwread), options follow a comma:\n\
+                                batch=SIZE; file: direct, prealloc=SIZE; unix: sndbuf=SIZE;\n\
+                                shm: size=SIZE (power of 2), wait=USEC\n\
+            -p,--split          write each word length to its own file, \"%%d\" in the path\n\
+                                is replaced by the length (otherwise \".<length>\" is appended)\n\
+            -r,--sample         N[:SEED], write N words drawn uniformly at random (with\n\
+                                replacement) from the words of -k, -m and -M instead of all\n\
+                                of them; the same seed gives the same words (default: logged)\n\
+            -O,--only           characters of the only keys to walk, the other keys of the\n\
+                                layout are disabled (a character selects its whole key)\n\
+            -X,--disable        characters of the keys to leave out of the walks\n\
+            -V,--verify         write to a file a digest (count, order independent and order\n\
+                                dependent hashes) of the words of each start key and of\n\
+                                the whole run, the counts are checked against the dry-run\n\
+            -u,--utf8           keyboard files, keys and restart word are UTF-8 encoded\n\
+            -t,--tag            with several -a, append to each word a tab and the list\n\
+                                of the keyboards it comes from\n\
+            -S,--shard          i/n, only use the start keys with index %% n == i (0-based)\n\
             -s,--stop           stop timer; < 0 error; == 0 no timer set; > 0 number of seconds\n\
             -w,--restart        restart string\n\
+            -P,--pattern        write the combinations of segments joined by '+': walk or\n\
+                                walk{N,M} (walks of N to M characters, -m to -M if not\n\
+                                given), \\d \\l \\u \\s or [SET] with an optional {N,M}\n\
+                                (digits, lower, upper, specials, SET: every string of N to\n\
+                                M of them), (A|B|...) alternatives, @FILE lines of a file,\n\
+                                or a literal; e.g. 'walk{4,6}+\\d{2,4}', 'walk+(!|?|)'\n\
+            -y,--sorted         SIZE (K, M, G) of memory for sorting: the output file of -o is\n\
+                                sorted (as LC_ALL=C sort) without repeated words, with a\n\
+                                sparse index in <output>.idx; sorted runs are spilled to a\n\
+                                directory next to it and merged while the words are generated\n\
+            -x,--combine        digest file written by -V, can be repeated: the parts (shards,\n\
+                                restarted runs) are combined and checked against the\n\
+                                dry-run of -k, the combined digest is the one of a single run\n\
+            -z,--compress       compress the output: gzip, zstd or lz4 with optional \":level\"\n\
+                                with -o a block index is written to <output>.idx\n\
             \n\n\
             Visit\n\
             \thttps://github.com/InfosystemSecurity/Keyboard-Wanderer\n\
@@ -33,7 +91,10 @@ cmdlopts_t init_cmdlopts(void)
 {
     cmdlopts_t ret;
     ret.dryrun = EMPTY_DRYRUN;
-    ret.afpath = EMPTY_PATH;
+    memset(ret.afpath, 0, sizeof(ret.afpath));
+    ret.nafpath = 0;
+    ret.tag = EMPTY_TAG;
+    ret.utf8 = 0;
     ret.infiniterun = EMPTY_INFINITERUN;
     ret.keys = EMPTY_KEYS;
     ret.min = EMPTY_MIN;
@@ -41,6 +102,27 @@ cmdlopts_t init_cmdlopts(void)
     ret.logfpath = EMPTY_PATH;
     ret.timeout = EMPTY_TIMEOUT;
     ret.restart = EMPTY_RESTART;
+    ret.export = EMPTY_EXPORT;
+    ret.outpath = EMPTY_PATH;
+    ret.compress = EMPTY_COMPRESS;
+    ret.clevel = 0;
+    ret.jobs = EMPTY_JOBS;
+    ret.split = EMPTY_PATH;
+    ret.cachedir = EMPTY_PATH;
+    ret.shard = 0;
+    ret.nshard = EMPTY_SHARD;
+    ret.daemon = EMPTY_PATH;
+    ret.check = EMPTY_PATH;
+    ret.sufcache = EMPTY_SUFCACHE;
+    ret.numa = EMPTY_NUMA;
+    ret.verify = EMPTY_PATH;
+    ret.ncombine = 0;
+    ret.sample = EMPTY_SAMPLE;
+    ret.seed = 0;
+    ret.only = EMPTY_KEYS;
+    ret.disable = EMPTY_KEYS;
+    ret.sorted = EMPTY_SORTED;
+    ret.pattern = EMPTY_PATTERN;
 
     return ret;
 }
@@ -49,7 +131,14 @@ cmdlopts_t parse_args(int argc, char *argv[])
 {
     cmdlopts_t ret = init_cmdlopts();
     int c;
-    int i, j;
+    int i, j, n, len;
+    sym_t keys[MAXKEYBOARDKEYS];
+    const char *p;
+    char *end;
+    int seeded = 0;
+    char *pattern = NULL; // --pattern, parsed after -m and -M
+    char errmsg[256];
+    int lmin = 0, lmax = 0; // --compress levels
 
     if (argc <= 0 || argv == 0 || *argv == 0) {
         fprintf(stderr, "Can't parse arguments\n");
@@ -61,6 +150,7 @@ cmdlopts_t parse_args(int argc, char *argv[])
         static struct option long_options[] = {
             {"dryrun", no_argument, 0, 'd'},
             {"arrangement", required_argument, 0, 'a'},
+            {"export", required_argument, 0, 'e'},
             {"infinite", no_argument, 0, 'i'},
             {"keys", required_argument, 0, 'k'},
             {"min", required_argument, 0, 'm'},
@@ -68,31 +158,162 @@ cmdlopts_t parse_args(int argc, char *argv[])
             {"logfile", required_argument, 0, 'l'},
             {"stop", required_argument, 0, 's'},
             {"restart", required_argument, 0, 'w'},
+            {"output", required_argument, 0, 'o'},
+            {"compress", required_argument, 0, 'z'},
+            {"jobs", required_argument, 0, 'j'},
+            {"split", required_argument, 0, 'p'},
+            {"cache", required_argument, 0, 'c'},
+            {"tag", no_argument, 0, 't'},
+            {"utf8", no_argument, 0, 'u'},
+            {"shard", required_argument, 0, 'S'},
+            {"daemon", required_argument, 0, 'D'},
+            {"check", required_argument, 0, 'C'},
+            {"suffix-cache", required_argument, 0, 'b'},
+            {"numa", required_argument, 0, 'n'},
+            {"sample", required_argument, 0, 'r'},
+            {"only", required_argument, 0, 'O'},
+            {"disable", required_argument, 0, 'X'},
+            {"sorted", required_argument, 0, 'y'},
+            {"pattern", required_argument, 0, 'P'},
+            {"verify", required_argument, 0, 'V'},
+            {"combine", required_argument, 0, 'x'},
             {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "a:dik:m:M:l:s:w:", long_options, &option_index);
+        c = getopt_long(argc, argv, "a:b:c:C:dD:e:ij:k:m:M:l:n:o:O:p:P:r:s:S:tuV:w:x:X:y:z:", long_options, &option_index);
 
         if (c == -1) break;
 
         switch(c) {
             case 'a':
-                ret.afpath = strndup(optarg, MAXPATHLEN);
-                if (ret.afpath == NULL) {
+                if (ret.nafpath == MAXARRANGEMENTS) {
+                    fprintf(stderr, "too many keyboard arrangement files, max %d\n", MAXARRANGEMENTS);
+                    exit(1);
+                }
+                ret.afpath[ret.nafpath] = strndup(optarg, MAXPATHLEN);
+                if (ret.afpath[ret.nafpath++] == NULL) {
                     fprintf(stderr, "strndup() error on keyboard arrangement file path\n");
                     usage(argv[0]);
                     exit(1);
                 }
                 break;
 
+            case 'b':
+                ret.sufcache = atoi(optarg);
+                if (ret.sufcache < 0) {
+                    fprintf(stderr, "-b,--suffix-cache should be >= 0\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'V':
+                ret.verify = strndup(optarg, MAXPATHLEN);
+                if (ret.verify == NULL) {
+                    fprintf(stderr, "strndup() error on digest file path\n");
+                    exit(1);
+                }
+                break;
+            case 'x':
+                if (ret.ncombine == MAXDIGESTS) {
+                    fprintf(stderr, "too many digest files, max %d\n", MAXDIGESTS);
+                    exit(1);
+                }
+                ret.combine[ret.ncombine] = strndup(optarg, MAXPATHLEN);
+                if (ret.combine[ret.ncombine++] == NULL) {
+                    fprintf(stderr, "strndup() error on digest file path\n");
+                    exit(1);
+                }
+                break;
+            case 'n':
+                if (strcmp(optarg, "auto") == 0) {
+                    ret.numa = NUMA_AUTO;
+                } else if ((ret.numa = atoi(optarg)) < 0 || ret.numa >= MAXNUMANODES) {
+                    fprintf(stderr, "-n,--numa should be \"auto\" or a node number >= 0 and < %d\n", MAXNUMANODES);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                ret.only = strndup(optarg, MAXKEYBOARDKEYS * MAXSYMLEN);
+                if (ret.only == NULL) {
+                    fprintf(stderr, "strndup() error on keys\n");
+                    exit(1);
+                }
+                break;
+            case 'X':
+                ret.disable = strndup(optarg, MAXKEYBOARDKEYS * MAXSYMLEN);
+                if (ret.disable == NULL) {
+                    fprintf(stderr, "strndup() error on keys\n");
+                    exit(1);
+                }
+                break;
+            case 'P':
+                pattern = optarg; // parsed once -m and -M are known
+                break;
+            case 'y':
+                ret.sorted = parse_size(optarg);
+                if (ret.sorted < SO_MINMEM) {
+                    fprintf(stderr, "-y,--sorted should be a size of at least %dM\n", SO_MINMEM >> 20);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                ret.sample = strtoull(optarg, &end, 10);
+                if (*end == ':') {
+                    ret.seed = strtoull(end + 1, &end, 10);
+                    seeded = 1;
+                }
+                if (ret.sample == 0 || *end != '\0') {
+                    fprintf(stderr, "-r,--sample should be N[:SEED] with N > 0\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                ret.cachedir = strndup(optarg, MAXPATHLEN);
+                if (ret.cachedir == NULL) {
+                    fprintf(stderr, "strndup() error on cache directory\n");
+                    exit(1);
+                }
+                break;
+            case 'C':
+                ret.check = strndup(optarg, MAXPATHLEN);
+                if (ret.check == NULL) {
+                    fprintf(stderr, "strndup() error on check file path\n");
+                    exit(1);
+                }
+                break;
             case 'd':
                 ret.dryrun = 1;
                 break;
+            case 'D':
+                ret.daemon = strndup(optarg, MAXPATHLEN);
+                if (ret.daemon == NULL) {
+                    fprintf(stderr, "strndup() error on daemon socket path\n");
+                    exit(1);
+                }
+                break;
+            case 'S':
+                if (sscanf(optarg, "%d/%d", &ret.shard, &ret.nshard) != 2 || ret.nshard <= 0 || ret.shard < 0 || ret.shard >= ret.nshard) {
+                    fprintf(stderr, "-S,--shard should be i/n with 0 <= i < n\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                ret.export = export_format(optarg);
+                if (ret.export == EXPORT_NONE) {
+                    fprintf(stderr, "unknown export format \"%s\", use \"hcmask\" or \"john\"\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
             case 'i':
                 ret.infiniterun = 1;
                 break;
             case 'k':
-                ret.keys = strndup(optarg, MAXKEYBOARDKEYS);
+                ret.keys = strndup(optarg, MAXKEYBOARDKEYS * MAXSYMLEN);
                 if (ret.keys == NULL) {
                     fprintf(stderr, "strndup() error on keys\n");
                     exit(1);
@@ -104,13 +325,53 @@ cmdlopts_t parse_args(int argc, char *argv[])
             case 'M':
                 ret.max = atoi(optarg);
                 break;
+            case 't':
+                ret.tag = 1;
+                break;
+            case 'u':
+                ret.utf8 = 1;
+                break;
             case 'w':
-                ret.restart = strndup(optarg, MAXWORDLEN);
+                ret.restart = strndup(optarg, MAXWORDLEN * MAXSYMLEN);
                 if (ret.restart == NULL) {
                     fprintf(stderr, "strndup() error on restart word\n");
                     exit(1);
                 }
                 break;
+            case 'o':
+                ret.outpath = strndup(optarg, MAXPATHLEN);
+                if (ret.outpath == NULL) {
+                    fprintf(stderr, "strndup() error on output file path\n");
+                    exit(1);
+                }
+                break;
+            case 'p':
+                ret.split = strndup(optarg, MAXPATHLEN);
+                if (ret.split == NULL) {
+                    fprintf(stderr, "strndup() error on split path\n");
+                    exit(1);
+                }
+                break;
+            case 'z':
+                ret.compress = cz_format(optarg, &ret.clevel);
+                if (ret.compress == CZ_NONE) {
+                    fprintf(stderr, "compression \"%s\" not valid or not available in this build\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                // a bad level would only fail in the compression threads
+                if (cz_levels(ret.compress, &lmin, &lmax) != 0 || ret.clevel < lmin || ret.clevel > lmax) {
+                    fprintf(stderr, "%s compression level should be >= %d and <= %d\n", cz_name(ret.compress), lmin, lmax);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                ret.jobs = atoi(optarg);
+                if (ret.jobs <= 0 || ret.jobs > CZ_MAXTHREADS) {
+                    fprintf(stderr, "-j,--jobs should be > 0 and <= %d\n", CZ_MAXTHREADS);
+                    exit(1);
+                }
+                break;
             case 'l':
                 ret.logfpath = strndup(optarg, MAXPATHLEN);
                 if (ret.logfpath == NULL) {
@@ -132,8 +393,18 @@ cmdlopts_t parse_args(int argc, char *argv[])
         }
     }
     // ignores other parameters
+    // the daemon only needs the log file, -a and -u preload keyboards
+    if (ret.daemon != EMPTY_PATH) {
+        if (ret.logfpath == NULL) {
+            fprintf(stderr, "Option -l, --logfile log file path required\n");
+            usage(argv[0]);
+            exit(1);
+        }
+        return ret;
+    }
+
     // check parameters in case they are still unset
-    if (ret.afpath == NULL) {
+    if (ret.nafpath == 0) {
         fprintf(stderr, "Must select a configuration file (option -a)\n");
         usage(argv[0]);
         exit(1);
@@ -144,15 +415,26 @@ cmdlopts_t parse_args(int argc, char *argv[])
         usage(argv[0]);
         exit(1);
     } else { // validate
-        for (i = 1; ret.keys[i] != '\0'; ++i) {
-            for (j = 0; j < i; ++j) {
-                if (ret.keys[i] == ret.keys[j]) {
-                    fprintf(stderr, "Reapeted initial key (%c) selected! Please avoid repeating the same key\n", ret.keys[i]);
+        n = 0;
+        len = 0;
+        for (p = ret.keys; n < MAXKEYBOARDKEYS && (len = nextsym(p, ret.utf8, &keys[n])) > 0; p += len) {
+            for (j = 0; j < n; ++j) {
+                if (keys[n] == keys[j]) {
+                    fprintf(stderr, "Reapeted initial key (%.*s) selected! Please avoid repeating the same key\n", len, p);
                     exit(1);
                 }
             }
+            n++;
+        }
+        if (len < 0) {
+            fprintf(stderr, "Invalid UTF-8 sequence in keys \"%s\"\n", ret.keys);
+            exit(1);
         }
     }
+    if ((ret.only != NULL && symcount(ret.only, ret.utf8) < 0) || (ret.disable != NULL && symcount(ret.disable, ret.utf8) < 0)) {
+        fprintf(stderr, "Invalid UTF-8 sequence in -O or -X keys\n");
+        exit(1);
+    }
 
     // open logfile
     if (ret.logfpath == NULL) {
@@ -173,6 +455,14 @@ cmdlopts_t parse_args(int argc, char *argv[])
         exit(1);
     }
 
+    // the per-length tables (output buffers, word offsets) have MAXWORDLEN
+    // entries
+    if (ret.max > MAXWORDLEN) {
+        fprintf(stderr, "maximum length -M must be <= %d\n", MAXWORDLEN);
+        usage(argv[0]);
+        exit(1);
+    }
+
     if (ret.max < ret.min) {
         fprintf(stderr, "-m should be <= -M\n");
         usage(argv[0]);
@@ -181,12 +471,110 @@ cmdlopts_t parse_args(int argc, char *argv[])
 
     // restart is an optional argument
     if (ret.restart != NULL) {
-        i = strnlen(ret.restart, MAXWORDLEN);
-        if (i > ret.max || i < ret.min) {
-            fprintf(stderr, "-w word has length %d, it must be >= %d and <= %d\n", i, ret.min, ret.max);
+        i = symcount(ret.restart, ret.utf8);
+        if (i < 0) {
+            fprintf(stderr, "Invalid UTF-8 sequence in restart word \"%s\"\n", ret.restart);
+            exit(1);
+        }
+        // an interrupted run may stop on a prefix shorter than -m
+        if (i > ret.max || i < 1) {
+            fprintf(stderr, "-w word has length %d, it must be >= 1 and <= %d\n", i, ret.max);
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (ret.export != EMPTY_EXPORT && (ret.dryrun || ret.restart != NULL)) {
+        fprintf(stderr, "-e,--export can't be used with -d or -w\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.utf8 && ret.export == EXPORT_HCMASK) {
+        fprintf(stderr, "hashcat masks can't describe multi-byte characters, use -e john with -u\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.nafpath > 1 && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.restart != NULL)) {
+        fprintf(stderr, "multiple -a can't be used with -d, -e or -w\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.split != EMPTY_PATH && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.outpath != EMPTY_PATH)) {
+        fprintf(stderr, "-p,--split can't be used with -d, -e or -o\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // the compressor writes its frames to a plain file descriptor
+    if (ret.compress != EMPTY_COMPRESS && ret.outpath != EMPTY_PATH && (strncmp(ret.outpath, "shm:", 4) == 0 || (strncmp(ret.outpath, "file:", 5) == 0 && strstr(ret.outpath, ",direct") != NULL))) {
+        fprintf(stderr, "-z,--compress can't be used with the shm sink or direct files\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if ((ret.verify != EMPTY_PATH || ret.ncombine > 0) && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.split != EMPTY_PATH || ret.check != EMPTY_PATH || ret.nafpath > 1)) {
+        fprintf(stderr, "-V,--verify and -x,--combine can't be used with -d, -e, -p, -C or multiple -a\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.ncombine > 0 && (ret.verify != EMPTY_PATH || ret.restart != NULL)) {
+        fprintf(stderr, "-x,--combine can't be used with -V or -w\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.numa == NUMA_AUTO && ret.nshard == EMPTY_SHARD) {
+        fprintf(stderr, "-n,--numa auto needs -S to choose the node\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.check != EMPTY_PATH && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.restart != NULL || ret.split != EMPTY_PATH || ret.nafpath > 1)) {
+        fprintf(stderr, "-C,--check can't be used with -d, -e, -w, -p or multiple -a\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (ret.sample != EMPTY_SAMPLE && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.restart != NULL || ret.split != EMPTY_PATH || ret.check != EMPTY_PATH || ret.verify != EMPTY_PATH || ret.ncombine > 0 || ret.nafpath > 1)) {
+        fprintf(stderr, "-r,--sample can't be used with -d, -e, -w, -p, -C, -V, -x or multiple -a\n");
+        usage(argv[0]);
+        exit(1);
+    }
+    // the final merge writes to a plain file, the segments go next to it
+    if (ret.sorted != EMPTY_SORTED && (ret.outpath == EMPTY_PATH || (strchr(ret.outpath, ':') != NULL && strncmp(ret.outpath, "file:", 5) != 0) || strstr(ret.outpath, ",direct") != NULL)) {
+        fprintf(stderr, "-y,--sorted needs -o with a file, without direct\n");
+        usage(argv[0]);
+        exit(1);
+    }
+    if (ret.sorted != EMPTY_SORTED && (ret.dryrun || ret.export != EMPTY_EXPORT || ret.restart != NULL || ret.split != EMPTY_PATH || ret.compress != EMPTY_COMPRESS || ret.check != EMPTY_PATH || ret.ncombine > 0)) {
+        fprintf(stderr, "-y,--sorted can't be used with -d, -e, -w, -p, -z, -C or -x\n");
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (pattern != NULL && (ret.export != EMPTY_EXPORT || ret.restart != NULL || ret.split != EMPTY_PATH || ret.check != EMPTY_PATH || ret.sample != EMPTY_SAMPLE || ret.verify != EMPTY_PATH || ret.ncombine > 0 || ret.nafpath > 1)) {
+        fprintf(stderr, "-P,--pattern can't be used with -e, -w, -p, -C, -r, -V, -x or several -a\n");
+        usage(argv[0]);
+        exit(1);
+    }
+    if (pattern != NULL) {
+        ret.pattern = comp_parse(pattern, ret.min, ret.max, errmsg, sizeof(errmsg));
+        if (ret.pattern == NULL) {
+            fprintf(stderr, "-P,--pattern: %s\n", errmsg);
             usage(argv[0]);
             exit(1);
         }
+        // the keyboards are parsed for the longest walk
+        if (comp_maxwalk(ret.pattern) > ret.max) ret.max = comp_maxwalk(ret.pattern);
+    }
+
+    // the seed is logged, the run can be repeated with it
+    if (ret.sample != EMPTY_SAMPLE && !seeded) {
+        ret.seed = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid();
     }
 
     return ret;
@@ -194,9 +582,13 @@ cmdlopts_t parse_args(int argc, char *argv[])
 
 void free_args(cmdlopts_t *c)
 {
+    int i;
     if (c == NULL) return;
     if (c->keys != NULL) free(c->keys);
-    if (c->afpath != NULL) free(c->afpath);
+    for (i = 0; i < c->nafpath; i++) {
+        free(c->afpath[i]);
+        c->afpath[i] = NULL;
+    }
     if (c->logfpath != NULL) {
         free(c->logfpath);
         c->logfpath = NULL;
@@ -205,19 +597,80 @@ void free_args(cmdlopts_t *c)
         free(c->restart);
         c->restart = NULL;
     }
+    if (c->outpath != NULL) {
+        free(c->outpath);
+        c->outpath = NULL;
+    }
+    if (c->cachedir != NULL) {
+        free(c->cachedir);
+        c->cachedir = NULL;
+    }
+    if (c->split != NULL) {
+        free(c->split);
+        c->split = NULL;
+    }
+    if (c->daemon != NULL) {
+        free(c->daemon);
+        c->daemon = NULL;
+    }
+    if (c->check != NULL) {
+        free(c->check);
+        c->check = NULL;
+    }
+    if (c->only != NULL) {
+        free(c->only);
+        c->only = NULL;
+    }
+    if (c->disable != NULL) {
+        free(c->disable);
+        c->disable = NULL;
+    }
+    if (c->verify != NULL) {
+        free(c->verify);
+        c->verify = NULL;
+    }
+    for (i = 0; i < c->ncombine; i++) {
+        free(c->combine[i]);
+        c->combine[i] = NULL;
+    }
+    c->ncombine = 0;
+    comp_free(c->pattern);
+    c->pattern = NULL;
 }
 
 void log_args(cmdlopts_t opt, FILE *logfile)
 {
+    int i;
     if (logfile == NULL) logfile = stdout;
-    if (opt.afpath != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--arrangement \"%s\"\n", opt.afpath);
+    for (i = 0; i < opt.nafpath; i++) logmessage(LOG_CONT, logfile, "--arrangement \"%s\"\n", opt.afpath[i]);
+    if (opt.utf8 != 0 ) logmessage(LOG_CONT, logfile, "--utf8 \"%d\"\n", opt.utf8);
+    if (opt.tag != EMPTY_TAG ) logmessage(LOG_CONT, logfile, "--tag \"%d\"\n", opt.tag);
     logmessage(LOG_CONT, logfile, "--dryrun \"%d\"\n", opt.dryrun);
     if (opt.infiniterun != EMPTY_INFINITERUN ) logmessage(LOG_CONT, logfile, "--infinite \"%d\"\n", opt.infiniterun);
     if (opt.keys != EMPTY_KEYS ) logmessage(LOG_CONT, logfile, "--keys \"%s\"\n", opt.keys);
+    if (opt.only != EMPTY_KEYS ) logmessage(LOG_CONT, logfile, "--only \"%s\"\n", opt.only);
+    if (opt.disable != EMPTY_KEYS ) logmessage(LOG_CONT, logfile, "--disable \"%s\"\n", opt.disable);
     if (opt.min != EMPTY_MIN ) logmessage(LOG_CONT, logfile, "--min \"%d\"\n", opt.min);
     if (opt.max != EMPTY_MAX ) logmessage(LOG_CONT, logfile, "--max \"%d\"\n", opt.max);
     if (opt.logfpath != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--logfile \"%s\"\n", opt.logfpath);
     if (opt.timeout != EMPTY_TIMEOUT ) logmessage(LOG_CONT, logfile, "--stop \"%d\"\n", opt.timeout);
     if (opt.restart != EMPTY_RESTART ) logmessage(LOG_CONT, logfile, "--restart \"%s\"\n", opt.restart);
+    if (opt.outpath != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--output \"%s\"\n", opt.outpath);
+    if (opt.compress != EMPTY_COMPRESS ) logmessage(LOG_CONT, logfile, "--compress \"%s:%d\"\n", cz_name(opt.compress), opt.clevel);
+    if (opt.cachedir != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--cache \"%s\"\n", opt.cachedir);
+    if (opt.split != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--split \"%s\"\n", opt.split);
+    if (opt.nshard != EMPTY_SHARD ) logmessage(LOG_CONT, logfile, "--shard \"%d/%d\"\n", opt.shard, opt.nshard);
+    if (opt.daemon != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--daemon \"%s\"\n", opt.daemon);
+    if (opt.sufcache != EMPTY_SUFCACHE ) logmessage(LOG_CONT, logfile, "--suffix-cache \"%d\"\n", opt.sufcache);
+    if (opt.numa == NUMA_AUTO) logmessage(LOG_CONT, logfile, "--numa \"auto\"\n");
+    else if (opt.numa != EMPTY_NUMA) logmessage(LOG_CONT, logfile, "--numa \"%d\"\n", opt.numa);
+    if (opt.verify != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--verify \"%s\"\n", opt.verify);
+    for (i = 0; i < opt.ncombine; i++) logmessage(LOG_CONT, logfile, "--combine \"%s\"\n", opt.combine[i]);
+    if (opt.check != EMPTY_PATH ) logmessage(LOG_CONT, logfile, "--check \"%s\"\n", opt.check);
+    if (opt.sample != EMPTY_SAMPLE ) logmessage(LOG_CONT, logfile, "--sample \"%llu:%llu\"\n", opt.sample, opt.seed);
+    if (opt.pattern != EMPTY_PATTERN ) logmessage(LOG_CONT, logfile, "--pattern \"%s\"\n", opt.pattern->spec);
+    if (opt.sorted != EMPTY_SORTED ) logmessage(LOG_CONT, logfile, "--sorted \"%zu\"\n", opt.sorted);
+    if (opt.jobs != EMPTY_JOBS ) logmessage(LOG_CONT, logfile, "--jobs \"%d\"\n", opt.jobs);
+    if (opt.export != EMPTY_EXPORT ) logmessage(LOG_CONT, logfile, "--export \"%s\"\n", opt.export == EXPORT_JOHN ? "john" : "hcmask");
     return;
 }
\ No newline at end of file
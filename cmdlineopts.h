@@ -13,12 +13,17 @@
 #include <stdarg.h>
 #include <getopt.h>
 
+struct composite; // composite.h
+
 #define MAXKEYBOARDKEYS 128
 
 #define MAXPATHLEN 128
+#define MAXARRANGEMENTS 32 // must be <= MAXLAYOUTS
+#define MAXDIGESTS 256 // --combine files
 #define MAXWORDLEN 512
 
 #define EMPTY_PATH NULL
+#define EMPTY_TAG 0
 #define EMPTY_DRYRUN 0
 #define EMPTY_INFINITERUN 0
 #define EMPTY_KEYS NULL
@@ -26,11 +31,23 @@
 #define EMPTY_MAX -1
 #define EMPTY_TIMEOUT -1
 #define EMPTY_RESTART NULL
+#define EMPTY_EXPORT 0
+#define EMPTY_COMPRESS 0
+#define EMPTY_JOBS -1
+#define EMPTY_SHARD 0
+#define EMPTY_SUFCACHE 0
+#define EMPTY_NUMA -1
+#define EMPTY_SAMPLE 0
+#define EMPTY_SORTED 0
+#define EMPTY_PATTERN NULL
 
 
 typedef struct {
     int dryrun; // dryrun flag
-    char *afpath; // keyboard arrangements file path
+    char *afpath[MAXARRANGEMENTS]; // keyboard arrangements file paths
+    int nafpath; // number of -a options
+    int tag; // --tag; append the list of layouts to each word
+    int utf8; // --utf8; keyboard files, keys and restart word are UTF-8 encoded
     int infiniterun; // if != 0 pass it to a call to pause(2) before returning from main
     char *keys; // starting keys - one dfs for each key
     int min; // min length of words to print
@@ -38,6 +55,28 @@ typedef struct {
     char *logfpath; // --logfile; log file full path
     int timeout; // --stop; stop timer; < 0 error, == 0 no timer set, > 0 # sec
     char *restart; // restart string - if not set default to NULL and restart mode is not used
+    int export; // --export; EXPORT_* mask format, EMPTY_EXPORT to generate the words
+    char *outpath; // --output; output file, if not set write to stdout
+    int compress; // --compress; CZ_* compression format
+    int clevel; // compression level
+    int jobs; // --jobs; number of compression threads
+    char *cachedir; // --cache; directory of the dry-run counters cache
+    char *split; // --split; write each word length to its own file, "%d" is replaced by the length
+    int shard; // --shard i/n; only the start keys with index % nshard == shard
+    int nshard; // number of shards, EMPTY_SHARD if not set
+    char *daemon; // --daemon; Unix socket path the jobs are read from
+    char *check; // --check; file of candidate words to look up, "-" for stdin
+    int sufcache; // --suffix-cache; KiB of cached suffix blocks, EMPTY_SUFCACHE disabled
+    char *verify; // --verify; digest file of the written words, one record per start key
+    char *combine[MAXDIGESTS]; // --combine; digest files of the parts of a run
+    int ncombine; // number of --combine files
+    int numa; // --numa; node to run on, NUMA_AUTO to choose it from the shard, EMPTY_NUMA not bound
+    unsigned long long sample; // --sample; number of random words, EMPTY_SAMPLE to write all of them
+    unsigned long long seed; // --sample seed, chosen at parse time if not given
+    char *only; // --only; characters of the keys to walk, the others are disabled
+    char *disable; // --disable; characters of the keys to leave out
+    size_t sorted; // --sorted; bytes of memory for the sorted runs, EMPTY_SORTED for the walk order
+    struct composite *pattern; // --pattern; segments combined with the walks, EMPTY_PATTERN for the walks alone
 } cmdlopts_t;
 
 // fname: program name
@@ -0,0 +1,415 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "composite.h"
+#include "cmdlineopts.h"
+#include "signals.h"
+
+// the hashcat ?s characters
+#define SPECIALS " !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~"
+
+// append the len bytes of w and a newline to the entries of s
+static int addline(compseg *s, size_t *cap, const char *w, size_t len)
+{
+    char *t;
+
+    if (len > COMP_MAXLINE || s->n >= COMP_MAXSET) return -1;
+    while (s->size + len + 1 > *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        if ((t = (char *)realloc(s->text, *cap)) == NULL) {
+            fprintf(stderr, "malloc() error\n");
+            exit(1);
+        }
+        s->text = t;
+    }
+    memcpy(s->text + s->size, w, len);
+    s->text[s->size + len] = '\n';
+    s->size += len + 1;
+    s->n++;
+    if ((int)len > s->maxlen) s->maxlen = len;
+
+    return 0;
+}
+
+// {N} or {N,M} at *p, if any; 0 on success
+static int repeat(const char **p, int *min, int *max, char *err, size_t errlen)
+{
+    char *end;
+    long a, b;
+
+    if (**p != '{') return 0;
+    a = strtol(*p + 1, &end, 10);
+    if (end == *p + 1 || a < 0) goto bad;
+    b = a;
+    if (*end == ',') {
+        b = strtol(end + 1, &end, 10);
+        if (end[-1] == ',') goto bad;
+    }
+    if (*end != '}' || b < a || b > COMP_MAXLINE) goto bad;
+    *p = end + 1;
+    *min = a;
+    *max = b;
+    return 0;
+
+bad:
+    snprintf(err, errlen, "bad repeat at \"%s\", expected {N} or {N,M} with N <= M <= %d", *p, COMP_MAXLINE);
+    return -1;
+}
+
+// [SET] at *p, the characters go to s->set without repetitions
+static int charset(const char **p, compseg *s, char *err, size_t errlen)
+{
+    const unsigned char *q = (const unsigned char *)*p + 1;
+    char seen[256] = {0};
+    int c, last;
+
+    while (*q != ']') {
+        if (*q == '\0') {
+            snprintf(err, errlen, "missing ] in \"%s\"", *p);
+            return -1;
+        }
+        if (*q == '\\' && q[1] != '\0') q++;
+        c = last = *q++;
+        // a range, unless the '-' is the last character of the set
+        if (q[0] == '-' && q[1] != ']' && q[1] != '\0') {
+            q++;
+            if (*q == '\\' && q[1] != '\0') q++;
+            last = *q++;
+            if (last < c) {
+                snprintf(err, errlen, "bad range %c-%c in \"%s\"", c, last, *p);
+                return -1;
+            }
+        }
+        for (; c <= last; c++) {
+            if (!seen[c]) s->set[s->nset++] = c;
+            seen[c] = 1;
+        }
+    }
+    if (s->nset == 0) {
+        snprintf(err, errlen, "empty set in \"%s\"", *p);
+        return -1;
+    }
+    *p = (const char *)q + 1;
+
+    return 0;
+}
+
+// every string of min to max characters of s->set, the last one varying
+// the fastest
+static int mask(compseg *s, char *err, size_t errlen)
+{
+    int idx[COMP_MAXLINE];
+    char w[COMP_MAXLINE];
+    size_t cap = 0;
+    double n = 0, m;
+    int l, i;
+
+    for (l = s->min; l <= s->max; l++) {
+        for (m = 1, i = 0; i < l; i++) m *= s->nset;
+        n += m;
+    }
+    if (n > COMP_MAXSET) {
+        snprintf(err, errlen, "%s has %.0lf strings, at most %d can be combined", s->spec, n, COMP_MAXSET);
+        return -1;
+    }
+
+    for (l = s->min; l <= s->max; l++) {
+        for (i = 0; i < l; i++) {
+            idx[i] = 0;
+            w[i] = s->set[0];
+        }
+        do {
+            addline(s, &cap, w, l);
+            for (i = l - 1; i >= 0 && ++idx[i] == s->nset; i--) {
+                idx[i] = 0;
+                w[i] = s->set[0];
+            }
+            if (i >= 0) w[i] = s->set[idx[i]];
+        } while (i >= 0);
+    }
+
+    return 0;
+}
+
+// literal text up to one of the stop characters, '\' escaped, into w
+static int literal(const char **p, const char *stop, char *w, size_t *len)
+{
+    const char *q = *p;
+
+    *len = 0;
+    while (*q != '\0' && strchr(stop, *q) == NULL) {
+        if (*q == '\\' && q[1] != '\0') q++;
+        if (*len == COMP_MAXLINE) return -1;
+        w[(*len)++] = *q++;
+    }
+    *p = q;
+
+    return 0;
+}
+
+// the lines of a file, a missing newline at the end is added
+static int dictionary(compseg *s, const char *path, char *err, size_t errlen)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t lcap = 0, cap = 0;
+    ssize_t len;
+    uint64_t nline = 0;
+    int ret = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        snprintf(err, errlen, "can't open \"%s\": %s", path, strerror(errno));
+        return -1;
+    }
+    while ((len = getline(&line, &lcap, f)) > 0) {
+        nline++;
+        if (line[len-1] == '\n') len--;
+        if (addline(s, &cap, line, len) != 0) {
+            snprintf(err, errlen, "%s:%llu: lines must be at most %d bytes, files at most %d lines", path, (unsigned long long)nline, COMP_MAXLINE, COMP_MAXSET);
+            ret = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    return ret;
+}
+
+// one segment at *p, up to the next '+' or the end
+static int segment(const char **p, compseg *s, int minlen, int maxlen, char *err, size_t errlen)
+{
+    const char *q = *p;
+    char w[COMP_MAXLINE];
+    char path[MAXPATHLEN+1];
+    size_t len, cap = 0;
+
+    if (strncmp(q, "walk", 4) == 0 && (q[4] == '{' || q[4] == '+' || q[4] == '\0')) {
+        s->type = COMP_WALK;
+        s->min = minlen;
+        s->max = maxlen;
+        q += 4;
+        if (repeat(&q, &s->min, &s->max, err, errlen) != 0) return -1;
+        if (s->min < 1 || s->max > MAXWORDLEN) {
+            snprintf(err, errlen, "walk lengths must be >= 1 and <= %d", MAXWORDLEN);
+            return -1;
+        }
+    } else if ((q[0] == '\\' && q[1] != '\0' && strchr("dlus", q[1]) != NULL) || q[0] == '[') {
+        s->type = COMP_MASK;
+        s->min = s->max = 1;
+        if (q[0] == '[') {
+            if (charset(&q, s, err, errlen) != 0) return -1;
+        } else {
+            switch (q[1]) {
+                case 'd': strcpy(s->set, "0123456789"); break;
+                case 'l': strcpy(s->set, "abcdefghijklmnopqrstuvwxyz"); break;
+                case 'u': strcpy(s->set, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"); break;
+                default: strcpy(s->set, SPECIALS); break;
+            }
+            s->nset = strlen(s->set);
+            q += 2;
+        }
+        if (repeat(&q, &s->min, &s->max, err, errlen) != 0) return -1;
+    } else if (q[0] == '(') {
+        s->type = COMP_LIST;
+        do {
+            q++;
+            if (literal(&q, "|)", w, &len) != 0 || addline(s, &cap, w, len) != 0) {
+                snprintf(err, errlen, "alternatives must be at most %d bytes", COMP_MAXLINE);
+                return -1;
+            }
+        } while (*q == '|');
+        if (*q != ')') {
+            snprintf(err, errlen, "missing ) in \"%s\"", *p);
+            return -1;
+        }
+        q++;
+    } else if (q[0] == '@') {
+        s->type = COMP_DICT;
+        len = strcspn(q + 1, "+");
+        if (len == 0 || len > MAXPATHLEN) {
+            snprintf(err, errlen, "bad dictionary path in \"%s\"", *p);
+            return -1;
+        }
+        memcpy(path, q + 1, len);
+        path[len] = '\0';
+        q += 1 + len;
+        if (dictionary(s, path, err, errlen) != 0) return -1;
+    } else {
+        s->type = COMP_LIST;
+        if (literal(&q, "+", w, &len) != 0) {
+            snprintf(err, errlen, "literals must be at most %d bytes", COMP_MAXLINE);
+            return -1;
+        }
+        if (len == 0) {
+            snprintf(err, errlen, "empty segment at \"%s\"", *p);
+            return -1;
+        }
+        addline(s, &cap, w, len);
+    }
+
+    len = q - *p < (int)sizeof(s->spec) - 1 ? q - *p : (int)sizeof(s->spec) - 1;
+    memcpy(s->spec, *p, len);
+    s->spec[len] = '\0';
+    *p = q;
+
+    if (s->type == COMP_MASK) return mask(s, err, errlen);
+    return 0;
+}
+
+composite *comp_parse(const char *spec, int minlen, int maxlen, char *err, size_t errlen)
+{
+    composite *c;
+    const char *p = spec;
+
+    assert(spec != NULL);
+
+    c = (composite *)calloc(1, sizeof(composite));
+    if (c == NULL || (c->spec = strdup(spec)) == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+
+    for (;;) {
+        if (c->nsegs == COMP_MAXSEGS) {
+            snprintf(err, errlen, "at most %d segments", COMP_MAXSEGS);
+            goto bad;
+        }
+        if (segment(&p, &c->seg[c->nsegs++], minlen, maxlen, err, errlen) != 0) goto bad;
+        if (*p == '\0') break;
+        if (*p != '+') {
+            snprintf(err, errlen, "expected + at \"%s\"", p);
+            goto bad;
+        }
+        p++;
+    }
+
+    return c;
+
+bad:
+    comp_free(c);
+    return NULL;
+}
+
+int comp_maxwalk(const composite *c)
+{
+    int i, max = 0;
+
+    for (i = 0; i < c->nsegs; i++) {
+        if (c->seg[i].type == COMP_WALK && c->seg[i].max > max) max = c->seg[i].max;
+    }
+
+    return max;
+}
+
+int comp_setwalk(compseg *s, int fd, size_t size)
+{
+    const char *line, *end, *nl;
+
+    assert(s->type == COMP_WALK && s->text == NULL);
+
+    s->n = 0;
+    s->maxlen = 0;
+    s->size = size;
+    if (size == 0) return 0;
+    s->text = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s->text == MAP_FAILED) {
+        s->text = NULL;
+        return -1;
+    }
+    s->mapped = 1;
+    madvise(s->text, size, MADV_SEQUENTIAL);
+
+    end = s->text + size;
+    for (line = s->text; line < end; line = nl + 1) {
+        if ((nl = memchr(line, '\n', end - line)) == NULL) return -1;
+        if (nl - line > s->maxlen) s->maxlen = nl - line;
+        s->n++;
+    }
+
+    return 0;
+}
+
+typedef struct emitter {
+    const composite *c;
+    outbuf *o;
+    char *word; // the entries of the outer segments
+    uint64_t n;
+} emitter;
+
+static void emit(emitter *e, int i, size_t plen)
+{
+    const compseg *s = &e->c->seg[i];
+    const char *line, *end = s->text + s->size, *nl;
+    size_t len;
+    char *p;
+
+    if (i == e->c->nsegs - 1) {
+        // the words: the prefix and a line with its newline
+        for (line = s->text; line < end && !stop_signal; line = nl + 1) {
+            nl = memchr(line, '\n', end - line);
+            len = nl - line + 1;
+            p = out_reserve(e->o, plen + len);
+            memcpy(p, e->word, plen);
+            memcpy(p + plen, line, len);
+            e->o->len += plen + len;
+            e->n++;
+        }
+        return;
+    }
+
+    for (line = s->text; line < end && !stop_signal; line = nl + 1) {
+        nl = memchr(line, '\n', end - line);
+        len = nl - line;
+        memcpy(e->word + plen, line, len);
+        emit(e, i + 1, plen + len);
+    }
+}
+
+uint64_t comp_emit(const composite *c, outbuf *o)
+{
+    emitter e;
+    size_t size = 1;
+    int i;
+
+    assert(c != NULL && o != NULL);
+
+    for (i = 0; i < c->nsegs; i++) size += c->seg[i].maxlen;
+    e.c = c;
+    e.o = o;
+    e.n = 0;
+    if ((e.word = (char *)malloc(size)) == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    emit(&e, 0, 0);
+    free(e.word);
+
+    return e.n;
+}
+
+void comp_free(composite *c)
+{
+    compseg *s;
+    int i;
+
+    if (c == NULL) return;
+    for (i = 0; i < c->nsegs; i++) {
+        s = &c->seg[i];
+        if (s->shared || s->text == NULL) continue;
+        if (s->mapped) munmap(s->text, s->size);
+        else free(s->text);
+    }
+    free(c->spec);
+    free(c);
+}
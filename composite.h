@@ -0,0 +1,89 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWCOMPOSITE__
+#define __KBWCOMPOSITE__
+
+#include <stdint.h>
+
+#include "output.h"
+
+// segments of a pattern
+#define COMP_MAXSEGS 16
+
+// longest entry of a segment (a literal, a dictionary line, a mask), bytes
+#define COMP_MAXLINE 256
+
+// entries of a mask, list or dictionary segment, they are kept in memory
+#define COMP_MAXSET (1 << 24)
+
+// segment types
+#define COMP_WALK 0 // the words of the keyboard walk, min to max characters
+#define COMP_MASK 1 // every string of min to max characters of a set
+#define COMP_LIST 2 // literal alternatives, a single literal is a list of one
+#define COMP_DICT 3 // the lines of a file
+
+/* *
+ * A segment holds its entries as '\n'-terminated lines in text, in the order
+ * they are combined. The walk segments are filled by the caller (the words
+ * written by dfs() to a temporary file, mapped), the others by comp_parse().
+ * Two walk segments with the same lengths share the text of the first one.
+ * */
+typedef struct compseg {
+    int type;
+    int min, max; // lengths in characters (walk and mask)
+    char set[256]; // mask characters, in order
+    int nset;
+    char *text;
+    size_t size; // bytes of text
+    uint64_t n; // entries
+    int maxlen; // longest entry, bytes without the '\n'
+    int mapped; // text is a mapping of size bytes, otherwise malloc()ed
+    int shared; // text belongs to another segment
+    char spec[64]; // the segment as written in the pattern, for the logs
+} compseg;
+
+typedef struct composite {
+    char *spec;
+    int nsegs;
+    compseg seg[COMP_MAXSEGS];
+} composite;
+
+/* *
+ * Parse a pattern: segments joined by '+', each one of
+ *   walk, walk{N}, walk{N,M}  words of the walk (minlen to maxlen characters
+ *                             for a plain walk), N >= 1
+ *   \d \l \u \s [SET]         digits, lowercase, uppercase, specials (the
+ *                             hashcat ?s set) or the characters of SET
+ *                             (ranges as a-z), optionally followed by {N} or
+ *                             {N,M}: every string of N to M of them, N >= 0
+ *   (A|B|...)                 literal alternatives, empty ones are allowed
+ *   @PATH                     the lines of a file
+ *   anything else             a literal
+ * '\' escapes the next character in literals, alternatives and sets.
+ * The entries of the mask, list and dictionary segments are built here.
+ * Returns NULL after writing a message in err.
+ * */
+composite *comp_parse(const char *spec, int minlen, int maxlen, char *err, size_t errlen);
+
+// the longest walk of the pattern, 0 if there is none
+int comp_maxwalk(const composite *c);
+
+// use the size bytes at fd (the words of a walk, one per line) as the
+// entries of s, 0 on success
+int comp_setwalk(compseg *s, int fd, size_t size);
+
+/* *
+ * Write the cartesian product of the segments, the first one varying the
+ * slowest. The prefix made of the entries of the outer segments is kept in
+ * a buffer and only the bytes after the segment that changed are rewritten:
+ * each word of the last segment is a copy of the prefix and of its line.
+ * Stops if stop_signal is set. Returns the number of written words.
+ * */
+uint64_t comp_emit(const composite *c, outbuf *o);
+
+void comp_free(composite *c);
+
+#endif
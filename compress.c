@@ -0,0 +1,433 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+
+#ifdef KBW_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KBW_ZSTD
+#include <zstd.h>
+#endif
+#ifdef KBW_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "compress.h"
+#include "signals.h"
+
+int cz_format(const char *spec, int *level)
+{
+    const char *colon;
+    size_t len;
+    int format = CZ_NONE;
+
+    if (spec == NULL || level == NULL) return CZ_NONE;
+
+    colon = strchr(spec, ':');
+    len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+#ifdef KBW_ZLIB
+    if (len == 4 && strncmp(spec, "gzip", len) == 0) format = CZ_GZIP;
+#endif
+#ifdef KBW_ZSTD
+    if (len == 4 && strncmp(spec, "zstd", len) == 0) format = CZ_ZSTD;
+#endif
+#ifdef KBW_LZ4
+    if (len == 3 && strncmp(spec, "lz4", len) == 0) format = CZ_LZ4;
+#endif
+
+    // default levels
+    switch (format) {
+        case CZ_GZIP: *level = 6; break;
+        case CZ_ZSTD: *level = 3; break;
+        case CZ_LZ4: *level = 0; break;
+        default: return CZ_NONE;
+    }
+    if (colon != NULL) {
+        char *end;
+        long l;
+
+        errno = 0;
+        l = strtol(colon+1, &end, 10);
+        if (end == colon+1 || *end != '\0' || errno != 0 || l < INT_MIN || l > INT_MAX) return CZ_NONE;
+        *level = (int)l;
+    }
+
+    return format;
+}
+
+int cz_levels(int format, int *min, int *max)
+{
+    switch (format) {
+#ifdef KBW_ZLIB
+        case CZ_GZIP:
+            *min = Z_NO_COMPRESSION;
+            *max = Z_BEST_COMPRESSION;
+            return 0;
+#endif
+#ifdef KBW_ZSTD
+        case CZ_ZSTD:
+            *min = 1;
+            *max = ZSTD_maxCLevel();
+            return 0;
+#endif
+#ifdef KBW_LZ4
+        case CZ_LZ4:
+            // 0 is the fast mode, 3 and up the HC one
+            *min = 0;
+            *max = LZ4F_compressionLevel_max();
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+const char *cz_name(int format)
+{
+    switch (format) {
+        case CZ_GZIP: return "gzip";
+        case CZ_ZSTD: return "zstd";
+        case CZ_LZ4: return "lz4";
+        default: return "none";
+    }
+}
+
+const char *cz_ext(int format)
+{
+    switch (format) {
+        case CZ_GZIP: return ".gz";
+        case CZ_ZSTD: return ".zst";
+        case CZ_LZ4: return ".lz4";
+        default: return "";
+    }
+}
+
+// upper bound of the compressed size of a len bytes block
+static size_t cz_bound(int format, size_t len)
+{
+    switch (format) {
+#ifdef KBW_ZLIB
+        case CZ_GZIP:
+            // deflateBound() plus the gzip header and trailer
+            return compressBound(len) + 32;
+#endif
+#ifdef KBW_ZSTD
+        case CZ_ZSTD:
+            return ZSTD_compressBound(len);
+#endif
+#ifdef KBW_LZ4
+        case CZ_LZ4:
+            // the frame header also stores the content size
+            return LZ4F_compressFrameBound(len, NULL) + 16;
+#endif
+        default:
+            return len;
+    }
+}
+
+// compress a block into a self-contained member/frame, returns 0 on success
+static int cz_block(int format, int level, struct czslot *sl)
+{
+#ifdef KBW_ZLIB
+    z_stream zs;
+    int ret;
+#endif
+#ifdef KBW_ZSTD
+    size_t zret;
+#endif
+#ifdef KBW_LZ4
+    LZ4F_preferences_t prefs;
+    size_t lret;
+#endif
+
+    switch (format) {
+#ifdef KBW_ZLIB
+        case CZ_GZIP:
+            memset(&zs, 0, sizeof(zs));
+            // 15 + 16: max window, gzip wrapper
+            if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+            zs.next_in = (Bytef *)sl->in;
+            zs.avail_in = sl->inlen;
+            zs.next_out = (Bytef *)sl->out;
+            zs.avail_out = sl->outcap;
+            ret = deflate(&zs, Z_FINISH);
+            sl->outlen = sl->outcap - zs.avail_out;
+            deflateEnd(&zs);
+            return ret == Z_STREAM_END ? 0 : -1;
+#endif
+#ifdef KBW_ZSTD
+        case CZ_ZSTD:
+            zret = ZSTD_compress(sl->out, sl->outcap, sl->in, sl->inlen, level);
+            if (ZSTD_isError(zret)) return -1;
+            sl->outlen = zret;
+            return 0;
+#endif
+#ifdef KBW_LZ4
+        case CZ_LZ4:
+            memset(&prefs, 0, sizeof(prefs));
+            prefs.compressionLevel = level;
+            prefs.frameInfo.contentSize = sl->inlen;
+            lret = LZ4F_compressFrame(sl->out, sl->outcap, sl->in, sl->inlen, &prefs);
+            if (LZ4F_isError(lret)) return -1;
+            sl->outlen = lret;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+static void *cz_worker(void *arg)
+{
+    czstream *z = (czstream *)arg;
+    struct czslot *sl;
+
+    pthread_mutex_lock(&z->lock);
+    while (1) {
+        sl = &z->slots[z->next_compress % z->nslots];
+        if (z->next_compress < z->next_submit && sl->state == CZ_READY) {
+            sl->state = CZ_BUSY;
+            z->next_compress++;
+            pthread_mutex_unlock(&z->lock);
+
+            if (cz_block(z->format, z->level, sl) != 0) {
+                fprintf(stderr, "%s compression failed\n", cz_name(z->format));
+                exit(1);
+            }
+
+            pthread_mutex_lock(&z->lock);
+            sl->state = CZ_DONE;
+            pthread_cond_broadcast(&z->cond);
+            continue;
+        }
+        if (z->closing && z->next_compress == z->next_submit) break;
+        pthread_cond_wait(&z->cond, &z->lock);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    return NULL;
+}
+
+// write blocks in submission order and keep the index
+static void *cz_writer(void *arg)
+{
+    czstream *z = (czstream *)arg;
+    struct czslot *sl;
+    size_t off, wlen;
+    ssize_t ret;
+    sigset_t set;
+
+    // the stop signals interrupt a write() to a stalled reader (the handlers
+    // have no SA_RESTART), the other ones are left to the generator thread
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    pthread_mutex_lock(&z->lock);
+    while (1) {
+        sl = &z->slots[z->next_write % z->nslots];
+        if (z->next_write < z->next_submit && sl->state == CZ_DONE) {
+            pthread_mutex_unlock(&z->lock);
+
+            // after an error the blocks are dropped, the generator isn't
+            // left waiting for a free slot
+            for (off = 0; off < sl->outlen && !z->error; off += ret) {
+                ret = write(z->fd, sl->out + off, sl->outlen - off);
+                if (ret < 0 && errno == EINTR && !stop_signal) {
+                    ret = 0;
+                    continue;
+                }
+                // a stop signal interrupted a write to a stalled reader
+                // (EINTR or a short write), or the write failed
+                if (ret < 0 || (stop_signal && ret < (ssize_t)(sl->outlen - off))) {
+                    z->error = 1;
+                    break;
+                }
+            }
+            if (z->idx != NULL && !z->error) {
+                // first word of the block
+                for (wlen = 0; wlen < sl->inlen && sl->in[wlen] != '\n'; wlen++);
+                fprintf(z->idx, "%lu\t%lu\t%lu\t%.*s\n", z->offset, sl->outlen, sl->inlen, (int)wlen, sl->in);
+            }
+            z->offset += sl->outlen;
+
+            pthread_mutex_lock(&z->lock);
+            sl->state = CZ_EMPTY;
+            z->next_write++;
+            pthread_cond_broadcast(&z->cond);
+            continue;
+        }
+        if (z->closing && z->next_write == z->next_submit) break;
+        pthread_cond_wait(&z->cond, &z->lock);
+    }
+    z->written = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+
+    return NULL;
+}
+
+/* *
+ * Wait for the writer (z->lock held). A stop signal received by the
+ * generator thread doesn't interrupt the writer blocked on a stalled reader:
+ * after 100 ms without news it is sent again to the writer.
+ * */
+static void cz_wait(czstream *z)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait(&z->cond, &z->lock, &ts) == ETIMEDOUT && stop_signal && !z->written) {
+        pthread_kill(z->writer, stop_signal);
+    }
+}
+
+czstream *cz_open(int format, int level, int fd, const char *idxpath, int nthreads, size_t bufsize)
+{
+    czstream *z;
+    sigset_t set, oldset;
+    off_t pos;
+    int i;
+
+    assert(format != CZ_NONE);
+    assert(bufsize > 0);
+
+    if (nthreads <= 0) nthreads = 1;
+    if (nthreads > CZ_MAXTHREADS) nthreads = CZ_MAXTHREADS;
+
+    z = (czstream *)calloc(1, sizeof(czstream));
+    if (z == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    z->format = format;
+    z->level = level;
+    z->fd = fd;
+    z->nthreads = nthreads;
+
+    // when appending to an existing file the index refers to absolute offsets
+    pos = lseek(fd, 0, SEEK_END);
+    z->offset = pos > 0 ? pos : 0;
+
+    if (idxpath != NULL) {
+        z->idx = fopen(idxpath, z->offset > 0 ? "a" : "w");
+        if (z->idx == NULL) {
+            fprintf(stderr, "Can't open index file \"%s\"\n", idxpath);
+            exit(1);
+        }
+    }
+
+    z->nslots = nthreads * CZ_SLOTSPERTHREAD;
+    z->slots = (struct czslot *)calloc(z->nslots, sizeof(struct czslot));
+    if (z->slots == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0; i < z->nslots; i++) {
+        z->slots[i].incap = bufsize;
+        z->slots[i].in = (char *)malloc(bufsize);
+        z->slots[i].outcap = cz_bound(format, bufsize);
+        z->slots[i].out = (char *)malloc(z->slots[i].outcap);
+        if (z->slots[i].in == NULL || z->slots[i].out == NULL) {
+            fprintf(stderr, "malloc() error\n");
+            exit(1);
+        }
+        z->slots[i].state = CZ_EMPTY;
+    }
+
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+
+    // signals are handled by the generator thread only
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&z->threads[i], NULL, cz_worker, z) != 0) {
+            fprintf(stderr, "pthread_create() error\n");
+            exit(1);
+        }
+    }
+    if (pthread_create(&z->writer, NULL, cz_writer, z) != 0) {
+        fprintf(stderr, "pthread_create() error\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return z;
+}
+
+char *cz_submit(czstream *z, char *buf, size_t len)
+{
+    struct czslot *sl;
+    char *ret;
+
+    assert(z != NULL && buf != NULL);
+    if (len == 0) return buf;
+
+    pthread_mutex_lock(&z->lock);
+    sl = &z->slots[z->next_submit % z->nslots];
+    while (sl->state != CZ_EMPTY) {
+        cz_wait(z);
+    }
+    ret = sl->in;
+    sl->in = buf;
+    sl->inlen = len;
+    sl->state = CZ_READY;
+    z->next_submit++;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+
+    return ret;
+}
+
+int cz_close(czstream *z)
+{
+    int i, err;
+
+    if (z == NULL) return 0;
+
+    pthread_mutex_lock(&z->lock);
+    z->closing = 1;
+    pthread_cond_broadcast(&z->cond);
+    while (!z->written) {
+        cz_wait(z);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    for (i = 0; i < z->nthreads; i++) {
+        pthread_join(z->threads[i], NULL);
+    }
+    pthread_join(z->writer, NULL);
+
+    if (z->idx != NULL) fclose(z->idx);
+    for (i = 0; i < z->nslots; i++) {
+        free(z->slots[i].in);
+        free(z->slots[i].out);
+    }
+    free(z->slots);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->cond);
+    err = z->error;
+    free(z);
+
+    return err ? -1 : 0;
+}
@@ -0,0 +1,97 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWCOMPRESS__
+#define __KBWCOMPRESS__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* compression formats, available ones depend on build flags */
+#define CZ_NONE 0
+#define CZ_GZIP 1 // needs KBW_ZLIB
+#define CZ_ZSTD 2 // needs KBW_ZSTD
+#define CZ_LZ4 3 // needs KBW_LZ4
+
+// max number of compression threads
+#define CZ_MAXTHREADS 64
+
+// number of blocks in flight for each compression thread
+#define CZ_SLOTSPERTHREAD 2
+
+// slot states
+#define CZ_EMPTY 0
+#define CZ_READY 1 // filled by the generator, waiting for a thread
+#define CZ_BUSY 2 // being compressed
+#define CZ_DONE 3 // compressed, waiting to be written
+
+struct czslot {
+    char *in; // uncompressed block, only complete lines
+    size_t inlen;
+    size_t incap;
+    char *out; // compressed block
+    size_t outlen;
+    size_t outcap;
+    int state;
+};
+
+/* *
+ * Compressed output stream. Blocks coming from the output buffer are
+ * compressed independently by a pool of threads, each one as a complete
+ * gzip member / zstd frame / lz4 frame, and written in order by a writer
+ * thread. The concatenation is a valid file for the standard tools and each
+ * block can be decompressed on its own starting from the offset recorded
+ * in the index (one line per block: offset, compressed size, uncompressed
+ * size, first word).
+ * */
+typedef struct czstream {
+    int format; // CZ_*
+    int level; // compression level, format dependent
+    int fd; // destination
+    FILE *idx; // block index, NULL if not required
+    uint64_t offset; // offset of the next block in fd
+    int nthreads;
+    pthread_t threads[CZ_MAXTHREADS];
+    pthread_t writer;
+    int nslots;
+    struct czslot *slots;
+    uint64_t next_submit; // next slot to be filled
+    uint64_t next_compress; // next slot to be compressed
+    uint64_t next_write; // next slot to be written
+    int closing;
+    int error; // set by the writer when fd can't be written anymore
+    int written; // set by the writer when it ends
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} czstream;
+
+// parse "format[:level]", returns CZ_NONE if not valid or not available
+// in this build; the level is not checked, see cz_levels()
+int cz_format(const char *spec, int *level);
+// the valid levels of a format, 0 on success
+int cz_levels(int format, int *min, int *max);
+const char *cz_name(int format);
+// default file name extension for format (".gz", ".zst", ".lz4")
+const char *cz_ext(int format);
+
+// bufsize: allocation size of the buffers swapped with cz_submit(), it is
+// also the max uncompressed block size
+// idxpath: block index path, NULL to disable the index
+czstream *cz_open(int format, int level, int fd, const char *idxpath, int nthreads, size_t bufsize);
+
+/* *
+ * Hand the len bytes in buf to the compressor. buf must have been allocated
+ * with malloc() and must be bufsize bytes long, the stream takes
+ * ownership of it and returns an empty buffer of the same size to be used
+ * for the next block.
+ * */
+char *cz_submit(czstream *z, char *buf, size_t len);
+
+// wait for all the blocks to be written, stop the threads and release z
+// (fd is not closed). Returns 0 on success, -1 if some block was not written
+int cz_close(czstream *z);
+
+#endif
@@ -0,0 +1,309 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "patterns.h"
+#include "logging.h"
+#include "signals.h"
+
+extern FILE *flog;
+
+typedef struct cached {
+    char path[MAXPATHLEN+1];
+    int utf8;
+    time_t mtime; // to notice a changed file
+    off_t size;
+    key *keys; // NULL if the entry is free
+    int numkeys;
+    unsigned long lastuse;
+} cached;
+
+// what a child process has to run
+typedef struct jobctx {
+    jobfn_t job;
+    cmdlopts_t *opt;
+    key **keyboards;
+    int *numkeys;
+    int argc; // job options, for the validation
+    char **argv;
+} jobctx;
+
+static cached cache[MAXCACHED];
+static unsigned long usecnt;
+
+static void cache_free(cached *c)
+{
+    if (c->keys == NULL) return;
+    free(c->keys);
+    c->keys = NULL;
+}
+
+/* *
+ * Look for the keyboard in path. If it is not cached (or the file changed)
+ * and load != 0 it is parsed and cached, replacing the least recently used
+ * entry when the cache is full. parseFile() exits on a wrong file.
+ * Returns NULL if the keyboard is not cached and load == 0 or if the file
+ * can't be accessed.
+ * */
+static cached *cache_get(const char *path, int utf8, int load)
+{
+    struct stat st;
+    cached *c = NULL;
+    int i;
+
+    if (stat(path, &st) != 0) return NULL;
+
+    for (i = 0; i < MAXCACHED; i++) {
+        if (cache[i].keys == NULL) {
+            if (c == NULL || c->keys != NULL) c = &cache[i];
+            continue;
+        }
+        if (cache[i].utf8 == utf8 && strcmp(cache[i].path, path) == 0) {
+            if (cache[i].mtime == st.st_mtime && cache[i].size == st.st_size) {
+                cache[i].lastuse = ++usecnt;
+                return &cache[i];
+            }
+            c = &cache[i]; // stale, reload in place
+            break;
+        }
+        if (c == NULL || (c->keys != NULL && cache[i].lastuse < c->lastuse)) c = &cache[i];
+    }
+    if (!load) return NULL;
+
+    cache_free(c);
+    // always allocate the counters, the jobs may need them up to any length
+    c->keys = parseFile(path, &c->numkeys, MAXWORDLEN, utf8);
+    strncpy(c->path, path, MAXPATHLEN);
+    c->path[MAXPATHLEN] = '\0';
+    c->utf8 = utf8;
+    c->mtime = st.st_mtime;
+    c->size = st.st_size;
+    c->lastuse = ++usecnt;
+    logmessage(LOG_CONT, flog, "Keyboard \"%s\" loaded, %d keys\n", path, c->numkeys);
+
+    return c;
+}
+
+// read one line from fd, without the newline; returns its length or -1
+static int read_line(int fd, char *buf, int size)
+{
+    int n = 0;
+    ssize_t r;
+
+    while (n < size-1) {
+        r = read(fd, buf+n, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        if (buf[n] == '\n') break;
+        n++;
+    }
+    buf[n] = '\0';
+    if (n > 0 && buf[n-1] == '\r') buf[--n] = '\0';
+    return r < 0 ? -1 : n;
+}
+
+// split line in place, argv[0] is the program name; returns argc or -1
+static int split_args(char *line, char **argv, int maxargs)
+{
+    int argc = 1;
+    char *p = line;
+
+    argv[0] = "kbw";
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+        if (argc == maxargs-1) return -1;
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            while (*p != '\0' && *p != '"') p++;
+        } else {
+            argv[argc++] = p;
+            while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+        }
+        if (*p != '\0') *p++ = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// fork, run f in the child with stdout and stderr on conn, wait for it
+static int run_child(int lfd, int conn, int (*f)(jobctx *), jobctx *j)
+{
+    pid_t pid;
+    int status, err;
+
+    fflush(flog);
+    pid = fork();
+    if (pid < 0) {
+        err = errno;
+        logmessage(LOG_CONT, flog, "fork() failed: %s\n", strerror(err));
+        return -1;
+    }
+    if (pid == 0) {
+        close(lfd);
+        dup2(conn, STDOUT_FILENO);
+        dup2(conn, STDERR_FILENO);
+        close(conn);
+        exit(f(j));
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    return 128 + WTERMSIG(status);
+}
+
+// validation child: parse the options and the keyboards missing in the cache
+static int probe_job(jobctx *j)
+{
+    cmdlopts_t opt;
+    int i, n;
+
+    optind = 0;
+    opt = parse_args(j->argc, j->argv);
+    for (i = 0; i < opt.nafpath; i++) {
+        if (cache_get(opt.afpath[i], opt.utf8, 0) == NULL) {
+            parseFile(opt.afpath[i], &n, 0, opt.utf8);
+        }
+    }
+    return 0;
+}
+
+static int start_job(jobctx *j)
+{
+    return j->job(j->opt, j->keyboards, j->numkeys);
+}
+
+static void serve(int lfd, int conn, jobfn_t job)
+{
+    char line[MAXJOBLINE];
+    char *argv[MAXJOBARGS];
+    int argc, i, status;
+    key *keyboards[MAXARRANGEMENTS];
+    int numkeys[MAXARRANGEMENTS];
+    cached *c;
+    cmdlopts_t opt;
+    jobctx j;
+    struct timeval tv = {10, 0};
+
+    // don't let a silent client block the daemon
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (read_line(conn, line, sizeof(line)) <= 0) {
+        logmessage(LOG_CONT, flog, "Empty job, connection closed\n");
+        return;
+    }
+    logmessage(LOG_CONT, flog, "Job \"%s\"\n", line);
+    if ((argc = split_args(line, argv, MAXJOBARGS)) < 0) {
+        dprintf(conn, "too many options, max %d\n", MAXJOBARGS-2);
+        return;
+    }
+
+    // parse_args() and parseFile() exit on errors, check the job in a child
+    // process first, the errors are sent to the client
+    memset(&j, 0, sizeof(j));
+    j.argc = argc;
+    j.argv = argv;
+    status = run_child(lfd, conn, probe_job, &j);
+    if (status != 0) {
+        logmessage(LOG_CONT, flog, "Job refused, status %d\n", status);
+        return;
+    }
+
+    optind = 0;
+    opt = parse_args(argc, argv);
+    for (i = 0; i < opt.nafpath; i++) {
+        if ((c = cache_get(opt.afpath[i], opt.utf8, 1)) == NULL) {
+            dprintf(conn, "Can't access keyboard file \"%s\"\n", opt.afpath[i]);
+            logmessage(LOG_CONT, flog, "Can't access keyboard file \"%s\"\n", opt.afpath[i]);
+            free_args(&opt);
+            return;
+        }
+        keyboards[i] = c->keys;
+        numkeys[i] = c->numkeys;
+    }
+
+    j.job = job;
+    j.opt = &opt;
+    j.keyboards = keyboards;
+    j.numkeys = numkeys;
+    status = run_child(lfd, conn, start_job, &j);
+    logmessage(LOG_CONT, flog, "Job completed, status %d\n", status);
+    free_args(&opt);
+}
+
+int daemon_serve(cmdlopts_t *opt, jobfn_t job)
+{
+    struct sockaddr_un addr;
+    int lfd, conn, err, i;
+
+    assert(opt != NULL && opt->daemon != NULL && job != NULL);
+
+    // writes to a closed connection must not kill the daemon, the jobs
+    // install their own handler
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < opt->nafpath; i++) {
+        if (cache_get(opt->afpath[i], opt->utf8, 1) == NULL) {
+            logmessage(LOG_EXIT, flog, "Can't access keyboard file \"%s\"\n", opt->afpath[i]);
+        }
+    }
+
+    if (strlen(opt->daemon) >= sizeof(addr.sun_path)) {
+        logmessage(LOG_EXIT, flog, "Socket path \"%s\" too long\n", opt->daemon);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, opt->daemon);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        err = errno;
+        logmessage(LOG_EXIT, flog, "socket() failed: %s\n", strerror(err));
+    }
+    unlink(opt->daemon); // left by a previous daemon
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 16) != 0) {
+        err = errno;
+        logmessage(LOG_EXIT, flog, "Can't listen on \"%s\": %s\n", opt->daemon, strerror(err));
+    }
+    logmessage(LOG_CONT, flog, "Waiting for jobs on \"%s\"\n", opt->daemon);
+
+    while (stop_signal == 0) {
+        conn = accept(lfd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue; // stop_signal is checked again
+            err = errno;
+            logmessage(LOG_CONT, flog, "accept() failed: %s\n", strerror(err));
+            break;
+        }
+        serve(lfd, conn, job);
+        close(conn);
+    }
+
+    close(lfd);
+    unlink(opt->daemon);
+    for (i = 0; i < MAXCACHED; i++) {
+        cache_free(&cache[i]);
+    }
+    if (stop_signal) {
+        logmessage(LOG_CONT, flog, "****** RECEIVED %s ******\n", signal_name(stop_signal));
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,33 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWDAEMON__
+#define __KBWDAEMON__
+
+#include "cmdlineopts.h"
+#include "keyboard.h"
+
+#define MAXCACHED 16 // keyboards kept parsed by the daemon
+#define MAXJOBLINE 4096 // max length of a job line
+#define MAXJOBARGS 64 // max number of options of a job
+
+// run a job, keyboards[i] is the parsed opt->afpath[i], returns the exit status
+typedef int (*jobfn_t)(cmdlopts_t *opt, key **keyboards, int *numkeys);
+
+/* *
+ * Listen on the Unix socket opt->daemon and run the jobs one after the other.
+ * A client connects and sends one line with the options of the job, written
+ * as on the command line (double quotes group words containing spaces).
+ * Every job runs in a child process with the standard output and error
+ * redirected to the connection, so the words are sent back to the client
+ * unless the job has -o or -p. The connection is closed at the end of the job.
+ * Keyboards are parsed once and kept in a cache shared by the jobs, a file
+ * is parsed again when its modification time or size changes. The keyboards
+ * in opt->afpath are loaded at startup.
+ * Returns 0 when stopped by a signal, 1 on errors.
+ * */
+int daemon_serve(cmdlopts_t *opt, jobfn_t job);
+
+#endif
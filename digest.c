@@ -0,0 +1,117 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include "digest.h"
+
+// multiplier of the sequence hash, odd so that it is invertible mod 2^64
+#define DIGEST_P 0x100000001b3ULL
+
+// FNV-1a of the bytes followed by a 64 bit finalizer, the sum of the hashes
+// needs well mixed high bits
+static inline uint64_t word_hash(const char *w, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)w[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+void digest_init(digest *d)
+{
+    assert(d != NULL);
+    d->count = d->sum = d->chain = 0;
+}
+
+void digest_update(digest *d, const char *buf, size_t len)
+{
+    const char *s = buf, *e, *end = buf + len;
+    uint64_t h;
+
+    assert(d != NULL);
+
+    for (; s < end; s = e + 1) {
+        e = memchr(s, '\n', end - s);
+        assert(e != NULL); // only complete words are buffered
+        h = word_hash(s, e - s);
+        d->count++;
+        d->sum += h;
+        d->chain = d->chain * DIGEST_P + h;
+    }
+}
+
+void digest_combine(digest *d, const digest *next)
+{
+    uint64_t p = 1, b = DIGEST_P, n;
+
+    assert(d != NULL && next != NULL);
+
+    // P^count by squaring
+    for (n = next->count; n > 0; n >>= 1) {
+        if (n & 1) p *= b;
+        b *= b;
+    }
+    d->chain = d->chain * p + next->chain;
+    d->sum += next->sum;
+    d->count += next->count;
+}
+
+int digest_format(char *line, size_t size, const digest *d, const char *state, const char *key, int keylen)
+{
+    int n;
+
+    assert(line != NULL && d != NULL && state != NULL);
+    n = snprintf(line, size, "%" PRIu64 "\t%016" PRIx64 "\t%016" PRIx64 "\t%s\t%.*s", d->count, d->sum, d->chain, state, keylen, key != NULL ? key : "");
+
+    return n < (int)size ? n : (int)size - 1;
+}
+
+int digest_read(FILE *f, digest *d, char *state, char *key, size_t keysize)
+{
+    char line[256], *field[5], *end;
+    int i;
+    size_t len;
+
+    assert(f != NULL && d != NULL && state != NULL && key != NULL);
+
+    if (fgets(line, sizeof(line), f) == NULL) return 0;
+    len = strlen(line);
+    if (len == 0 || line[len-1] != '\n') return -1;
+    line[len-1] = '\0';
+
+    // split on the tabs only, the key may be a space
+    field[0] = line;
+    for (i = 1; i < 5; i++) {
+        if ((field[i] = strchr(field[i-1], '\t')) == NULL) return -1;
+        *field[i]++ = '\0';
+    }
+
+    d->count = strtoull(field[0], &end, 10);
+    if (*field[0] == '\0' || *end != '\0') return -1;
+    d->sum = strtoull(field[1], &end, 16);
+    if (*field[1] == '\0' || *end != '\0') return -1;
+    d->chain = strtoull(field[2], &end, 16);
+    if (*field[2] == '\0' || *end != '\0') return -1;
+    if (strlen(field[3]) >= 16 || strlen(field[4]) >= keysize) return -1;
+    strcpy(state, field[3]);
+    strcpy(key, field[4]);
+
+    return 1;
+}
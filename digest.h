@@ -0,0 +1,54 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWDIGEST__
+#define __KBWDIGEST__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// states of a digest file record
+#define DIGEST_COMPLETE "complete" // every word of the key
+#define DIGEST_PARTIAL "partial" // interrupted or restarted key
+#define DIGEST_TOTAL "total" // all the keys of the run, in -k order
+
+/* *
+ * Streaming digest of a sequence of words: the count, the sum of the word
+ * hashes (independent of the order, a duplicate or a missing word changes
+ * it) and a polynomial hash of the sequence (chain = chain * P + h, which
+ * depends on the order). Digests of consecutive parts of a sequence combine
+ * into the digest of the whole sequence, whatever the parts are: shards,
+ * restarted runs or start keys.
+ * */
+typedef struct digest {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t chain;
+} digest;
+
+void digest_init(digest *d);
+
+// add the '\n'-terminated words in buf[0, len)
+void digest_update(digest *d, const char *buf, size_t len);
+
+// d becomes the digest of the words of d followed by the ones of next
+void digest_combine(digest *d, const digest *next);
+
+/* *
+ * A digest file has one record per line: the count, sum and chain in hex, the
+ * state and the start key (empty for the total), tab separated.
+ * Write the record to line (without '\n'), returns its length.
+ * */
+int digest_format(char *line, size_t size, const digest *d, const char *state, const char *key, int keylen);
+
+/* *
+ * Read the next record of f. key (at least keysize bytes) gets the start
+ * key, state (at least 16 bytes) the state.
+ * Returns 1 on success, 0 at the end of the file, -1 on a malformed line.
+ * */
+int digest_read(FILE *f, digest *d, char *state, char *key, size_t keysize);
+
+#endif
@@ -0,0 +1,198 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "dryrun.h"
+#include "cmdlineopts.h"
+
+// a walk of length r has prefixes of every length < r, so the longest one is
+// the last length with words
+static void set_reachlen(key *keyboard, int numkeys, int maxdepth)
+{
+    int i, r;
+
+    for (i = 0; i < numkeys; i++) {
+        for (r = maxdepth; r > 0 && keyboard[i].counter[r-1] == 0; r--);
+        keyboard[i].reachlen = r;
+    }
+}
+
+/* *
+ * Counts, for each key, how many strings of each length can be generated
+ * starting from it. Instead of visiting the paths the counters are filled one
+ * length at a time, the words of length r from k are the words of length
+ * r-1 from its active neighbours prefixed by the base character or one of
+ * the shift variants of k.
+ * */
+void dry_run(key *keyboard, int numkeys, int maxdepth)
+{
+    int i, j, r;
+    double acnt;
+    key *k;
+
+    assert(keyboard != NULL);
+    assert(maxdepth > 0);
+
+    for (i = 0; i < numkeys; i++) {
+        k = &keyboard[i];
+        assert(k->counter != NULL && k->maxdepth >= maxdepth);
+        k->counter[0] = k->active == ACTIVE ? 1 + k->lensv : 0;
+    }
+
+    for (r = 1; r < maxdepth; r++) {
+        for (i = 0; i < numkeys; i++) {
+            k = &keyboard[i];
+            if (k->active != ACTIVE) {
+                k->counter[r] = 0;
+                continue;
+            }
+            acnt = 0;
+            // accumulate number of suffixes
+            for (j = 0; j < k->nreach; j++) {
+                acnt += k->reach[j]->counter[r-1];
+            }
+            // multiply by the number of current characters (key + shift variants)
+            k->counter[r] = (1 + k->lensv) * acnt;
+        }
+    }
+    set_reachlen(keyboard, numkeys, maxdepth);
+
+    return;
+}
+
+double count_words(const key *k, int minlen, int maxlen)
+{
+    double total = 0;
+    int r;
+
+    assert(k != NULL);
+    assert(minlen > 0 && maxlen <= k->maxdepth);
+
+    for (r = minlen; r <= maxlen; r++) {
+        total += k->counter[r-1];
+    }
+
+    return total;
+}
+
+// words in the subtrees of all the characters of k at position pos (0-based)
+static double subtrees(const key *k, int pos, int minlen, int depth)
+{
+    int lo = minlen - pos > 1 ? minlen - pos : 1;
+    return lo <= depth - pos ? count_words(k, lo, depth - pos) : 0;
+}
+
+double word_rank(key *const *path, const int *types, int len, int minlen, int depth)
+{
+    double rank = 0;
+    int i, j;
+    const key *k, *p;
+
+    assert(path != NULL && types != NULL);
+    assert(len > 0 && len <= depth);
+
+    for (i = 0; i < len; i++) {
+        k = path[i];
+        if (i > 0) {
+            // the prefix is written before its subtree
+            if (i >= minlen) rank++;
+            // neighbours are pushed in order, so the later ones are popped
+            // first, each with all its characters
+            p = path[i-1];
+            for (j = p->nreach-1; j >= 0 && p->reach[j] != k; j--) {
+                if (p->reach[j]->active == ACTIVE) rank += subtrees(p->reach[j], i, minlen, depth);
+            }
+            assert(j >= 0);
+        }
+        // shift variants are popped from the last one, the base character last
+        rank += (k->lensv - 1 - types[i]) * (subtrees(k, i, minlen, depth) / (1 + k->lensv));
+    }
+
+    return rank;
+}
+
+// read the cached table in path if it matches the keyboard, 1 on success
+static int load_cache(const char *path, key *keyboard, int numkeys, int maxdepth, uint64_t hash)
+{
+    FILE *f;
+    char magic[4];
+    uint32_t version, nk, depth;
+    uint64_t h;
+    int i, ok = 1;
+
+    if ((f = fopen(path, "rb")) == NULL) return 0;
+
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, DRYRUN_MAGIC, 4) != 0) ok = 0;
+    if (ok && (fread(&version, sizeof(version), 1, f) != 1 || version != DRYRUN_VERSION)) ok = 0;
+    if (ok && (fread(&h, sizeof(h), 1, f) != 1 || h != hash)) ok = 0;
+    if (ok && (fread(&nk, sizeof(nk), 1, f) != 1 || nk != (uint32_t)numkeys)) ok = 0;
+    if (ok && (fread(&depth, sizeof(depth), 1, f) != 1 || depth < (uint32_t)maxdepth)) ok = 0;
+
+    // one row of depth counters for each key, only the first maxdepth are used
+    for (i = 0; ok && i < numkeys; i++) {
+        if (fread(keyboard[i].counter, sizeof(double), maxdepth, f) != (size_t)maxdepth) ok = 0;
+        if (ok && fseek(f, (depth - maxdepth) * sizeof(double), SEEK_CUR) != 0) ok = 0;
+    }
+
+    fclose(f);
+    return ok;
+}
+
+static void save_cache(const char *path, key *keyboard, int numkeys, int maxdepth, uint64_t hash)
+{
+    FILE *f;
+    uint32_t version = DRYRUN_VERSION, nk = numkeys, depth = maxdepth;
+    char tmppath[MAXPATHLEN+96];
+    int i, ok = 1;
+
+    // write a temporary file and rename it, concurrent runs never read a
+    // partial table
+    snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+    if ((f = fopen(tmppath, "wb")) == NULL) {
+        fprintf(stderr, "Can't write dry-run cache \"%s\"\n", tmppath);
+        return;
+    }
+    ok = fwrite(DRYRUN_MAGIC, 1, 4, f) == 4;
+    ok = ok && fwrite(&version, sizeof(version), 1, f) == 1;
+    ok = ok && fwrite(&hash, sizeof(hash), 1, f) == 1;
+    ok = ok && fwrite(&nk, sizeof(nk), 1, f) == 1;
+    ok = ok && fwrite(&depth, sizeof(depth), 1, f) == 1;
+    for (i = 0; ok && i < numkeys; i++) {
+        ok = fwrite(keyboard[i].counter, sizeof(double), maxdepth, f) == (size_t)maxdepth;
+    }
+    if (fclose(f) != 0) ok = 0;
+
+    if (!ok || rename(tmppath, path) != 0) {
+        fprintf(stderr, "Can't write dry-run cache \"%s\"\n", path);
+        remove(tmppath);
+    }
+}
+
+int dry_run_cached(key *keyboard, int numkeys, int maxdepth, const char *cachedir)
+{
+    char path[MAXPATHLEN+64];
+    uint64_t hash;
+
+    assert(cachedir != NULL);
+
+    hash = layout_hash(keyboard, numkeys);
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".kbwc", cachedir, hash);
+
+    if (load_cache(path, keyboard, numkeys, maxdepth, hash)) {
+        set_reachlen(keyboard, numkeys, maxdepth);
+        return 1;
+    }
+
+    dry_run(keyboard, numkeys, maxdepth);
+    save_cache(path, keyboard, numkeys, maxdepth, hash);
+
+    return 0;
+}
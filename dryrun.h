@@ -0,0 +1,52 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWDRYRUN__
+#define __KBWDRYRUN__
+
+#include <stdint.h>
+
+#include "keyboard.h"
+
+// cache file format
+#define DRYRUN_MAGIC "KBWC"
+#define DRYRUN_VERSION 1
+
+/* *
+ * Fill the counters of every key of the keyboard: counter[r-1] is the number
+ * of words of exactly r characters starting from the key (base character and
+ * shift variants), for r in [1, maxdepth]. Inactive keys count 0.
+ * reachlen is set to the longest r with words, dfs() uses it to skip the
+ * neighbours that can't reach minlen.
+ * Every key must have been initialized with maxdepth >= the given one.
+ * */
+void dry_run(key *keyboard, int numkeys, int maxdepth);
+
+// number of words of length in [minlen, maxlen] starting from k, dry_run()
+// must have been called with maxdepth >= maxlen
+double count_words(const key *k, int minlen, int maxlen);
+
+/* *
+ * Position (0-based) of a word in the output of dfs() from path[0] with the
+ * given minlen and depth, without visiting the tree: the subtrees popped
+ * before each character of the word are counted with the counters.
+ * path[i] is the key of the i-th character and types[i] its type (-1 base
+ * character, >= 0 shift variant index); path must be a walk (path[i+1] an
+ * active neighbour of path[i]) with len <= depth. A word shorter than minlen
+ * isn't written, its rank is the number of words written before its node.
+ * dry_run() must have been called with maxdepth >= depth.
+ * */
+double word_rank(key *const *path, const int *types, int len, int minlen, int depth);
+
+/* *
+ * Same as dry_run() but the counters are read from (and saved to) the cache
+ * directory cachedir. The cache file name is the layout hash, so the same
+ * directory can be shared by different keyboards. A cached table computed
+ * for a longer max depth is reused for any shorter one.
+ * Returns 1 if the table was found in the cache, 0 if it was computed.
+ * */
+int dry_run_cached(key *keyboard, int numkeys, int maxdepth, const char *cachedir);
+
+#endif
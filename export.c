@@ -0,0 +1,224 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "export.h"
+#include "cmdlineopts.h"
+#include "stack.h"
+#include "signals.h"
+
+int export_format(const char *name)
+{
+    if (name == NULL) return EXPORT_NONE;
+    if (strcmp(name, "hcmask") == 0) return EXPORT_HCMASK;
+    if (strcmp(name, "john") == 0) return EXPORT_JOHN;
+    return EXPORT_NONE;
+}
+
+// append c to p escaping hashcat special characters, returns the new end
+static char *hc_putc(char *p, char c)
+{
+    if (c == '?') {
+        *p++ = '?';
+    } else if (c == ',') {
+        *p++ = '\\';
+    }
+    *p++ = c;
+    return p;
+}
+
+// John the Ripper mask special characters (all single byte)
+static int john_special(const key *k, int t)
+{
+    return k->symlen[t] == 1 && strchr("\\[]?-", *(const char *)&k->sym[t]) != NULL;
+}
+
+// append character t of k to p, escaped, returns the new end
+static char *john_putc(char *p, const key *k, int t)
+{
+    if (john_special(k, t)) *p++ = '\\';
+    memcpy(p, &k->sym[t], k->symlen[t]);
+    return p + k->symlen[t];
+}
+
+static void john_mask(key **path, int len, outbuf *o)
+{
+    int i, j;
+    size_t need = 1; // the newline
+    char *p, *start;
+
+    // the line is reserved whole, the buffer only holds complete lines: a
+    // worst case bound ("[", 256 escaped variants, "]" per position) would
+    // exceed the smallest batch past ~50 positions
+    for (i = 0; i < len; i++) {
+        if (path[i]->lensv > 0) need += 2;
+        for (j = 0; j <= path[i]->lensv; j++) need += path[i]->symlen[j] + john_special(path[i], j);
+    }
+    if (need > o->cap) {
+        fprintf(stderr, "A mask of %zu bytes doesn't fit the output buffer of %zu bytes, use a larger -o batch=\n", need, o->cap);
+        exit(1);
+    }
+    p = start = out_reserve(o, need);
+
+    for (i = 0; i < len; i++) {
+        if (path[i]->lensv == 0) {
+            p = john_putc(p, path[i], 0);
+            continue;
+        }
+        *p++ = '[';
+        for (j = 0; j <= path[i]->lensv; j++) {
+            p = john_putc(p, path[i], j);
+        }
+        *p++ = ']';
+    }
+    *p++ = '\n';
+    o->len += p - start;
+}
+
+/* *
+ * Write the hashcat masks for path. Keys with shift variants are mapped to
+ * the custom charsets ?1..?4 (the same key always uses the same charset), the
+ * variants of the keys which do not fit in the 4 charsets are enumerated
+ * and produce one line for each combination.
+ * Hashcat masks are byte oriented, keys are single byte characters here
+ * (-u is refused with hcmask).
+ * */
+static void hc_mask(key **path, int len, outbuf *o)
+{
+    key *cs[HC_MAXCHARSETS]; // keys used as custom charsets
+    int ncs = 0;
+    int csidx[MAXWORDLEN]; // charset index for each position, -1 if none
+    int sel[MAXWORDLEN]; // current variant of enumerated positions
+    int i, j;
+    char *p, *start;
+
+    // assign charsets
+    for (i = 0; i < len; i++) {
+        csidx[i] = -1;
+        sel[i] = 0;
+        if (path[i]->lensv == 0) continue;
+        for (j = 0; j < ncs; j++) {
+            if (cs[j] == path[i]) break;
+        }
+        if (j == ncs && ncs < HC_MAXCHARSETS) cs[ncs++] = path[i];
+        if (j < ncs) csidx[i] = j;
+    }
+
+    while (1) {
+        // worst case: charsets (each char escaped) plus the mask, about 3K
+        // with MAXWORDLEN positions, always within the smallest batch
+        p = out_reserve(o, (size_t)ncs * (2*(MAXSHIFTVARS+1)+1) + (size_t)len*2 + 2);
+        start = p;
+        for (j = 0; j < ncs; j++) {
+            for (i = 0; i <= cs[j]->lensv; i++) {
+                p = hc_putc(p, *(const char *)&cs[j]->sym[i]);
+            }
+            *p++ = ',';
+        }
+        for (i = 0; i < len; i++) {
+            if (csidx[i] >= 0) {
+                *p++ = '?';
+                *p++ = '1' + csidx[i];
+            } else {
+                p = hc_putc(p, *(const char *)&path[i]->sym[sel[i]]);
+            }
+        }
+        // a leading '#' would make the line a comment
+        if (*start == '#') {
+            memmove(start+1, start, p - start);
+            *start = '\\';
+            p++;
+        }
+        *p++ = '\n';
+        o->len += p - start;
+
+        // next combination of the enumerated positions (last one fastest)
+        for (i = len-1; i >= 0; i--) {
+            if (csidx[i] >= 0 || path[i]->lensv == 0) continue;
+            if (++sel[i] <= path[i]->lensv) break;
+            sel[i] = 0;
+        }
+        if (i < 0) break;
+    }
+}
+
+double mask_export(key *start, int minlen, int depth, int format, outbuf *o)
+{
+    key *path[MAXWORDLEN];
+    double mul[MAXWORDLEN+1]; // mul[i]: number of words described by path[0..i-1]
+    double total = 0;
+    int i, curridx;
+    stack s;
+    struct stackel *currstack;
+
+    assert(start != NULL);
+    assert(minlen > 0);
+    assert(depth >= minlen && depth <= MAXWORDLEN);
+    assert(o != NULL);
+
+    if (start->active == INACTIVE) {
+        fprintf(stderr, "Can't start from an inactive key\n");
+        exit(1); // wrong starting point
+    }
+
+    mul[0] = 1;
+
+    // only base keys are walked, variants are part of the masks
+    s.pos = 0;
+    s.stack[s.pos].k = start;
+    s.stack[s.pos].idx = 0;
+    s.stack[s.pos].type = -1;
+    s.stack[s.pos].visited = 0;
+
+    while (s.pos >= 0 && !stop_signal) {
+        currstack = &(s.stack[s.pos]);
+        curridx = currstack->idx;
+
+        if (currstack->visited != 0) {
+            s.pos--;
+            continue;
+        }
+        currstack->visited = 1;
+
+        path[curridx] = currstack->k;
+        mul[curridx+1] = mul[curridx] * (1 + currstack->k->lensv);
+
+        if (curridx+1 >= minlen) {
+            if (format == EXPORT_JOHN) {
+                john_mask(path, curridx+1, o);
+            } else {
+                hc_mask(path, curridx+1, o);
+            }
+            total += mul[curridx+1];
+        }
+
+        if (curridx >= depth-1) {
+            s.pos--;
+            continue;
+        }
+
+        if (s.pos == STACKSIZE-1) {
+            fprintf(stderr, "reached max stack size\n");
+            exit(1);
+        }
+
+        for (i = 0; i < currstack->k->nreach; i++) {
+            if (currstack->k->reach[i]->active == ACTIVE) {
+                s.pos++;
+                assert(s.pos < STACKSIZE);
+                s.stack[s.pos].k = currstack->k->reach[i];
+                s.stack[s.pos].idx = curridx+1;
+                s.stack[s.pos].type = -1;
+                s.stack[s.pos].visited = 0;
+            }
+        }
+    }
+
+    return total;
+}
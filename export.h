@@ -0,0 +1,34 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWEXPORT__
+#define __KBWEXPORT__
+
+#include "keyboard.h"
+#include "output.h"
+
+/* export formats, see -e,--export */
+#define EXPORT_NONE 0
+// hashcat .hcmask file: up to 4 custom charsets per line
+#define EXPORT_HCMASK 1
+// John the Ripper mask mode: one [..] set per position
+#define EXPORT_JOHN 2
+
+// max number of custom charsets hashcat accepts on a single mask line
+#define HC_MAXCHARSETS 4
+
+// returns the EXPORT_* value for name, EXPORT_NONE if name is not valid
+int export_format(const char *name);
+
+/* *
+ * Walk only the base characters of the paths starting from start and write
+ * one mask for each path of length in [minlen, depth], shift variants are
+ * expressed as per position character sets.
+ * Returns the number of words described by the written masks, which must be
+ * equal to the dry-run count for the same parameters.
+ * */
+double mask_export(key *start, int minlen, int depth, int format, outbuf *o);
+
+#endif
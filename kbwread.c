@@ -0,0 +1,207 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+
+/* *
+ * kbwread: consumer for the kbw output sinks. It receives the words from a
+ * Unix socket, a shared memory ring or a file descriptor, counts bytes and
+ * words and reports the throughput on stderr. With -o the received bytes
+ * are also copied to a file, to compare them with the output of other sinks.
+ * */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+#include "signals.h"
+
+#define READSIZE (1 << 20)
+
+volatile sig_atomic_t stop_signal; // also checked by the writes of sink.c
+static int copyfd = -1;
+static unsigned long long nbytes, nlines;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-o FILE] [-w USEC] SOURCE\n", name);
+    fprintf(stderr, "  SOURCE is one of:\n");
+    fprintf(stderr, "    unix:PATH  listen on PATH and read from the first connection\n");
+    fprintf(stderr, "    shm:NAME   read the ring created by kbw -o shm:NAME\n");
+    fprintf(stderr, "    fd:N       read file descriptor N (fd:0 for a pipe)\n");
+    fprintf(stderr, "  -o FILE  copy the received bytes to FILE\n");
+    fprintf(stderr, "  -w USEC  sleep time when the ring is empty, 0 to yield (default %d)\n", RING_DEFWAIT);
+    exit(1);
+}
+
+static void handler(int sig)
+{
+    (void)sig;
+    stop_signal = 1;
+}
+
+static void consume(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    ssize_t r;
+
+    nbytes += len;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        nlines++;
+        p++;
+    }
+    while (copyfd >= 0 && len > 0) {
+        if ((r = write(copyfd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+static int read_fd(int fd)
+{
+    static char buf[READSIZE];
+    ssize_t r;
+
+    while (!stop_signal && (r = read(fd, buf, sizeof(buf))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return 1;
+        }
+        consume(buf, r);
+    }
+
+    return 0;
+}
+
+static int read_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int ls, fd, ret;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, 1) != 0) {
+        fprintf(stderr, "Can't listen on \"%s\": %s\n", path, strerror(errno));
+        return 1;
+    }
+    fd = accept(ls, NULL, NULL);
+    close(ls);
+    unlink(path);
+    if (fd < 0) {
+        perror("accept");
+        return 1;
+    }
+    ret = read_fd(fd);
+    close(fd);
+
+    return ret;
+}
+
+static int read_ring(const char *name, unsigned int wait)
+{
+    ringhdr *r;
+    size_t maplen;
+    const char *data;
+    uint64_t head, tail = 0, off, n;
+
+    if ((r = ring_attach(name, &maplen)) == NULL) {
+        fprintf(stderr, "Can't attach to ring \"%s\"\n", name);
+        return 1;
+    }
+    data = (const char *)r + SINK_ALIGN;
+
+    while (!stop_signal) {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (head == tail) {
+            // closed is set after the last head update
+            if (atomic_load_explicit(&r->closed, memory_order_acquire) && head == atomic_load_explicit(&r->head, memory_order_acquire)) break;
+            if (wait > 0) usleep(wait);
+            else sched_yield();
+            continue;
+        }
+        // the words are read in place, in at most two pieces
+        off = tail & (r->size - 1);
+        n = head - tail < r->size - off ? head - tail : r->size - off;
+        consume(data + off, n);
+        tail += n;
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    // don't leave the producer waiting for a reader that's gone
+    if (stop_signal) atomic_store(&r->detached, 1);
+    munmap(r, maplen);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec t0, t1;
+    unsigned int wait = RING_DEFWAIT;
+    double secs;
+    char *end;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "o:w:")) != -1) {
+        switch (c) {
+            case 'o':
+                if ((copyfd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                    fprintf(stderr, "Can't open \"%s\": %s\n", optarg, strerror(errno));
+                    exit(1);
+                }
+                break;
+            case 'w':
+                wait = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    signal(SIGINT, handler);
+    signal(SIGTERM, handler);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (strncmp(argv[optind], "unix:", 5) == 0) {
+        ret = read_unix(argv[optind] + 5);
+    } else if (strncmp(argv[optind], "shm:", 4) == 0) {
+        ret = read_ring(argv[optind] + 4, wait);
+    } else if (strncmp(argv[optind], "fd:", 3) == 0) {
+        c = (int)strtol(argv[optind] + 3, &end, 10);
+        if (*end != '\0') usage(argv[0]);
+        ret = read_fd(c);
+    } else {
+        usage(argv[0]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    if (copyfd >= 0 && close(copyfd) != 0) ret = 1;
+    fprintf(stderr, "%s: %llu bytes, %llu words in %.3f s, %.1f MB/s\n",
+            argv[optind], nbytes, nlines, secs, secs > 0 ? nbytes / secs / 1e6 : 0);
+
+    return ret;
+}
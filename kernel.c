@@ -0,0 +1,186 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "kernel.h"
+
+/* *
+ * The kernels are instances of subtree() and leaves() with compile time
+ * constant characters per key (NV), copy size (FIXED) and levels (L): the
+ * compiler unrolls the loop over the characters, drops the length of the
+ * prefix copies and the level checks, and each level calls the instance of
+ * the next one directly. dfs() has to do all this at runtime for every node.
+ * */
+#define INLINE static inline __attribute__((always_inline))
+
+// write the len bytes of word and a newline at p
+INLINE char *put(char *p, const char *word, int len, const int fixed)
+{
+    // the fixed store may write past the newline, OUTBUFSLACK covers it
+    if (fixed) memcpy(p, word, KERNEL_WORDBYTES);
+    else memcpy(p, word, len);
+    p[len] = '\n';
+
+    return p + len + 1;
+}
+
+// write the characters of nk after the prefix in tmpl, last one first
+INLINE char *leaf_chars(char *p, const char *tmpl, int plen, const key *nk, int nchars, const int fixed)
+{
+    int j;
+
+    for (j = nchars - 1; j >= 0; j--) {
+        if (fixed) memcpy(p, tmpl, KERNEL_WORDBYTES);
+        else memcpy(p, tmpl, plen);
+        memcpy(p + plen, &nk->sym[j], MAXSYMLEN);
+        p += plen + nk->symlen[j];
+        *p++ = '\n';
+    }
+
+    return p;
+}
+
+// last level: same as emit_leaves() in main.c
+INLINE uint64_t leaves(const kernel *kn, char *word, int plen, int pos, const key *k, const int nv, const int fixed)
+{
+    outbuf *o = kn->outs[pos+1];
+    char tmpl[KERNEL_WORDBYTES];
+    const key *nk, *lastk = NULL;
+    uint64_t n = 0;
+    char *p, *start;
+    int i;
+
+    if (fixed) memcpy(tmpl, word, KERNEL_WORDBYTES);
+    for (i = k->nreach - 1; i >= 0; i--) {
+        nk = k->reach[i];
+        if (nk->active != ACTIVE) continue;
+        start = p = out_reserve(o, (size_t)(1 + nk->lensv) * (plen + MAXSYMLEN + 1));
+        if (nk->lensv == nv - 1) {
+            p = leaf_chars(p, fixed ? tmpl : word, plen, nk, nv, fixed);
+        } else {
+            p = leaf_chars(p, fixed ? tmpl : word, plen, nk, 1 + nk->lensv, fixed);
+        }
+        o->len += p - start;
+        n += 1 + nk->lensv;
+        lastk = nk;
+    }
+
+    // the base character of the first active neighbour is the last word,
+    // the prefix if there is none
+    if (lastk != NULL) {
+        memcpy(word + plen, &lastk->sym[0], MAXSYMLEN);
+        word[plen + lastk->symlen[0]] = '\0';
+    } else {
+        word[plen] = '\0';
+    }
+
+    return n;
+}
+
+// a node of nk with character j, then its subtree; word is terminated by
+// the last level only
+INLINE uint64_t node(const kernel *kn, char *word, int plen, int pos, const key *nk, int j, const int fixed, kernel_fn next)
+{
+    int len = plen + nk->symlen[j];
+    outbuf *o;
+    char *p;
+
+    memcpy(word + plen, &nk->sym[j], MAXSYMLEN);
+    if (pos + 1 >= kn->minlen) {
+        o = kn->outs[pos+1];
+        p = out_reserve(o, len + 1);
+        o->len += put(p, word, len, fixed) - p;
+        return 1 + next(kn, word, len, pos + 1, nk);
+    }
+
+    return next(kn, word, len, pos + 1, nk);
+}
+
+INLINE uint64_t subtree(const kernel *kn, char *word, int plen, int pos, const key *k, const int nv, const int fixed, const int levels, kernel_fn next)
+{
+    const key *nk, *lastk = NULL;
+    uint64_t n = 0;
+    int i, j;
+
+    if (levels == 1) return leaves(kn, word, plen, pos, k, nv, fixed);
+
+    for (i = k->nreach - 1; i >= 0; i--) {
+        nk = k->reach[i];
+        // skip the neighbours whose walks all end before minlen
+        if (nk->active != ACTIVE || nk->reachlen < kn->minlen - pos) continue;
+        // pop order: last shift variant first, base character last
+        if (nk->lensv == nv - 1) {
+            for (j = nv - 1; j >= 0; j--) n += node(kn, word, plen, pos, nk, j, fixed, next);
+        } else {
+            for (j = nk->lensv; j >= 0; j--) n += node(kn, word, plen, pos, nk, j, fixed, next);
+        }
+        lastk = nk;
+    }
+    if (lastk == NULL) word[plen] = '\0'; // no children, the prefix is the last word
+
+    return n;
+}
+
+#define KERNEL(NV, FIXED, L, NEXT) \
+static uint64_t kernel_##NV##_##FIXED##_##L(const kernel *kn, char *word, int plen, int pos, const key *k) \
+{ \
+    return subtree(kn, word, plen, pos, k, NV, FIXED, L, NEXT); \
+}
+
+#define KERNELS(NV, FIXED) \
+    KERNEL(NV, FIXED, 1, NULL) \
+    KERNEL(NV, FIXED, 2, kernel_##NV##_##FIXED##_1) \
+    KERNEL(NV, FIXED, 3, kernel_##NV##_##FIXED##_2)
+
+KERNELS(1, 0)
+KERNELS(1, 1)
+KERNELS(2, 0)
+KERNELS(2, 1)
+KERNELS(3, 0)
+KERNELS(3, 1)
+
+#define KERNELROW(NV, FIXED) {kernel_##NV##_##FIXED##_1, kernel_##NV##_##FIXED##_2, kernel_##NV##_##FIXED##_3}
+
+// [nv-1][fixed][levels-1]
+static const kernel_fn kernels[KERNEL_MAXNV][2][KERNEL_LEVELS] = {
+    {KERNELROW(1, 0), KERNELROW(1, 1)},
+    {KERNELROW(2, 0), KERNELROW(2, 1)},
+    {KERNELROW(3, 0), KERNELROW(3, 1)},
+};
+
+void kernel_select(kernel *kn, const key *keyboard, int numkeys, int minlen, int depth, outbuf **outs)
+{
+    int count[MAXSHIFTVARS+2] = {0};
+    int i, j, symlen = 1;
+
+    assert(kn != NULL && keyboard != NULL && outs != NULL);
+
+    memset(kn, 0, sizeof(*kn));
+    kn->minlen = minlen;
+    kn->outs = outs;
+#ifndef KBW_KERNELS
+    return; // built with KERNELS=0, dfs() takes the generic path
+#endif
+
+    for (i = 0; i < numkeys; i++) {
+        if (keyboard[i].active != ACTIVE) continue;
+        count[1 + keyboard[i].lensv]++;
+        for (j = 0; j <= keyboard[i].lensv; j++) {
+            if (keyboard[i].symlen[j] > symlen) symlen = keyboard[i].symlen[j];
+        }
+    }
+    for (i = 1; i <= MAXSHIFTVARS+1; i++) {
+        if (count[i] > count[kn->nv]) kn->nv = i;
+    }
+
+    if (depth < 2 || kn->nv == 0 || kn->nv > KERNEL_MAXNV) return;
+    kn->levels = depth - 1 < KERNEL_LEVELS ? depth - 1 : KERNEL_LEVELS;
+    kn->fixed = depth * symlen <= KERNEL_WORDBYTES;
+    kn->fn = kernels[kn->nv-1][kn->fixed][kn->levels-1];
+}
@@ -0,0 +1,54 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWKERNEL__
+#define __KBWKERNEL__
+
+#include <stdint.h>
+
+#include "keyboard.h"
+#include "output.h"
+
+// levels at the bottom of the tree written by a specialized kernel
+#define KERNEL_LEVELS 3
+
+// kernels are unrolled for keys with 1 to KERNEL_MAXNV characters (base
+// character and shift variants)
+#define KERNEL_MAXNV 3
+
+// words of at most this many bytes are copied with one fixed size store
+#define KERNEL_WORDBYTES 16
+
+typedef struct kernel kernel;
+
+/* *
+ * Write the subtree below a node, in the order dfs() would: word holds the
+ * plen bytes (pos characters) of the node, k is its key. Returns the number
+ * of written words, word is left holding the last visited node.
+ * */
+typedef uint64_t (*kernel_fn)(const kernel *kn, char *word, int plen, int pos, const key *k);
+
+struct kernel {
+    kernel_fn fn; // NULL if dfs() has to use the generic path
+    int levels; // levels below the node written by fn
+    int nv; // characters per key the kernel is unrolled for
+    int fixed; // every word fits in KERNEL_WORDBYTES
+    int minlen;
+    outbuf **outs; // output buffer of each word length
+};
+
+/* *
+ * Choose the kernel for a dfs() with the given minlen and depth: it is
+ * unrolled for the most common number of characters of the active keys
+ * (the other keys take a loop over their characters), and copies the words
+ * with fixed size stores if depth characters of the longest symbol fit in
+ * KERNEL_WORDBYTES. dfs() calls it at depth-1-levels, the nodes below
+ * (e.g. of a restart word) take the generic path. kn->fn is NULL if no
+ * kernel applies (depth < 2 or more than KERNEL_MAXNV characters per key).
+ * The kernels follow the dry-run pruning of dfs(), reachlen must be set.
+ * */
+void kernel_select(kernel *kn, const key *keyboard, int numkeys, int minlen, int depth, outbuf **outs);
+
+#endif
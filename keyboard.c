@@ -10,47 +10,138 @@
 
 #include "keyboard.h"
 
-// assume shiftvar is a '\0'-terminated string
-void char_initkey(key *k, int active, char c, char *shiftvar, int maxdepth)
+int nextsym(const char *s, int utf8, sym_t *sym)
 {
-    int i;
+    const unsigned char *u = (const unsigned char *)s;
+    int len, i;
+
+    assert(s != NULL && sym != NULL);
+
+    *sym = 0;
+    if (*u == 0) return 0;
+
+    if (!utf8 || *u < 0x80) {
+        len = 1;
+    } else if (*u >= 0xC2 && *u <= 0xDF) {
+        len = 2;
+    } else if ((*u & 0xF0) == 0xE0) {
+        len = 3;
+    } else if (*u >= 0xF0 && *u <= 0xF4) {
+        len = 4;
+    } else {
+        return -1; // continuation byte, overlong C0/C1 or lead past U+10FFFF
+    }
+
+    for (i = 1; i < len; i++) {
+        if ((u[i] & 0xC0) != 0x80) return -1; // also stops at '\0'
+    }
+    // overlong 3 and 4 bytes forms, UTF-16 surrogates, past U+10FFFF: one
+    // character would have two encodings, or none
+    if (len > 1 && ((*u == 0xE0 && u[1] < 0xA0) || (*u == 0xED && u[1] >= 0xA0)
+        || (*u == 0xF0 && u[1] < 0x90) || (*u == 0xF4 && u[1] >= 0x90))) {
+        return -1;
+    }
+    memcpy(sym, s, len);
+
+    return len;
+}
+
+int symcount(const char *s, int utf8)
+{
+    int n = 0, len;
+    sym_t sym;
+
+    assert(s != NULL);
+    while ((len = nextsym(s, utf8, &sym)) > 0) {
+        s += len;
+        n++;
+    }
+
+    return len < 0 ? -1 : n;
+}
+
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+size_t arena_size(int numkeys, size_t nsyms, size_t nreach, int maxdepth)
+{
+    // every key starts a new sym and symlen block
+    return ARENA_ROUND((size_t)numkeys * sizeof(key))
+        + nsyms * sizeof(sym_t) + (size_t)numkeys * ARENA_ALIGN
+        + nsyms + (size_t)numkeys * ARENA_ALIGN
+        + nreach * sizeof(key *)
+        + (size_t)numkeys * (maxdepth > 0 ? maxdepth : 0) * sizeof(double);
+}
+
+void arena_init(arena *a, size_t size)
+{
+    assert(a != NULL);
+    a->base = (char *)calloc(1, size);
+    if (a->base == NULL) {
+        fprintf(stderr, "malloc() failed\n");
+        exit(1);
+    }
+    a->size = size;
+    a->used = 0;
+}
+
+void *arena_alloc(arena *a, size_t n)
+{
+    void *p;
+
+    assert(a != NULL && a->base != NULL);
+    assert(a->used + n <= a->size);
+    p = a->base + a->used;
+    a->used = ARENA_ROUND(a->used + n);
+    if (a->used > a->size) a->used = a->size;
+    return p;
+}
+
+// assume def is a '\0'-terminated string, valid for the encoding
+void char_initkey(key *k, int active, const char *def, int utf8, int maxdepth, arena *a)
+{
+    int i, n, len;
+    const char *p;
     assert(k != NULL);
     assert(maxdepth >= 0);
+    assert(def != NULL);
     k->active = active;
-    k->c = c;
-    assert(k->shiftvar == NULL);
-    assert(shiftvar != NULL);
-    k->lensv = strnlen(shiftvar, MAXSHIFTVARS+1);
-    assert(k->lensv >= 0 && k->lensv <= MAXSHIFTVARS);
 
-    k->shiftvar = strdup(shiftvar);
-    assert(k->shiftvar != NULL);
+    n = symcount(def, utf8);
+    assert(n >= 1 && n <= MAXSHIFTVARS+1);
+    k->lensv = n-1;
+
+    assert(k->sym == NULL && k->symlen == NULL);
+    k->sym = (sym_t *)arena_alloc(a, n * sizeof(sym_t));
+    k->symlen = (unsigned char *)arena_alloc(a, n);
+    for (i = 0, p = def; i < n; i++) {
+        len = nextsym(p, utf8, &k->sym[i]);
+        k->symlen[i] = len;
+        p += len;
+    }
+
 
     assert(k->reach == NULL);
     k->nreach = 0;
 
-    // dry-run setup
+    // dry-run setup, the arena is zeroed
     assert(k->counter == NULL);
     k->maxdepth = maxdepth;
+    k->reachlen = INT_MAX; // unknown, nothing can be pruned
     if (maxdepth > 0) {
-        k->counter = (double *)malloc(maxdepth * sizeof(double));
-        assert(k->counter != NULL);
-        for (i = 0; i < maxdepth; ++i) {
-            k->counter[i] = 0;
-        }
+        k->counter = (double *)arena_alloc(a, maxdepth * sizeof(double));
     }
 
     return;
 }
 
 // initialize key neighbours with empty array
-void neigh_initkey(key *k, int numreach)
+void neigh_initkey(key *k, int numreach, arena *a)
 {
     assert(k != NULL);
     assert(numreach > 0);
 
-    k->reach = (key **)malloc(numreach * sizeof(key *));
-    assert(k->reach != NULL);
+    k->reach = (key **)arena_alloc(a, numreach * sizeof(key *));
 
     k->nreach = numreach;
 
@@ -58,61 +149,70 @@ void neigh_initkey(key *k, int numreach)
     return;
 }
 
-void initkey(key *k, int active, char c, char *shiftvar, int numreach, int maxdepth)
+void initkey(key *k, int active, const char *def, int utf8, int numreach, int maxdepth, arena *a)
 {
-    char_initkey(k, active, c, shiftvar, maxdepth);
-    neigh_initkey(k, numreach);
+    char_initkey(k, active, def, utf8, maxdepth, a);
+    neigh_initkey(k, numreach, a);
 
     return;
 }
 
 void printkey(key *k)
 {
-    int i = 0;
+    int i;
     printf("Active: %d\n", k->active);
-    printf("Char: %c\n", k->c);
-    while (k->shiftvar[i] != '\0') {
-        printf("shift%d: %c\n", i+1, k->shiftvar[i]);
-        ++i;
+    printf("Char: %.*s\n", SYMARG(k, 0));
+    for (i = 1; i <= k->lensv; i++) {
+        printf("shift%d: %.*s\n", i, SYMARG(k, i));
     }
     printf("numreach: %d\n", k->nreach);
     return;
 }
 
-void freekey(key *k)
+// searches in list of length listlen for a key which either base character or
+// a shift variant is equal to sym if no key is found NULL is returned
+key *getkey(key *list, int listlen, sym_t sym, int *type)
 {
-    if (k == NULL) return;
-    k->active = INACTIVE;
-    k->c = 0;
-    if (k->shiftvar != NULL) {
-        free(k->shiftvar);
-        k->shiftvar = NULL;
-    }
-    if (k->reach != NULL) {
-        free(k->reach);
-        k->reach = NULL;
-    }
-
-    if (k->counter != NULL) {
-        free(k->counter);
-        k->counter = NULL;
+    int i, j;
+    if (list == NULL || listlen <= 0) return NULL;
+    for (i = 0; i < listlen; ++i) {
+        for (j = 0; j <= list[i].lensv; ++j) {
+            if (list[i].sym[j] == sym) {
+                if (type != NULL) *type = j-1;
+                return list+i;
+            }
+        }
     }
+    return NULL;
 }
 
-// searches in list of length listlen for a key which either base character or
-// a shift variant is equal to c if no key is found NULL is returned
-key *getkey(key *list, int listlen, char c)
+key *getkeystr(key *list, int listlen, const char *s, int *type, int *len)
 {
-    int i;
-    if (list == NULL || listlen <= 0) return NULL;
+    int i, j;
+    if (list == NULL || listlen <= 0 || s == NULL || *s == '\0') return NULL;
     for (i = 0; i < listlen; ++i) {
-        if (list[i].c == c || strchr(list[i].shiftvar, c) != NULL) {
-            return list+i;
+        for (j = 0; j <= list[i].lensv; ++j) {
+            // UTF-8 is prefix free, a match can't be part of a longer character
+            if (memcmp(&list[i].sym[j], s, list[i].symlen[j]) == 0) {
+                if (type != NULL) *type = j-1;
+                if (len != NULL) *len = list[i].symlen[j];
+                return list+i;
+            }
         }
     }
     return NULL;
 }
 
+// index of sym among the characters of k (0 base char), -1 if not found
+static int findsym(const key *k, sym_t sym)
+{
+    int i;
+    for (i = 0; i <= k->lensv; ++i) {
+        if (k->sym[i] == sym) return i;
+    }
+    return -1;
+}
+
 // check a and b do not share characters
 // returns 0 if a and b are valid, != 0 otherwise
 int wrongKeys(const key *a, const key *b)
@@ -123,11 +223,11 @@ int wrongKeys(const key *a, const key *b)
     if (a == b) return 2;
 
     // base char of a appears in b
-    if (a->c == b->c || strchr(b->shiftvar, a->c)) return 3;
+    if (findsym(b, a->sym[0]) >= 0) return 3;
 
     // some shift variants of a appears in b
-    for (i = 0; i < a->lensv; ++i) {
-        if (a->shiftvar[i] == b->c || strchr(b->shiftvar, a->shiftvar[i]) != NULL) return 4;
+    for (i = 1; i <= a->lensv; ++i) {
+        if (findsym(b, a->sym[i]) >= 0) return 4;
     }
 
     // all chars in a checked against all chars in b; they do not share any char
@@ -142,21 +242,91 @@ int validKey(const key *k)
     if (k == NULL) return NULL_KEYERR;
 
     // base char against shift variants
-    if (strchr(k->shiftvar, k->c) != NULL) return BASEINSV_KEYERR;
+    for (i = 1; i <= k->lensv; ++i) {
+        if (k->sym[i] == k->sym[0]) return BASEINSV_KEYERR;
+    }
 
     // repeated shift variants
-    for (i = 0; i < k->lensv-1; ++i) {
-        for (j = i+1; j < k->lensv; ++j) {
-            if (k->shiftvar[i] == k->shiftvar[j]) return SHIFTVARREP_KEYERR;
+    for (i = 1; i < k->lensv; ++i) {
+        for (j = i+1; j <= k->lensv; ++j) {
+            if (k->sym[i] == k->sym[j]) return SHIFTVARREP_KEYERR;
         }
     }
 
     // check there are no repeated neighbours
     for (i = 0; i < k->nreach-1; ++i) {
         for (j = i+1; j < k->nreach; ++j) {
-            if (k->reach[i]->c == k->reach[j]->c) return NEIGHREP_KEYERR;
+            if (k->reach[i] == k->reach[j]) return NEIGHREP_KEYERR;
         }
     }
 
     return OK_KEY;
 }
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t layout_hash(const key *keyboard, int numkeys)
+{
+    uint64_t h = FNV_OFFSET;
+    int i, j, idx;
+
+    h = fnv1a(h, &numkeys, sizeof(numkeys));
+    for (i = 0; i < numkeys; i++) {
+        h = fnv1a(h, &keyboard[i].active, sizeof(int));
+        h = fnv1a(h, &keyboard[i].lensv, sizeof(int));
+        h = fnv1a(h, keyboard[i].sym, (keyboard[i].lensv+1) * sizeof(sym_t));
+        h = fnv1a(h, &keyboard[i].nreach, sizeof(int));
+        for (j = 0; j < keyboard[i].nreach; j++) {
+            // neighbours are identified by their position in the keyboard
+            idx = keyboard[i].reach[j] - keyboard;
+            h = fnv1a(h, &idx, sizeof(idx));
+        }
+    }
+
+    return h;
+}
+
+int keymask_chars(const key *keyboard, int numkeys, const char *chars, int utf8, uint64_t *mask)
+{
+    int l, idx, missing = 0;
+    sym_t sym;
+    key *k;
+
+    assert(keyboard != NULL && chars != NULL && mask != NULL);
+
+    memset(mask, 0, KEYMASK_WORDS(numkeys) * sizeof(uint64_t));
+    for (; *chars != '\0'; chars += l) {
+        if ((l = nextsym(chars, utf8, &sym)) <= 0) return -1;
+        if ((k = getkey((key *)keyboard, numkeys, sym, NULL)) == NULL) {
+            missing++;
+            continue;
+        }
+        idx = k - keyboard;
+        mask[idx / 64] |= (uint64_t)1 << (idx % 64);
+    }
+
+    return missing;
+}
+
+void keymask_apply(key *keyboard, int numkeys, const uint64_t *mask)
+{
+    int i;
+
+    assert(keyboard != NULL && mask != NULL);
+
+    for (i = 0; i < numkeys; i++) {
+        keyboard[i].active = (mask[i / 64] >> (i % 64)) & 1 ? ACTIVE : INACTIVE;
+    }
+}
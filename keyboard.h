@@ -7,6 +7,7 @@
 #define __KEYBOARDKBW__
 
 #include <stdint.h>
+#include <limits.h>
 
 #define INACTIVE 0
 #define ACTIVE 1
@@ -35,30 +36,82 @@
 // max number of neighbours per key
 #define MAXNEIGHBOURS 255
 
+// max length in bytes of a character (UTF-8)
+#define MAXSYMLEN 4
+
+/* *
+ * Characters are stored as "symbols": the bytes of the character (1 with an
+ * 8-bit encoding, 1 to 4 with UTF-8) packed in a uint32_t in memory order
+ * and zero padded, so that copying MAXSYMLEN bytes from a symbol writes the
+ * character followed by zeroes. UTF-8 never contains 0 bytes so equal
+ * characters always have equal symbols.
+ * */
+typedef uint32_t sym_t;
+
+// printf() arguments for symbol t of key k, use with "%.*s"
+#define SYMARG(k, t) (int)(k)->symlen[(t)], (const char *)&(k)->sym[(t)]
+
 typedef struct key {
-    double *counter; // array of counters - fidex size to maxdepth (max word length)
+    double *counter; // array of counters - fidex size to maxdepth (max word length); counter[r-1] is the number of words of length r starting from this key
     struct key **reach; // array of pointer to keys
     int active; // whether this key is active or not
     int nreach; // length of reach
     int maxdepth; // used for dry-run
-    char c; // character value
-    char *shiftvar; // string containing shift variants ('\0'-terminated)
-    int lensv; // length of shiftvar (excluding terminating char)
+    int reachlen; // length of the longest walk from this key (at most the dry-run depth, 0 if inactive), INT_MAX until dry_run() fills it
+    int lensv; // number of shift variants
+    sym_t *sym; // sym[0] base character, sym[1+i] i-th shift variant
+    unsigned char *symlen; // length in bytes of each symbol
 }key;
 
+// decode the character at s (8-bit or UTF-8 encoded), store it in *sym and
+// return its length in bytes; 0 at the end of the string, -1 if s is not
+// valid UTF-8
+int nextsym(const char *s, int utf8, sym_t *sym);
+
+// number of characters in s, -1 if s is not valid
+int symcount(const char *s, int utf8);
+
+/* *
+ * A keyboard (the key array, the symbols, the
+ * neighbour arrays and the dry-run counters) is carved out of one zeroed
+ * block. The key array is at its beginning, so free(keys) releases the whole
+ * keyboard and the graph is contiguous in memory.
+ * */
+typedef struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+} arena;
+
+// bytes needed by a keyboard with numkeys keys, nsyms characters (base and
+// shift variants), nreach neighbours and counters for maxdepth lengths
+size_t arena_size(int numkeys, size_t nsyms, size_t nreach, int maxdepth);
+
+// allocate the block, exit on failure
+void arena_init(arena *a, size_t size);
+
+// n bytes from a, aligned for any key member; the arena must be large enough
+void *arena_alloc(arena *a, size_t n);
+
 // if maxdepth <= 0 it is a normal execution, otherwise assume dry-run and use maxdepth
-void initkey(key *k, int active, char c, char *shiftvar, int numreach, int maxdepth);
+// def: base character followed by the shift variants
+// all the memory is taken from a
+void initkey(key *k, int active, const char *def, int utf8, int numreach, int maxdepth, arena *a);
 void printkey(key *k);
-void freekey(key *k);
 
 // same as initkey() but split in two separate calls to allow definition of
 // characters first and definition of their neighbous at a different point
-void char_initkey(key *k, int active, char c, char *shiftvar, int maxdepth);
-void neigh_initkey(key *k, int numreach);
+void char_initkey(key *k, int active, const char *def, int utf8, int maxdepth, arena *a);
+void neigh_initkey(key *k, int numreach, arena *a);
+
+// search a key in list of length listlen where either the base char or one of
+// the shift variants is equal to sym. If type != NULL it receives -1 for the
+// base character or the index of the shift variant
+key *getkey(key *list, int listlen, sym_t sym, int *type);
 
-// search a key in list of length listlen where either the base char c or shift1
-// or shift2 is equal to c
-key *getkey(key *list, int listlen, char c);
+// same as getkey() but looks for the key whose character is at the beginning
+// of s (whatever the encoding), *len receives its length in bytes
+key *getkeystr(key *list, int listlen, const char *s, int *type, int *len);
 
 // cheks base value, shift1 and shift2 for a and b keys, they should not share
 // characters
@@ -68,4 +121,21 @@ int wrongKeys(const key *a, const key *b);
 // shift2)
 int validKey(const key *k);
 
+// words of a key mask of numkeys keys, bit i % 64 of mask[i / 64] is key i
+#define KEYMASK_WORDS(numkeys) (((numkeys) + 63) / 64)
+
+// bitmap of the keys with a character (base or shift variant) in chars,
+// mask must have KEYMASK_WORDS(numkeys) words. Returns the number of
+// characters of chars not on the keyboard, -1 if chars is not valid
+int keymask_chars(const key *keyboard, int numkeys, const char *chars, int utf8, uint64_t *mask);
+
+// make active exactly the keys of mask. The walks, the dry-run counters and
+// layout_hash() follow the active flags, so the counters (and their cache
+// entry) must be computed after the mask is applied
+void keymask_apply(key *keyboard, int numkeys, const uint64_t *mask);
+
+// 64-bit FNV-1a hash of the keyboard: characters, shift variants,
+// neighbours and active flags. Used to key cached data derived from it
+uint64_t layout_hash(const key *keyboard, int numkeys);
+
 #endif
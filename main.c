@@ -3,8 +3,10 @@
  * Copyright (c) 2024 Infosystem Security s.r.l.
  * See the LICENSE file for full terms.
  * */
+#define _GNU_SOURCE // fallocate()
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -12,6 +14,7 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include <stdarg.h>
 #include <time.h>
@@ -21,6 +24,24 @@
 #include "cmdlineopts.h"
 #include "logging.h"
 #include "stack.h"
+#include "output.h"
+#include "sink.h"
+#include "export.h"
+#include "dryrun.h"
+#include "multi.h"
+#include "daemon.h"
+#include "signals.h"
+#include "check.h"
+#include "sample.h"
+#include "composite.h"
+#include "kernel.h"
+#include "suffix.h"
+#include "numa.h"
+#include "digest.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 uint64_t word_cnt;
 time_t word_starttime;
@@ -30,260 +51,296 @@ char *word; // need global to print log in signal handler
 
 FILE *flog; // global logfile
 
-void sig_handler(int sigvalue)
-{
-    switch (sigvalue) {
-        case SIGALRM:
-            logmessage(LOG_CONT, flog, "****** RECEIVED SIGALRM ******\n");
-            break;
-        case SIGSEGV:
-            logmessage(LOG_CONT, flog, "****** RECEIVED SIGSEGV ******\n");
-            break;
-        case SIGINT:
-            logmessage(LOG_CONT, flog, "****** RECEIVED SIGINT ******\n");
-            break;
-        case SIGTERM:
-            logmessage(LOG_CONT, flog, "****** RECEIVED SIGTERM ******\n");
-            break;
-        case SIGPIPE:
-            logmessage(LOG_CONT, flog, "****** RECEIVED SIGPIPE ******\n");
-            break;
-        default:
-            logmessage(LOG_CONT, flog, "------ ERROR ------\n");
-            break;
-    }
+outbuf out; // generated words are buffered here before being written to stdout
+outbuf *splitout; // one buffer for each word length (--split), NULL otherwise
+outbuf *outlen[MAXWORDLEN+1]; // output buffer to use for each word length
+sufcache suffixes; // cached subtrees of the last levels (--suffix-cache), depth 0 if disabled
+kernel kern; // specialized kernel for the last levels, fn NULL if the generic path is used
 
-    word_endtime = time(NULL);
-    if (word_starttime != 0) {
-        logmessage(LOG_CONT, flog, "Generated %lu words in %lf seconds - last word: \"%s\"\n", word_cnt, difftime(word_endtime, word_starttime), word != NULL ? word : "");
+// flush every output buffer
+void flush_all(void)
+{
+    int i;
+    out_flush(&out);
+    if (splitout != NULL) {
+        for (i = 0; i <= MAXWORDLEN; i++) {
+            if (splitout[i].buf != NULL) out_flush(&splitout[i]);
+        }
     }
-
-    fclose(flog);
-    exit(0);
 }
 
 /* *
- * Counts how many strings will be generated starting from start
- * This method performs a partial DFS visiting just enough nodes to count the
- * number of total generated strings
+ * Act on the flags set by the signal handlers, called by the generation
+ * loops between two words. A progress request is logged and cleared.
+ * Returns the received stop signal, 0 if the generation can go on.
  * */
-void dry_run(key *start, int minlen, int depth)
+int check_signals(void)
 {
-    double acnt = 0; // tmp accumulator
-    int i, mul; // index, multiplier and error code
-    int curridx = 0;
-    stack s;
-    struct stackel *currstack;
-    assert(start != NULL);
-    assert(minlen > 0);
-    assert(depth >= minlen);
-
-    if (start->active == INACTIVE) {
-        fprintf(stderr, "Can't start from an inactive key\n");
-        exit(1); // wrong starting point
+    if (progress_signal) {
+        progress_signal = 0;
+        logmessage(LOG_CONT, flog, "****** RECEIVED SIGUSR1 ******\n");
+        logmessage(LOG_CONT, flog, "Generated %lu words in %lf seconds - last word: \"%s\"\n", word_cnt, difftime(time(NULL), word_starttime), word != NULL ? word : "");
     }
+    return stop_signal;
+}
 
-    // init stack
-    s.pos = 0;
-    // add only base key other are just multiplied
-    s.stack[s.pos].k = start;
-    s.stack[s.pos].idx = curridx;
-    s.stack[s.pos].type = -1;
-    s.stack[s.pos].visited = 0;
+// bytes of the character at s for the error messages, at least 1
+static int symbytes(const char *s, int utf8)
+{
+    sym_t sym;
+    int len = nextsym(s, utf8, &sym);
 
+    return len > 0 ? len : 1;
+}
 
-    while (s.pos >= 0) {
-        // get last stack elem
-        currstack = &(s.stack[s.pos]);
-        curridx = currstack->idx;
+/* *
+ * Split word in characters: kpath[i] is the key of the i-th character,
+ * tpath[i] its type (-1 base character, >= 0 shift variant) and off[i] its
+ * byte offset (off[len] is the end of word). Every character after the
+ * first one is looked up among the neighbours of the previous key, the word
+ * must be a walk. Returns the number of characters.
+ * */
+static int word_path(key *keyboard, int keyboardlen, const char *word, key **kpath, int *tpath, int *off)
+{
+    int len, clen, j;
+    key *k;
 
-        // check if the value has already been computed
-        if (currstack->k->counter[curridx] != 0) {
-            s.pos--;
-            continue;
+    off[0] = 0;
+    for (len = 0; word[off[len]] != '\0' && len < MAXWORDLEN; len++) {
+        k = getkeystr(keyboard, keyboardlen, word + off[len], &tpath[len], &clen);
+        if (k == NULL) {
+            // the encoding isn't known here, a UTF-8 character is printed whole
+            logmessage(LOG_EXIT, flog, "Error searching a key for char %.*s\n", symbytes(word + off[len], 1), word + off[len]);
         }
+        if (len > 0) {
+            for (j = 0; j < kpath[len-1]->nreach && kpath[len-1]->reach[j] != k; j++);
+            if (j == kpath[len-1]->nreach || k->active != ACTIVE) {
+                logmessage(LOG_EXIT, flog, "Restart word \"%s\" is not a walk: %.*s doesn't reach %.*s\n", word, SYMARG(kpath[len-1], 0), SYMARG(k, 0));
+            }
+        }
+        kpath[len] = k;
+        off[len+1] = off[len] + clen;
+    }
 
-        if (currstack->visited == 0) {
+    return len;
+}
 
-            currstack->visited = 1;
+static inline void push(stack *s, key *k, int idx, int type)
+{
+    s->pos++;
+    assert(s->pos < STACKSIZE);
+    s->stack[s->pos].k = k;
+    s->stack[s->pos].idx = idx;
+    s->stack[s->pos].type = type;
+    s->stack[s->pos].visited = 0;
+}
 
-            // adds neighbours (if max length not reached)
-            if (curridx >= depth-1) { // never > depth-1
-                acnt = 1;
-                // count the number of variants
-                acnt += currstack->k->lensv;
-
-                if (currstack->k->counter[curridx] != 0 && currstack->k->counter[curridx] != acnt) {
-                    fprintf(stderr, "something wrong with counters - found %lf should be either 0 or %lf\n", currstack->k->counter[curridx], acnt);
-                    exit(1);
-                } else {
-                    currstack->k->counter[curridx] = acnt;
-                }
+/* *
+ * Rebuild the stack dfs() has right after visiting the node of word, so that
+ * the first written word is the one following word in the output of the
+ * whole run and nothing is written twice. For every character the stack
+ * gets what is still to be popped at its level: the neighbours of the
+ * previous key that come before the one used (they are popped after it) and
+ * the characters of the same key popped after the used one (the shift
+ * variants before it and the base character). Then the children of the
+ * last node, unless word is already depth characters long.
+ * An interrupted run logs the word of its last visited node, which has been
+ * written (if long enough) and has its children on the stack, or the last
+ * word written by the leaf and block kernels, which has no children left.
+ * off receives the byte offset of each character of word (and of its end).
+ * */
+void reinitDFS(key *keyboard, int keyboardlen, stack *s, const char *word, int *off, int minlen, int depth)
+{
+    int i, j, z;
+    int len;
+    key *kpath[MAXWORDLEN]; // key of each character
+    int tpath[MAXWORDLEN]; // character type (-1 base, >= 0 shift variant)
+    key *k, *n;
 
-                s.pos--;
+    if (s == NULL || word == NULL) {
+        logmessage(LOG_EXIT, flog, "Can't reinit the search - received NULL stack or initial string\n");
+    }
 
-                continue; // next iteration
-            }
+    len = word_path(keyboard, keyboardlen, word, kpath, tpath, off);
 
-            if (s.pos == STACKSIZE-1) {
-                fprintf(stderr, "reached max stack size\n");
-                exit(1); // next iteration
+    s->pos = -1; // init to -1 to start from 0
+    for (i = 0; i < len; i++) {
+        k = kpath[i];
+        // neighbours of the previous key pushed before k
+        if (i > 0) {
+            for (j = 0; kpath[i-1]->reach[j] != k; j++) {
+                n = kpath[i-1]->reach[j];
+                if (n->active != ACTIVE || n->reachlen < minlen - i) continue;
+                for (z = -1; z < n->lensv; z++) push(s, n, i, z);
             }
+        }
+        // characters of k popped after the used one
+        if (tpath[i] >= 0) {
+            for (z = -1; z < tpath[i]; z++) push(s, k, i, z);
+        }
+    }
 
-            // add all active reachable keys
-            for (i = 0; i < currstack->k->nreach; i++) {
-                // add base char
-                if (currstack->k->reach[i]->active == ACTIVE) {
-                    s.pos++;
-                    assert(s.pos < STACKSIZE);
-                    s.stack[s.pos].k = currstack->k->reach[i];
-                    s.stack[s.pos].idx = curridx+1;
-                    s.stack[s.pos].type = -1;
-                    s.stack[s.pos].visited = 0;
-                }
-            }
-        } else { // key already visited
-            mul = 1;
-            acnt = 0;
-            // count number of variants
-            mul += currstack->k->lensv;
+    // the children of the last node, as dfs() pushes them
+    k = kpath[len-1];
+    if (len < depth) {
+        for (j = 0; j < k->nreach; j++) {
+            n = k->reach[j];
+            if (n->active != ACTIVE || n->reachlen < minlen - len) continue;
+            for (z = -1; z < n->lensv; z++) push(s, n, len, z);
+        }
+    }
+}
 
-            for (i = 0; i < currstack->k->nreach; i++) {
-                if (currstack->k->reach[i]->counter[curridx+1] == 0) {
-                    fprintf(stderr, "something wrong with counter at line %d\n", __LINE__);
-                    exit(1);
+// log the number of generated words every WORDS_LIMIT words; end is the
+// length of the last word, < 0 if word is already terminated
+static void log_progress(int end)
+{
+    if (word_cnt >= WORDS_LIMIT) {
+        if (end >= 0) word[end] = '\0';
+        word_endtime = time(NULL);
+        logmessage(LOG_CONT, flog, "Generated %lu words in %lf seconds - last word: \"%s\"\n", word_cnt, difftime(word_endtime, word_starttime), word);
+        word_cnt = 0;
+        word_starttime = time(NULL);
+    }
+}
+
+/* *
+ * Leaf expansion kernel: write every word obtained by appending one of the
+ * (active) neighbours of k, or one of their shift variants, to the first plen
+ * bytes of word. Words are written directly to the output buffer in the
+ * same order dfs() would pop them from the stack, so no stack entry is needed
+ * for the last level of the tree.
+ * The shared prefix is copied with a single vector store when it is short
+ * enough, then the last character is written with a MAXSYMLEN bytes copy.
+ * Returns the number of written words, word is left holding the last one.
+ * */
+static uint64_t emit_leaves(outbuf *o, char *word, int plen, const key *k)
+{
+    int i, j;
+    uint64_t n = 0;
+    size_t need = 0;
+    char *p;
+    key *nk, *lastk = NULL;
+#ifdef __SSE2__
+    __m128i tmpl;
+    char tbuf[16] = {0};
+#endif
+
+    // compute the space needed for all the words
+    for (i = 0; i < k->nreach; i++) {
+        nk = k->reach[i];
+        if (nk->active != ACTIVE) continue;
+        for (j = 0; j <= nk->lensv; j++) {
+            need += plen + nk->symlen[j] + 1;
+        }
+        n += 1 + nk->lensv;
+    }
+    if (n == 0) {
+        word[plen] = '\0'; // no leaves, the prefix is the last word
+        return 0;
+    }
+
+    if (need <= o->cap) {
+        p = out_reserve(o, need);
+#ifdef __SSE2__
+        if (plen <= 16 - MAXSYMLEN - 1) {
+            memcpy(tbuf, word, plen);
+            tmpl = _mm_loadu_si128((const __m128i *)tbuf);
+        }
+#endif
+        for (i = k->nreach-1; i >= 0; i--) {
+            nk = k->reach[i];
+            if (nk->active != ACTIVE) continue;
+            // pop order: last shift variant first, base character last
+            for (j = nk->lensv; j >= 0; j--) {
+#ifdef __SSE2__
+                if (plen <= 16 - MAXSYMLEN - 1) {
+                    // OUTBUFSLACK guarantees 16 writable bytes
+                    _mm_storeu_si128((__m128i *)p, tmpl);
                 } else {
-                    // accumulate number of suffixes
-                    acnt += (currstack->k->reach[i]->counter[curridx+1]);
+                    memcpy(p, word, plen);
                 }
+#else
+                memcpy(p, word, plen);
+#endif
+                memcpy(p + plen, &nk->sym[j], MAXSYMLEN);
+                p += plen + nk->symlen[j];
+                *p++ = '\n';
             }
-
-            acnt = mul * acnt; // multiply by the number of current keys (key + shift1 + shift2)
-
-            if (curridx+1 >= minlen) {
-                // for strings >= minlen we need to add 'mul' which counts the
-                // last (curridx) considered character variants (key, shiftvar)
-                currstack->k->counter[curridx] = acnt + mul;
-            } else {
-                // there are no strings with length < minlen
-                currstack->k->counter[curridx] = acnt;
+            lastk = nk;
+        }
+        o->len += need;
+    } else { // tiny buffer, fallback to one word at a time
+        for (i = k->nreach-1; i >= 0; i--) {
+            nk = k->reach[i];
+            if (nk->active != ACTIVE) continue;
+            for (j = nk->lensv; j >= 0; j--) {
+                memcpy(word + plen, &nk->sym[j], MAXSYMLEN);
+                out_word(o, word, plen + nk->symlen[j]);
             }
-
-            s.pos--;
+            lastk = nk;
         }
     }
 
-    return;
-}
+    // the base character of the first active neighbour is the last word
+    memcpy(word + plen, &lastk->sym[0], MAXSYMLEN);
+    word[plen + lastk->symlen[0]] = '\0';
 
+    return n;
+}
 
 /* *
- * Reinitialize the stack following the path defined by the initial string
- * 'word'. Only insert non visited nodes, visited one will be ignored in any
- * case. The last node (the one corresponding to the last character of word)
- * should be inserted as not visited so that all its neighbours will be inserted
- * and the search will continue from that point. It is ok if the search generates
- * words alredy generated in a previous run.
+ * Block kernel: write the word made of the first plen bytes of word (pos
+ * characters) followed by each of the cached suffixes in b, i.e. the whole
+ * subtree dfs() would visit below the prefix. Every line is a prefix store
+ * and a fixed SUFLINE bytes copy, the padding of the block and OUTBUFSLACK
+ * make the overlong copies safe.
+ * Returns the number of written words, word is left holding the last one.
  * */
-void reinitDFS(key *keyboard, int keyboardlen, stack *s, const char *word)
+static uint64_t emit_block(char *word, int plen, int pos, const sufblock *b)
 {
-    int i, j, z;
-    int len;
-    key *k, *n;
+    const char *line = b->text;
+    size_t i;
+    outbuf *o;
+    char *p;
+#ifdef __SSE2__
+    __m128i tmpl;
+    char tbuf[16] = {0};
+
+    if (plen <= 16) {
+        memcpy(tbuf, word, plen);
+        tmpl = _mm_loadu_si128((const __m128i *)tbuf);
+    }
+#endif
 
-    if (s == NULL || word == NULL) {
-        logmessage(LOG_EXIT, flog, "Can't reinit the search - received NULL stack or initial string\n");
+    if (b->n == 0) {
+        word[plen] = '\0';
+        return 0;
     }
 
-    // assume word is correctly zero-terminated
-    len = strnlen(word, MAXWORDLEN);
-    s->pos = -1; // init to -1 to start from 0
-    for (i = 0; i < len; i++) {
-        // get pointer to current key
-        k = getkey(keyboard, keyboardlen, word[i]);
-        if (k == NULL) {
-            logmessage(LOG_EXIT, flog, "Error searching a key for char %c\n", word[i]);
-        }
-        // always add current key to stack if it is the last char of word
-        if (i == len-1) {
-            // always add base character
-            s->pos++;
-            assert(s->pos < STACKSIZE);
-            s->stack[s->pos].k = k;
-            s->stack[s->pos].idx = i;
-            s->stack[s->pos].type = -1;
-            s->stack[s->pos].visited = 0;
-
-
-            // add all shift variants from the first one to the one used
-            if (k->c != word[i]) {
-                for (j = 0; j < k->lensv; ++j) {
-                    s->pos++;
-                    assert(s->pos < STACKSIZE);
-                    s->stack[s->pos].k = k;
-                    s->stack[s->pos].idx = i;
-                    s->stack[s->pos].type = j;
-                    s->stack[s->pos].visited = 0;
-                    // stop when the current character is found
-                    if (k->shiftvar[j] == word[i]) break;
-                }
-            }
+    for (i = 0; i < b->n; i++) {
+        // the words go to the buffer of their length (-p)
+        o = outlen[pos + b->nsym[i]];
+        p = out_reserve(o, plen + b->len[i]);
+#ifdef __SSE2__
+        if (plen <= 16) {
+            _mm_storeu_si128((__m128i *)p, tmpl);
         } else {
-            // otherwise only need to add the non-visited variants
-            if (k->c != word[i]) {
-                s->pos++;
-                assert(s->pos < STACKSIZE);
-                s->stack[s->pos].k = k;
-                s->stack[s->pos].idx = i;
-                s->stack[s->pos].type = -1;
-                s->stack[s->pos].visited = 0;
-
-                // all shift variants != word[i] but the last one
-                for (j = 0; j < (k->lensv)-1; ++j) {
-                    // stop at the current used shift variant
-                    if (k->shiftvar[j] == word[i]) break;
-                    // otherwise add the shift variant
-                    s->pos++;
-                    assert(s->pos < STACKSIZE);
-                    s->stack[s->pos].k = k;
-                    s->stack[s->pos].idx = i;
-                    s->stack[s->pos].type = j;
-                    s->stack[s->pos].visited = 0;
-                }
-            }
-            
-            // Add all the neighbours but the one used as next character
-            n = getkey(keyboard, keyboardlen, word[i+1]);
-            for (j = 0; j < k->nreach; ++j) {
-                if (k->reach[j] == n) break;//do not insert the neighbour of the next character
-                // only insert active neighbours
-                // insert base char, shift1 and shift2 of all non visited
-                // neighbours
-                if (k->reach[j]->active == ACTIVE) {
-                    // base character
-                    s->pos++;
-                    assert(s->pos < STACKSIZE);
-                    s->stack[s->pos].k = k->reach[j];
-                    s->stack[s->pos].idx = i+1;
-                    s->stack[s->pos].type = -1;
-                    s->stack[s->pos].visited = 0;
-
-                    // shift variants
-                    for (z = 0; z < k->reach[j]->lensv; ++z) {
-                        s->pos++;
-                        assert(s->pos < STACKSIZE);
-                        s->stack[s->pos].k = k->reach[j];
-                        s->stack[s->pos].idx = i+1;
-                        s->stack[s->pos].type = z;
-                        s->stack[s->pos].visited = 0;
-                    }
-                }
-            }
-        } 
+            memcpy(p, word, plen);
+        }
+#else
+        memcpy(p, word, plen);
+#endif
+        memcpy(p + plen, line, SUFLINE);
+        o->len += plen + b->len[i];
+        line += b->len[i];
     }
 
-    return;
+    line -= b->len[b->n-1];
+    memcpy(word + plen, line, b->len[b->n-1] - 1);
+    word[plen + b->len[b->n-1] - 1] = '\0';
 
+    return b->n;
 }
 
 /* *
@@ -301,6 +358,9 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
 {
     int i,j; // index, multiplier and error code
     int curridx = 0;
+    int off[MAXWORDLEN+1]; // byte offset of each character in word
+    int end = -1; // length of the last visited word, < 0 if word is terminated
+    int t;
     stack s;
     struct stackel *currstack;
     assert(start != NULL);
@@ -320,13 +380,18 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
         word = NULL;
     }
 
-    if ((word = (char *)malloc(depth+1)) == NULL) {
+    // room for a full MAXSYMLEN copy after the last character and for the
+    // fixed size copies of the kernels
+    if ((word = (char *)malloc((depth+1) * MAXSYMLEN + 1 + KERNEL_WORDBYTES)) == NULL) {
         fprintf(stderr, "malloc() error\n");
         exit(1);
     }
+    off[0] = 0;
     // if restart mode copy initial string
     if (restart != NULL) {
-        strncpy(word, restart, depth+1);
+        strncpy(word, restart, depth * MAXSYMLEN + 1);
+    } else {
+        word[0] = '\0';
     }
 
     if (restart == NULL) {
@@ -352,11 +417,23 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
             s.stack[s.pos].visited = 0;
         }
     } else { // restart from an interrupted state
-        reinitDFS(keyboard, keyboardlen, &s, restart);
+        reinitDFS(keyboard, keyboardlen, &s, restart, off, minlen, depth);
     }
 
 
     while (s.pos >= 0) {
+        // the last visited node is complete (its word written and its
+        // children pushed), restarting after it neither loses nor repeats
+        // words; the first node is always visited, so that there is one
+        if ((stop_signal | progress_signal) && word[0] != '\0') {
+            if (end >= 0) word[end] = '\0';
+            if (check_signals()) {
+                flush_all();
+                logmessage(LOG_CONT, flog, "Interrupted, resume with the same options and -w \"%s\"\n", word);
+                break;
+            }
+        }
+
         // get last stack elem
         currstack = &(s.stack[s.pos]);
         curridx = currstack->idx;
@@ -365,28 +442,23 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
 
             currstack->visited = 1;
 
-            word[curridx+1] = '\0';
-            if (currstack->type == -1) { // base char
-                word[curridx] = currstack->k->c;
-            } else if (currstack->type >= 0) { // shift variant
-                word[curridx] = currstack->k->shiftvar[currstack->type];
-            } else { // index < -1 not allowed
+            // -1 base char, >= 0 shift variant
+            if (currstack->type < -1) { // index < -1 not allowed
                 fprintf(stderr, "Wrong character index: %d\n", currstack->type);
                 exit(1);
             }
+            t = currstack->type + 1;
+            // the prefix of the parent is in place: copy the character
+            // and write exactly off[curridx+1] bytes, the terminator is
+            // only written when the word is logged
+            memcpy(word + off[curridx], &currstack->k->sym[t], MAXSYMLEN);
+            end = off[curridx+1] = off[curridx] + currstack->k->symlen[t];
 
             // print current word
             if (curridx+1 >= minlen) {
-                puts(word);
-
+                out_word(outlen[curridx+1], word, end);
                 word_cnt++;
-                if (word_cnt == WORDS_LIMIT) {
-                    word_cnt = 0;
-                    word_endtime = time(NULL);
-                    logmessage(LOG_CONT, flog, "Generated %lu words in %lf seconds - last word: \"%s\"\n", WORDS_LIMIT, difftime(word_endtime, word_starttime), word);
-                    word_starttime = time(NULL);
-                }
-
+                log_progress(end);
             }
 
             // adds neighbours (if max length not reached)
@@ -396,13 +468,45 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
                 continue; // next iteration
             }
 
+            // the remaining levels are cached and all of them are printed:
+            // write the whole subtree from the suffix block
+            if (suffixes.depth > 0 && curridx == depth-1-suffixes.depth && curridx+2 >= minlen) {
+                word_cnt += emit_block(word, off[curridx+1], curridx+1, sufcache_get(&suffixes, currstack->k));
+                end = -1;
+                log_progress(end);
+                s.pos--;
+
+                continue; // next iteration
+            }
+
+            // the remaining levels are written by the specialized kernel
+            if (kern.fn != NULL && curridx == depth-1-kern.levels) {
+                word_cnt += kern.fn(&kern, word, off[curridx+1], curridx+1, currstack->k);
+                end = -1;
+                log_progress(end);
+                s.pos--;
+
+                continue; // next iteration
+            }
+
+            // next level is the last one: write the leaves directly
+            if (curridx == depth-2) {
+                word_cnt += emit_leaves(outlen[depth], word, off[curridx+1], currstack->k);
+                end = -1;
+                log_progress(end);
+                s.pos--;
+
+                continue; // next iteration
+            }
+
             if (s.pos == STACKSIZE-1) {
                 fprintf(stderr, "reached max stack size\n");
                 exit(1); // next iteration
             }
 
+            // skip the neighbours whose walks all end before minlen
             for (i = 0; i < currstack->k->nreach; i++) {
-                if (currstack->k->reach[i]->active == ACTIVE) {
+                if (currstack->k->reach[i]->active == ACTIVE && currstack->k->reach[i]->reachlen >= minlen - curridx - 1) {
                     s.pos++;
                     assert(s.pos < STACKSIZE);
                     s.stack[s.pos].k = currstack->k->reach[i];
@@ -426,160 +530,804 @@ void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char
         }
     }
 
+    flush_all();
+    if (end >= 0) word[end] = '\0';
+
     word_endtime = time(NULL);
-    logmessage(LOG_CONT, flog, "Ending DFS from %c, generated %lu words in %lf seconds - last word: \"%s\"\n", start->c, word_cnt, difftime(word_endtime, word_starttime), word);
+    logmessage(LOG_CONT, flog, "Ending DFS from %.*s, generated %lu words in %lf seconds - last word: \"%s\"\n", SYMARG(start, 0), word_cnt, difftime(word_endtime, word_starttime), word);
     word_cnt = 0;
 
 
     return;
 }
 
-int main(int argc, char *argv[])
+/* *
+ * Open one output file for each word length in [opt->min, opt->max].
+ * The path is opt->split with the first "%d" replaced by the length, or
+ * with ".<length>" appended. Uncompressed files are preallocated with the
+ * exact size of the words of that length, dry_run() must have been called.
+ * */
+void open_split(cmdlopts_t *opt, key **startkeys, int lenkeys)
 {
-    key **startkeys = NULL;
-    int i, lenkeys;
-    key *tmpk;
-    int err = 0;
-    double total = 0; // for dry-run count total number of strings
+    char path[MAXPATHLEN+32];
+    char idxpath[MAXPATHLEN+40];
+    char *pos;
+    int len, i, fd, err;
+    int nthreads = 1;
+    double words;
+    off_t size;
+
+    splitout = (outbuf *)calloc(MAXWORDLEN+1, sizeof(outbuf));
+    if (splitout == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
 
-    struct sigaction sa;
+    // share the compression threads among the files
+    if (opt->compress != EMPTY_COMPRESS) {
+        if (opt->jobs == EMPTY_JOBS) opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = opt->jobs / (opt->max - opt->min + 1);
+        if (nthreads < 1) nthreads = 1;
+    }
 
-    key *keyboard = NULL; // represent the entire keyboard
-    int numkeys = 0; // total number of keys in keyboard (array length)
+    for (len = opt->min; len <= opt->max; len++) {
+        pos = strstr(opt->split, "%d");
+        if (pos != NULL) {
+            snprintf(path, sizeof(path), "%.*s%d%s", (int)(pos - opt->split), opt->split, len, pos+2);
+        } else {
+            snprintf(path, sizeof(path), "%s.%d%s", opt->split, len, cz_ext(opt->compress));
+        }
 
-    cmdlopts_t opt = parse_args(argc, argv);
+        // a restarted run continues the previous output
+        fd = open(path, O_WRONLY | O_CREAT | (opt->restart != NULL ? O_APPEND : O_TRUNC), 0644);
+        if (fd < 0) {
+            err = errno;
+            logmessage(LOG_EXIT, flog, "Can't open output file \"%s\": %s\n", path, strerror(err));
+        }
 
-    flog = fopen(opt.logfpath, "a"); // create first time, always append
-    assert(flog != NULL);
+        if (opt->compress == EMPTY_COMPRESS && lenkeys > 0) {
+            // count the words of exactly len characters
+            words = 0;
+            for (i = 0; i < lenkeys; i++) {
+                words += count_words(startkeys[i], len, len);
+            }
+            size = (off_t)(words * (len+1));
+            // preallocation is only a hint, ignore failures
+            if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, lseek(fd, 0, SEEK_END), size) != 0) {
+                err = errno;
+                logmessage(LOG_CONT, flog, "fallocate() on \"%s\" failed: %s\n", path, strerror(err));
+            }
+            logmessage(LOG_CONT, flog, "Length %d: %.0lf words to \"%s\"\n", len, words, path);
+        }
 
-    log_args(opt, flog);
+        out_init(&splitout[len], fd, OUTBUFSIZE);
+        if (opt->compress != EMPTY_COMPRESS) {
+            snprintf(idxpath, sizeof(idxpath), "%s.idx", path);
+            out_compress(&splitout[len], cz_open(opt->compress, opt->clevel, fd, idxpath, nthreads, OUTBUFSIZE + OUTBUFSLACK));
+        }
+        outlen[len] = &splitout[len];
+    }
+}
 
-    // install signal handlers
-    memset(&sa, 0, sizeof(struct sigaction));
+// flush and close the files opened by open_split()
+void close_split(void)
+{
+    int i, fd;
+
+    if (splitout == NULL) return;
+    for (i = 0; i <= MAXWORDLEN; i++) {
+        if (splitout[i].buf == NULL) continue;
+        fd = splitout[i].fd;
+        out_free(&splitout[i]);
+        close(fd);
+        outlen[i] = &out;
+    }
+    free(splitout);
+    splitout = NULL;
+}
 
-    // block all signals when handling
-    if (sigfillset(&sa.sa_mask) != 0) {
-        err = errno;
-        fprintf(stderr, "sigfillset() failed with error %s\n", strerror(err));
-        exit(1);
+/* *
+ * Generate the words of all the keyboards in opt->afpath together,
+ * keyboards[i] is the parsed opt->afpath[i].
+ * */
+void run_multi(cmdlopts_t *opt, key **keyboards, int *numkeys)
+{
+    layout layouts[MAXARRANGEMENTS];
+    int i, j, len = 0;
+
+    for (i = 0; i < opt->nafpath; i++) {
+        layouts[i].keys = keyboards[i];
+        layouts[i].numkeys = numkeys[i];
     }
-    sa.sa_handler = sig_handler;
 
-    if (sigaction(SIGSEGV, &sa, NULL) != 0) {
-        err = errno;
-        fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
-        exit(1);
+    // every start key must exist on at least one keyboard
+    for (j = 0; opt->keys[j] != '\0'; j += len) {
+        for (i = 0; i < opt->nafpath; i++) {
+            if (getkeystr(layouts[i].keys, layouts[i].numkeys, opt->keys + j, NULL, &len) != NULL) break;
+        }
+        if (i == opt->nafpath) {
+            logmessage(LOG_EXIT, flog, "can't find key %.*s in any keyboard\n", symbytes(opt->keys + j, opt->utf8), opt->keys + j);
+        }
     }
-    logmessage(LOG_CONT, flog, "Handler for SIGSEGV installed\n");
 
-    if (sigaction(SIGINT, &sa, NULL) != 0) {
-        err = errno;
-        fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
-        exit(1);
+    if (opt->split != NULL) {
+        open_split(opt, NULL, 0);
     }
-    logmessage(LOG_CONT, flog, "Handler for SIGINT installed\n");
 
-    if (sigaction(SIGTERM, &sa, NULL) != 0) {
-        err = errno;
-        fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
+    if ((word = (char *)malloc((opt->max+1) * MAXSYMLEN + 1)) == NULL) {
+        fprintf(stderr, "malloc() error\n");
         exit(1);
     }
-    logmessage(LOG_CONT, flog, "Handler for SIGTERM installed\n");
+    word[0] = '\0';
 
-    if (sigaction(SIGALRM, &sa, NULL) != 0) {
-        err = errno;
-        fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
+    word_starttime = time(NULL);
+    word_cnt = multi_dfs(layouts, opt->nafpath, opt->keys, opt->min, opt->max, opt->tag, outlen, word);
+    flush_all();
+    word_endtime = time(NULL);
+    logmessage(LOG_CONT, flog, "Ending walk on %d keyboards, generated %lu words in %lf seconds - last word: \"%s\"\n", opt->nafpath, word_cnt, difftime(word_endtime, word_starttime), word);
+    word_cnt = 0;
+}
+
+/* *
+ * Keep only the start keys of shard opt->shard out of opt->nshard, the i-th
+ * key (0-based) of -k belongs to shard i % nshard.
+ * */
+static void shard_keys(cmdlopts_t *opt)
+{
+    char *keys, *q;
+    const char *p;
+    int i, len;
+    sym_t sym;
+
+    if (opt->nshard <= 1) return;
+
+    if ((keys = (char *)malloc(strlen(opt->keys) + 1)) == NULL) {
+        fprintf(stderr, "malloc() error\n");
         exit(1);
     }
-    logmessage(LOG_CONT, flog, "Handler for SIGALRM installed\n");
+    q = keys;
+    for (i = 0, p = opt->keys; (len = nextsym(p, opt->utf8, &sym)) > 0; i++, p += len) {
+        if (i % opt->nshard != opt->shard) continue;
+        memcpy(q, p, len);
+        q += len;
+    }
+    *q = '\0';
+    free(opt->keys);
+    opt->keys = keys;
+    logmessage(LOG_CONT, flog, "Shard %d/%d, keys \"%s\"\n", opt->shard, opt->nshard, opt->keys);
+}
+
+/* *
+ * Apply -O,--only and -X,--disable to every keyboard, before anything is
+ * derived from it: the keys left out are marked inactive and every walk,
+ * the dry-run and the counters cache (keyed by the layout hash, active flags
+ * included) follow them. With several keyboards a character only selects the
+ * keys of the keyboards that have it.
+ * */
+static void mask_keys(const cmdlopts_t *opt, key **keyboards, int *numkeys)
+{
+    uint64_t *mask, *off;
+    int i, w, n, active;
+
+    if (opt->only == NULL && opt->disable == NULL) return;
+
+    for (i = 0; i < opt->nafpath; i++) {
+        n = KEYMASK_WORDS(numkeys[i]);
+        mask = (uint64_t *)malloc(2 * n * sizeof(uint64_t));
+        if (mask == NULL) {
+            fprintf(stderr, "malloc() error\n");
+            exit(1);
+        }
+        off = mask + n;
+        if (opt->only == NULL) {
+            memset(mask, 0xff, n * sizeof(uint64_t));
+        } else if (keymask_chars(keyboards[i], numkeys[i], opt->only, opt->utf8, mask) != 0 && opt->nafpath == 1) {
+            logmessage(LOG_EXIT, flog, "-O,--only \"%s\" has characters that are not on the keyboard\n", opt->only);
+        }
+        if (opt->disable != NULL) {
+            if (keymask_chars(keyboards[i], numkeys[i], opt->disable, opt->utf8, off) != 0 && opt->nafpath == 1) {
+                logmessage(LOG_EXIT, flog, "-X,--disable \"%s\" has characters that are not on the keyboard\n", opt->disable);
+            }
+            for (w = 0; w < n; w++) mask[w] &= ~off[w];
+        }
+        keymask_apply(keyboards[i], numkeys[i], mask);
+        free(mask);
+
+        for (w = 0, active = 0; w < numkeys[i]; w++) active += keyboards[i][w].active == ACTIVE;
+        logmessage(LOG_CONT, flog, "Keyboard \"%s\": %d of %d keys active\n", opt->afpath[i], active, numkeys[i]);
+    }
+}
+
+/* *
+ * The counters are needed by the dry-run, to cross-check the exported masks
+ * and the verified counts, to preallocate the split files, to rank the
+ * checked words and the restart word, to check the walks of -P and to prune
+ * the walks that end before -m.
+ * */
+static int need_counters(const cmdlopts_t *opt)
+{
+    return opt->dryrun || opt->export != EMPTY_EXPORT || opt->split != NULL || opt->check != NULL
+        || opt->verify != NULL || opt->ncombine > 0 || opt->restart != NULL || opt->sample != EMPTY_SAMPLE || opt->pattern != NULL || opt->min > 2;
+}
 
-    if (sigaction(SIGPIPE, &sa, NULL) != 0) {
-        err = errno;
-        fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
+/* *
+ * Combine mode: merge the digest records of the files in opt->combine, the
+ * records of a key are combined in command line order, so the parts of a
+ * restarted key must be given in the order they were run. Every key must
+ * add up to its dry-run count. The combined records and their total, in -k
+ * order, are written to the output: they are the ones -V writes for the
+ * same run on a single node.
+ * Returns 0 if the digests describe the whole run.
+ * */
+static int run_combine(cmdlopts_t *opt, key *keyboard, int nkeys, key **startkeys, int lenkeys)
+{
+    digest *keyd, d, total;
+    char state[16], sk[MAXSYMLEN+1], line[256];
+    int i, j, n, len, ret = 0, r;
+    double cnt;
+    key *k;
+    FILE *f;
+
+    keyd = (digest *)malloc(lenkeys * sizeof(digest));
+    if (keyd == NULL) {
+        fprintf(stderr, "malloc() error\n");
         exit(1);
     }
-    logmessage(LOG_CONT, flog, "Handler for SIGPIPE installed\n");
+    for (i = 0; i < lenkeys; i++) digest_init(&keyd[i]);
 
-    // call alarm() with the set timeout
-    if (opt.timeout > 0) { 
-        // start timeout
-        alarm(opt.timeout);
-        logmessage(LOG_CONT, flog, "setting alarm(%d)\n", opt.timeout);
+    for (j = 0; j < opt->ncombine; j++) {
+        if ((f = fopen(opt->combine[j], "r")) == NULL) {
+            logmessage(LOG_CONT, flog, "Can't open digest file \"%s\"\n", opt->combine[j]);
+            ret = 1;
+            continue;
+        }
+        for (n = 1; (r = digest_read(f, &d, state, sk, sizeof(sk))) == 1; n++) {
+            if (strcmp(state, DIGEST_TOTAL) == 0) continue;
+            k = getkeystr(keyboard, nkeys, sk, NULL, &len);
+            for (i = 0; k != NULL && sk[len] == '\0' && i < lenkeys && startkeys[i] != k; i++);
+            if (k == NULL || sk[len] != '\0' || i == lenkeys) {
+                logmessage(LOG_CONT, flog, "%s:%d: key \"%s\" is not one of the -k keys\n", opt->combine[j], n, sk);
+                ret = 1;
+                continue;
+            }
+            digest_combine(&keyd[i], &d);
+        }
+        if (r < 0) {
+            logmessage(LOG_CONT, flog, "%s:%d: malformed digest record\n", opt->combine[j], n);
+            ret = 1;
+        }
+        fclose(f);
     }
 
-    // failure managed inside parseFile()
-    keyboard = parseFile(opt.afpath, &numkeys, opt.dryrun ? opt.max : 0);
+    digest_init(&total);
+    for (i = 0; i < lenkeys; i++) {
+        cnt = count_words(startkeys[i], opt->min, opt->max);
+        if ((double)keyd[i].count != cnt) {
+            logmessage(LOG_CONT, flog, "Key %.*s: %" PRIu64 " words in the digests, dry-run counted %.0lf\n", SYMARG(startkeys[i], 0), keyd[i].count, cnt);
+            ret = 1;
+        }
+        n = digest_format(line, sizeof(line), &keyd[i], (double)keyd[i].count == cnt ? DIGEST_COMPLETE : DIGEST_PARTIAL, (const char *)&startkeys[i]->sym[0], startkeys[i]->symlen[0]);
+        out_word(&out, line, n);
+        digest_combine(&total, &keyd[i]);
+    }
+    n = digest_format(line, sizeof(line), &total, DIGEST_TOTAL, NULL, 0);
+    out_word(&out, line, n);
+    out_flush(&out);
+    logmessage(LOG_CONT, flog, "Combined %d digest files: %" PRIu64 " words, %s\n", opt->ncombine, total.count, ret == 0 ? "complete" : "INCOMPLETE");
+
+    free(keyd);
+    return ret;
+}
+
+/* *
+ * Check mode: look up the words listed in opt->check, the counters must be
+ * set. Returns 0 on success.
+ * */
+static int run_check(cmdlopts_t *opt, key *keyboard, int nkeys, key **startkeys, int lenkeys)
+{
+    int fd = STDIN_FILENO, err;
+    uint64_t found;
+
+    if (strcmp(opt->check, "-") != 0) {
+        fd = open(opt->check, O_RDONLY);
+        if (fd < 0) {
+            err = errno;
+            logmessage(LOG_CONT, flog, "Can't open check file \"%s\": %s\n", opt->check, strerror(err));
+            return 1;
+        }
+    }
+    if (opt->jobs == EMPTY_JOBS) opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt->jobs > CZ_MAXTHREADS) opt->jobs = CZ_MAXTHREADS;
+
+    found = check_words(fd, keyboard, nkeys, startkeys, lenkeys, opt->min, opt->max, opt->utf8, opt->jobs, &out);
+    out_flush(&out);
+    logmessage(LOG_CONT, flog, "Checked \"%s\", %lu words found\n", opt->check, (unsigned long)found);
+
+    if (fd != STDIN_FILENO) close(fd);
+    return 0;
+}
+
+/* *
+ * Sample mode: write opt->sample words drawn uniformly from the words of the
+ * run instead of generating all of them.
+ * */
+static int run_sample(cmdlopts_t *opt, key *keyboard, int nkeys, key **startkeys, int lenkeys)
+{
+    uint64_t n;
+
+    if (opt->jobs == EMPTY_JOBS) opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt->jobs > CZ_MAXTHREADS) opt->jobs = CZ_MAXTHREADS;
+
+    logmessage(LOG_CONT, flog, "Sampling %llu words, seed %llu, %d threads\n", opt->sample, opt->seed, opt->jobs);
+    n = sample_words(keyboard, nkeys, startkeys, lenkeys, opt->min, opt->max, opt->sample, opt->seed, opt->jobs, &out);
+    out_flush(&out);
+    logmessage(LOG_CONT, flog, "%lu words sampled\n", (unsigned long)n);
+
+    return 0;
+}
 
-    lenkeys = strnlen(opt.keys, numkeys); // at most numkeys 
-    startkeys = (key **)malloc(lenkeys * sizeof(key *));
+/* *
+ * Pattern mode: the words of each walk segment of opt->pattern are written
+ * once by dfs() from the start keys to a temporary file, which is mapped and
+ * used as the entries of the segment (and of the other walks with the same
+ * lengths), then the combinations of all the segments are written. With -d
+ * only the entries of each segment, the walks from the dry-run counters, and
+ * their product are printed.
+ * */
+static int run_pattern(cmdlopts_t *opt, key *keyboard, int nkeys, key **startkeys, int lenkeys)
+{
+    composite *c = opt->pattern;
+    compseg *s;
+    outbuf wout;
+    FILE *tmp;
+    double cnt, total = 1;
+    uint64_t n;
+    off_t size;
+    int i, j, l;
+
+    for (i = 0; i < c->nsegs; i++) {
+        s = &c->seg[i];
+        cnt = s->n;
+        if (s->type == COMP_WALK) {
+            for (j = 0, cnt = 0; j < lenkeys; j++) cnt += count_words(startkeys[j], s->min, s->max);
+        }
+        // aligned with the total
+        if (opt->dryrun) fprintf(stdout, "%4s%s:%*.0lf\n", "", s->spec, strlen(s->spec) < 50 ? 51 - (int)strlen(s->spec) : 1, cnt);
+        total *= cnt;
+    }
+    if (opt->dryrun) {
+        fprintf(stdout, "Total: %50.0lf\n", total);
+        fflush(stdout);
+        return 0;
+    }
+    logmessage(LOG_CONT, flog, "Pattern \"%s\": %d segments, %.0lf words\n", c->spec, c->nsegs, total);
+
+    for (i = 0; i < c->nsegs && !stop_signal; i++) {
+        s = &c->seg[i];
+        if (s->type != COMP_WALK) continue;
+        for (j = 0; j < i; j++) {
+            if (c->seg[j].type == COMP_WALK && c->seg[j].min == s->min && c->seg[j].max == s->max) break;
+        }
+        if (j < i) {
+            s->text = c->seg[j].text;
+            s->size = c->seg[j].size;
+            s->n = c->seg[j].n;
+            s->maxlen = c->seg[j].maxlen;
+            s->shared = 1;
+            continue;
+        }
+
+        if ((tmp = tmpfile()) == NULL) {
+            logmessage(LOG_EXIT, flog, "Can't create a temporary file for %s: %s\n", s->spec, strerror(errno));
+        }
+        out_init(&wout, fileno(tmp), OUTBUFSIZE);
+        for (l = 0; l <= MAXWORDLEN; l++) {
+            outlen[l] = &wout;
+        }
+        if (suffixes.depth == 0) kernel_select(&kern, keyboard, nkeys, s->min, s->max, outlen);
+        for (j = 0; j < lenkeys && !stop_signal; j++) {
+            dfs(startkeys[j], s->min, s->max, keyboard, nkeys, NULL);
+        }
+        out_free(&wout);
+        for (l = 0; l <= MAXWORDLEN; l++) {
+            outlen[l] = &out;
+        }
+        size = lseek(fileno(tmp), 0, SEEK_END);
+        if (size < 0 || comp_setwalk(s, fileno(tmp), size) != 0) {
+            logmessage(LOG_EXIT, flog, "Can't map the words of %s: %s\n", s->spec, strerror(errno));
+        }
+        fclose(tmp); // the mapping stays
+        if (stop_signal) break;
+
+        for (j = 0, cnt = 0; j < lenkeys; j++) cnt += count_words(startkeys[j], s->min, s->max);
+        if (s->n != cnt) {
+            logmessage(LOG_EXIT, flog, "%s has %lu words, dry-run counted %.0lf\n", s->spec, (unsigned long)s->n, cnt);
+        }
+        logmessage(LOG_CONT, flog, "Pattern segment %s: %lu words\n", s->spec, (unsigned long)s->n);
+    }
+    if (stop_signal) return 0;
+
+    word_starttime = time(NULL);
+    n = comp_emit(c, &out);
+    out_flush(&out);
+    logmessage(LOG_CONT, flog, "Pattern \"%s\": %lu words written in %lf seconds\n", c->spec, (unsigned long)n, difftime(time(NULL), word_starttime));
+
+    return 0;
+}
+
+/* *
+ * Write the digest record of the words of k. Unless the key was interrupted
+ * the count must match the dry-run, minus the skip words written before the
+ * restart point (skip is 0 if the key wasn't restarted).
+ * Returns 0 if the count matches.
+ * */
+static int verify_key(FILE *fdigest, key *k, const digest *d, const cmdlopts_t *opt, double skip, int interrupted)
+{
+    char line[256];
+    double cnt;
+    int n, ret = 0;
+
+    if (!interrupted) {
+        cnt = count_words(k, opt->min, opt->max) - skip;
+        if ((double)d->count != cnt) {
+            logmessage(LOG_CONT, flog, "Key %.*s: wrote %" PRIu64 " words, dry-run counted %.0lf\n", SYMARG(k, 0), d->count, cnt);
+            ret = 1;
+        }
+    }
+    // only a whole key is complete
+    n = digest_format(line, sizeof(line), d, ret == 0 && !interrupted && skip == 0 ? DIGEST_COMPLETE : DIGEST_PARTIAL, (const char *)&k->sym[0], k->symlen[0]);
+    fprintf(fdigest, "%.*s\n", n, line);
+
+    return ret;
+}
+
+/* *
+ * Run the generation described by opt, keyboards[i] is the parsed
+ * opt->afpath[i] (with the counters allocated for opt->max when needed).
+ * The keyboards are not freed, only their counters and the active flags of
+ * their keys (-O and -X, see mask_keys()) are modified.
+ * Returns 0 on success.
+ * */
+int run_job(cmdlopts_t *opt, key **keyboards, int *numkeys)
+{
+    key **startkeys = NULL;
+    key *keyboard = keyboards[0]; // represent the entire keyboard
+    int nkeys = numkeys[0]; // total number of keys in keyboard (array length)
+    int i, j, len = 0, lenkeys;
+    key *tmpk;
+    int err = 0, ret = 0;
+    double total = 0; // for dry-run count total number of strings
+    double cnt;
+
+    sink outsink; // -o, standard output if not given
+    char idxpath[MAXPATHLEN+8];
+    czstream *cz = NULL;
+    sorter *sorted = NULL; // --sorted
+    sostats sost;
+    key *kpath[MAXWORDLEN]; // restart word
+    int tpath[MAXWORDLEN], off[MAXWORDLEN+1];
+    double skip = 0;
+    FILE *fdigest = NULL; // --verify
+    digest key_digest, total_digest;
+    char line[256];
+    int n;
+
+    shard_keys(opt);
+
+    // a restarted run continues the previous output
+    if (sink_open(&outsink, opt->outpath != NULL ? opt->outpath : "fd:1", opt->restart != NULL, OUTBUFSIZE, line, sizeof(line)) != 0) {
+        logmessage(LOG_EXIT, flog, "%s\n", line);
+    }
+    out_init(&out, outsink.fd, outsink.batch);
+    out.sk = &outsink;
+    if (opt->compress != EMPTY_COMPRESS && opt->split == NULL) {
+        // the compressor writes the frames to the file descriptor itself
+        if (opt->jobs == EMPTY_JOBS) opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (outsink.path != NULL) snprintf(idxpath, sizeof(idxpath), "%s.idx", outsink.path);
+        cz = cz_open(opt->compress, opt->clevel, outsink.fd, outsink.path != NULL ? idxpath : NULL, opt->jobs, outsink.batch + OUTBUFSLACK);
+        out_compress(&out, cz);
+        logmessage(LOG_CONT, flog, "Compressing output with %s, %d threads\n", cz_name(opt->compress), opt->jobs);
+    }
+    if (opt->sorted != EMPTY_SORTED) {
+        // the blocks are sorted in runs and merged into the file at the end,
+        // an interrupted run leaves the words generated so far, sorted
+        if (opt->jobs == EMPTY_JOBS) opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        sorted = so_open(outsink.path, outsink.fd, opt->sorted, opt->jobs, outsink.batch + OUTBUFSLACK, line, sizeof(line));
+        if (sorted == NULL) logmessage(LOG_EXIT, flog, "%s\n", line);
+        out_sort(&out, sorted);
+        logmessage(LOG_CONT, flog, "Sorting output in %zu bytes, %d threads, segments in \"%s\"\n", opt->sorted, sorted->nthreads, sorted->dir);
+    }
+
+    for (i = 0; i <= MAXWORDLEN; i++) {
+        outlen[i] = &out;
+    }
+
+    mask_keys(opt, keyboards, numkeys);
+
+    if (opt->nafpath > 1) {
+        run_multi(opt, keyboards, numkeys);
+        goto completed;
+    }
+
+    lenkeys = symcount(opt->keys, opt->utf8); // characters, not bytes
+    startkeys = (key **)malloc((lenkeys + 1) * sizeof(key *));
     if (startkeys == NULL) {
         fprintf(stderr, "malloc() error\n");
         exit(1);
     }
-    for (i = 0; i < lenkeys; i++) {
-        tmpk = getkey(keyboard, numkeys, opt.keys[i]);
+    for (i = 0, j = 0, n = 0; i < lenkeys; i++, j += len) {
+        tmpk = getkeystr(keyboard, nkeys, opt->keys + j, NULL, &len);
         if (tmpk == NULL) {
-            fprintf(stderr, "can't find key %c\n", opt.keys[i]);
+            fprintf(stderr, "can't find key %.*s\n", symbytes(opt->keys + j, opt->utf8), opt->keys + j);
+            ret = 1;
             goto term;
         }
-        startkeys[i] = tmpk;
+        // a start key left out by -O or -X has no words
+        if (tmpk->active != ACTIVE) {
+            logmessage(LOG_CONT, flog, "Start key %.*s is disabled, skipped\n", len, opt->keys + j);
+            continue;
+        }
+        startkeys[n++] = tmpk;
+    }
+    lenkeys = n;
+
+    // the counters are computed once for every key and length
+    if (need_counters(opt)) {
+        if (opt->cachedir != NULL) {
+            if (dry_run_cached(keyboard, nkeys, opt->max, opt->cachedir)) {
+                logmessage(LOG_CONT, flog, "Dry-run counters loaded from cache \"%s\"\n", opt->cachedir);
+            }
+        } else {
+            dry_run(keyboard, nkeys, opt->max);
+        }
+    }
+
+    if (opt->split != NULL) {
+        open_split(opt, startkeys, lenkeys);
+    }
+
+    if (opt->check != NULL) {
+        ret = run_check(opt, keyboard, nkeys, startkeys, lenkeys);
+        goto completed;
+    }
+
+    if (opt->sample != EMPTY_SAMPLE) {
+        ret = run_sample(opt, keyboard, nkeys, startkeys, lenkeys);
+        goto completed;
+    }
+
+    if (opt->ncombine > 0) {
+        ret = run_combine(opt, keyboard, nkeys, startkeys, lenkeys);
+        goto completed;
+    }
+
+    if (opt->verify != NULL) {
+        if ((fdigest = fopen(opt->verify, "w")) == NULL) {
+            err = errno;
+            logmessage(LOG_EXIT, flog, "Can't open digest file \"%s\": %s\n", opt->verify, strerror(err));
+        }
+        digest_init(&total_digest);
+    }
+
+    if (opt->sufcache != EMPTY_SUFCACHE && !opt->dryrun && opt->export == EMPTY_EXPORT) {
+        if (sufcache_init(&suffixes, keyboard, nkeys, opt->max - 1, (size_t)opt->sufcache << 10) > 0) {
+            logmessage(LOG_CONT, flog, "Suffix cache: last %d characters written from cached blocks\n", suffixes.depth);
+        } else {
+            logmessage(LOG_CONT, flog, "Suffix cache: budget too small, disabled\n");
+        }
     }
 
-    i = 0; // init i in case opt.restart == NULL
-    if (opt.restart != NULL) {
-        tmpk = getkey(keyboard, numkeys, opt.restart[0]);
+    // without a suffix cache the last levels go through a kernel unrolled
+    // for the layout
+    if (suffixes.depth == 0 && !opt->dryrun && opt->export == EMPTY_EXPORT) {
+        kernel_select(&kern, keyboard, nkeys, opt->min, opt->max, outlen);
+        if (kern.fn != NULL) {
+            logmessage(LOG_CONT, flog, "Kernel: last %d levels unrolled for %d characters per key%s\n", kern.levels, kern.nv, kern.fixed ? ", fixed size words" : "");
+        }
+    }
+
+    if (opt->pattern != NULL) {
+        ret = run_pattern(opt, keyboard, nkeys, startkeys, lenkeys);
+        goto completed;
+    }
+
+    i = 0; // init i in case opt->restart == NULL
+    if (opt->restart != NULL) {
+        tmpk = getkeystr(keyboard, nkeys, opt->restart, NULL, NULL);
         for (i = 0; i < lenkeys; ++i) {
             if (tmpk == startkeys[i]) break;
         }
         if (i >= lenkeys) {
-            fprintf(stderr, "Can't find initial char %c for restart word %s\n", opt.restart[0], opt.restart);
+            fprintf(stderr, "Can't find initial char %.*s for restart word %s\n", symbytes(opt->restart, opt->utf8), opt->restart, opt->restart);
             exit(1);
         }
-        logmessage(LOG_CONT, flog, "Restarting from word \"%s\", key index: %d\n", opt.restart, i);
+        // the rank of the word is what the previous run wrote from this key
+        len = word_path(keyboard, nkeys, opt->restart, kpath, tpath, off);
+        skip = word_rank(kpath, tpath, len, opt->min, opt->max) + (len >= opt->min);
+        logmessage(LOG_CONT, flog, "Restarting after word \"%s\", key index: %d, %.0lf of its %.0lf words already written\n", opt->restart, i, skip, count_words(startkeys[i], opt->min, opt->max));
     }
 
-    while (i < lenkeys) {
-        if (opt.dryrun) {
-            dry_run(startkeys[i], opt.min, opt.max);
-            fprintf(stdout, "%5c: %50.0lf\n", startkeys[i]->c, startkeys[i]->counter[0]);
-            total += (double)(startkeys[i]->counter[0]);
+    while (i < lenkeys && check_signals() == 0) {
+        if (opt->dryrun) {
+            cnt = count_words(startkeys[i], opt->min, opt->max);
+            fprintf(stdout, "%4s%.*s: %50.0lf\n", "", SYMARG(startkeys[i], 0), cnt);
+            total += cnt;
+        } else if (opt->export != EMPTY_EXPORT) {
+            total = mask_export(startkeys[i], opt->min, opt->max, opt->export, &out);
+            out_flush(&out);
+            if (stop_signal) break; // partial export
+            cnt = count_words(startkeys[i], opt->min, opt->max);
+            if (total != cnt) {
+                logmessage(LOG_EXIT, flog, "Masks from %.*s describe %.0lf words, dry-run counted %.0lf\n", SYMARG(startkeys[i], 0), total, cnt);
+            }
+            logmessage(LOG_CONT, flog, "Exported masks from %.*s, %.0lf words\n", SYMARG(startkeys[i], 0), total);
         } else {
-            dfs(startkeys[i], opt.min, opt.max, keyboard, numkeys, opt.restart);
+            if (fdigest != NULL) {
+                digest_init(&key_digest);
+                out.dg = &key_digest;
+            }
+            dfs(startkeys[i], opt->min, opt->max, keyboard, nkeys, opt->restart);
+            if (fdigest != NULL) {
+                out_flush(&out);
+                out.dg = NULL;
+                // a restarted or interrupted key is only a part of its words
+                if (verify_key(fdigest, startkeys[i], &key_digest, opt, opt->restart != NULL ? skip : 0, stop_signal != 0) != 0) ret = 1;
+                digest_combine(&total_digest, &key_digest);
+            }
             // restart only the first time
-            free(opt.restart);
-            opt.restart = NULL;
+            free(opt->restart);
+            opt->restart = NULL;
         }
         i++;
     }
-    if (opt.dryrun) {
+    if (opt->dryrun && stop_signal == 0) {
         fprintf(stdout, "Total: %50.0lf\n", total);
+        fflush(stdout);
+    }
+
+    if (fdigest != NULL) {
+        n = digest_format(line, sizeof(line), &total_digest, DIGEST_TOTAL, NULL, 0);
+        fprintf(fdigest, "%.*s\n", n, line);
+        logmessage(LOG_CONT, flog, "Digest: %.*s\n", n, line);
     }
 
+completed:
+    if (stop_signal) {
+        logmessage(LOG_CONT, flog, "****** RECEIVED %s ******\n", signal_name(stop_signal));
+        logmessage(LOG_CONT, flog, "Execution interrupted\n");
+        goto term;
+    }
     logmessage(LOG_CONT, flog, "Execution completed\n");
 
 term:
-
-    if (opt.afpath != NULL) {
-        for (i = 0; i < numkeys; i++) {
-            freekey(&keyboard[i]);
+    if (startkeys != NULL) free(startkeys);
+    if (fdigest != NULL && fclose(fdigest) != 0) {
+        logmessage(LOG_CONT, flog, "Error writing digest file \"%s\"\n", opt->verify);
+        ret = 1;
+    }
+    sufcache_free(&suffixes);
+
+    close_split();
+    if (sorted != NULL) {
+        out_flush(&out);
+        out.so = NULL;
+        if (so_close(sorted, &sost) != 0) {
+            logmessage(LOG_CONT, flog, "Error writing the sorted output\n");
+            ret = 1;
+        } else {
+            logmessage(LOG_CONT, flog, "Sorted output: %llu words, %llu duplicates dropped, %llu runs, %llu merges, %d ranges\n", (unsigned long long)sost.words, (unsigned long long)sost.dups, (unsigned long long)sost.runs, (unsigned long long)sost.merges, sost.parts);
         }
+    }
+    out_free(&out);
+    if (sink_close(&outsink) != 0) {
+        logmessage(LOG_CONT, flog, "Error closing the output\n");
+        ret = 1;
+    }
 
+    if (word != NULL) {
+        free(word);
+        word = NULL;
+    }
+
+    return ret;
+}
+
+/* *
+ * Move the process to the NUMA node requested with -n before the keyboard and
+ * the buffers are allocated and the threads are started, with "auto" the
+ * shards are spread over the online nodes.
+ * */
+static void bind_node(const cmdlopts_t *opt)
+{
+    int nodes[MAXNUMANODES], n, node = opt->numa;
+
+    if (node == EMPTY_NUMA) return;
+    if (node == NUMA_AUTO) {
+        n = node_list(nodes, MAXNUMANODES);
+        node = nodes[opt->shard % n];
+    }
+    if (node_bind(node) != 0) {
+        logmessage(LOG_CONT, flog, "Can't run on NUMA node %d, placement left to the system\n", node);
+        return;
+    }
+    logmessage(LOG_CONT, flog, "Running on NUMA node %d\n", node);
+}
+
+/* *
+ * Daemon side of a job, runs in the child process forked for it: log to the
+ * job's log file and install the handlers again (the daemon ignores SIGPIPE).
+ * */
+static int serve_job(cmdlopts_t *opt, key **keyboards, int *numkeys)
+{
+    fclose(flog);
+    flog = fopen(opt->logfpath, "a");
+    if (flog == NULL) {
+        fprintf(stderr, "Can't open log file \"%s\"\n", opt->logfpath);
+        return 1;
+    }
+    log_args(*opt, flog);
+    install_handlers(flog);
+    if (opt->timeout > 0) {
+        alarm(opt->timeout);
+        logmessage(LOG_CONT, flog, "setting alarm(%d)\n", opt->timeout);
+    }
+    // the cached keyboards stay where the daemon allocated them
+    bind_node(opt);
+    return run_job(opt, keyboards, numkeys);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret;
+    key *keyboards[MAXARRANGEMENTS]; // first one with counters if needed
+    int numkeys[MAXARRANGEMENTS]; // number of keys of each keyboard
+
+    cmdlopts_t opt = parse_args(argc, argv);
+
+    flog = fopen(opt.logfpath, "a"); // create first time, always append
+    assert(flog != NULL);
+
+    log_args(opt, flog);
+
+    // install signal handlers
+    install_handlers(flog);
+
+    bind_node(&opt);
+
+    if (opt.daemon != NULL) {
+        ret = daemon_serve(&opt, serve_job);
+        free_args(&opt);
+        fclose(flog);
+        return ret;
+    }
+
+    // call alarm() with the set timeout
+    if (opt.timeout > 0) { 
+        // start timeout
+        alarm(opt.timeout);
+        logmessage(LOG_CONT, flog, "setting alarm(%d)\n", opt.timeout);
+    }
+
+    // failure managed inside parseFile()
+    for (i = 0; i < opt.nafpath; i++) {
+        keyboards[i] = parseFile(opt.afpath[i], &numkeys[i], (i == 0 && need_counters(&opt)) ? opt.max : 0, opt.utf8);
+    }
+
+    ret = run_job(&opt, keyboards, numkeys);
+
+    for (i = 0; i < opt.nafpath; i++) {
+        free(keyboards[i]); // the whole keyboard is one block
     }
-    if (keyboard != NULL) free(keyboard);
 
     free_args(&opt);
 
     // pause if infinite run is required
-    if (opt.infiniterun == 1) pause();
-
-    if (word != NULL) {
-        free(word);
-        word = NULL;
+    if (opt.infiniterun == 1) {
+        wait_stop_signal();
+        logmessage(LOG_CONT, flog, "****** RECEIVED %s ******\n", signal_name(stop_signal));
     }
 
-    // assume it is not already closed - it can be closed in handling signals which
-    // calls exit(), so it should never reach this point
     fclose(flog);
 
-    return 0;
-}
\ No newline at end of file
+    return ret;
+}
@@ -0,0 +1,310 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "multi.h"
+#include "stack.h"
+#include "signals.h"
+
+struct mstackel {
+    int c; // id of the character at position idx
+    int idx;
+    uint32_t mask; // layouts on which the prefix ending with c is a walk
+    int visited;
+};
+
+typedef struct mstack {
+    struct mstackel stack[STACKSIZE];
+    int pos;
+} mstack;
+
+// characters of all the layouts, indexed by id
+typedef struct symtab {
+    sym_t *sym;
+    unsigned char *len;
+    int n;
+} symtab;
+
+static int intern(symtab *st, sym_t sym, unsigned char len)
+{
+    int i;
+
+    for (i = 0; i < st->n; i++) {
+        if (st->sym[i] == sym) return i;
+    }
+    st->sym[st->n] = sym;
+    st->len[st->n] = len;
+    return st->n++;
+}
+
+// number the characters of all the layouts and fill map, ids and first
+static void layout_map(layout *layouts, int nlayouts, symtab *st)
+{
+    int l, i, j, cap = 0, n;
+    layout *lt;
+
+    for (l = 0; l < nlayouts; l++) {
+        for (i = 0; i < layouts[l].numkeys; i++) {
+            cap += 1 + layouts[l].keys[i].lensv;
+        }
+    }
+    st->sym = (sym_t *)malloc(cap * sizeof(sym_t));
+    st->len = (unsigned char *)malloc(cap);
+    st->n = 0;
+    assert(st->sym != NULL && st->len != NULL);
+
+    for (l = 0; l < nlayouts; l++) {
+        lt = &layouts[l];
+        lt->first = (int *)malloc(lt->numkeys * sizeof(int));
+        assert(lt->first != NULL);
+        n = 0;
+        for (i = 0; i < lt->numkeys; i++) {
+            lt->first[i] = n;
+            n += 1 + lt->keys[i].lensv;
+        }
+        lt->ids = (int *)malloc(n * sizeof(int));
+        assert(lt->ids != NULL);
+        for (i = 0; i < lt->numkeys; i++) {
+            for (j = 0; j <= lt->keys[i].lensv; j++) {
+                lt->ids[lt->first[i] + j] = intern(st, lt->keys[i].sym[j], lt->keys[i].symlen[j]);
+            }
+        }
+    }
+
+    // maps are indexed by id, allocate them once the number of ids is known
+    for (l = 0; l < nlayouts; l++) {
+        lt = &layouts[l];
+        lt->map = (key **)calloc(st->n, sizeof(key *));
+        assert(lt->map != NULL);
+        for (i = 0; i < lt->numkeys; i++) {
+            for (j = 0; j <= lt->keys[i].lensv; j++) {
+                lt->map[lt->ids[lt->first[i] + j]] = &lt->keys[i];
+            }
+        }
+    }
+}
+
+static void layout_unmap(layout *layouts, int nlayouts, symtab *st)
+{
+    int l;
+
+    for (l = 0; l < nlayouts; l++) {
+        free(layouts[l].map);
+        free(layouts[l].ids);
+        free(layouts[l].first);
+        layouts[l].map = NULL;
+        layouts[l].ids = layouts[l].first = NULL;
+    }
+    free(st->sym);
+    free(st->len);
+}
+
+// id of the character t of key k in layout l
+#define SYMID(l, k, t) ((l)->ids[(l)->first[(k) - (l)->keys] + (t) + 1])
+
+// write word and, if tag != 0, the list of layouts in mask
+static void emit(outbuf *o, const char *word, int len, uint32_t mask, int tag)
+{
+    char *p;
+    int l, first = 1;
+
+    if (!tag) {
+        out_word(o, word, len);
+        return;
+    }
+
+    // word, tab, at most 3 chars per layout, newline
+    p = out_reserve(o, len + 1 + 3*MAXLAYOUTS + 1);
+    memcpy(p, word, len);
+    o->len += len;
+    p += len;
+    *p++ = '\t';
+    o->len++;
+    for (l = 0; l < MAXLAYOUTS; l++) {
+        if (!(mask & (1U << l))) continue;
+        o->len += sprintf(p, first ? "%d" : ",%d", l+1);
+        p = o->buf + o->len;
+        first = 0;
+    }
+    *p = '\n';
+    o->len++;
+}
+
+// push c with the given mask, the caller checks the stack size
+static void mpush(mstack *s, int c, int idx, uint32_t mask)
+{
+    s->pos++;
+    assert(s->pos < STACKSIZE);
+    s->stack[s->pos].c = c;
+    s->stack[s->pos].idx = idx;
+    s->stack[s->pos].mask = mask;
+    s->stack[s->pos].visited = 0;
+}
+
+/* *
+ * Collect the characters reachable from c on the layouts in mask, in the
+ * order dfs() would push them (layouts in order, then neighbours, then base
+ * character and shift variants). order receives each distinct character once,
+ * cmask[c] the layouts it is reachable on (cmask must be all 0 on entry).
+ * Returns the number of characters in order.
+ * */
+static int children(layout *layouts, int nlayouts, int c, uint32_t mask, int *order, uint32_t *cmask)
+{
+    int l, i, j, n = 0;
+    int ch;
+    key *k, *nk;
+
+    for (l = 0; l < nlayouts; l++) {
+        if (!(mask & (1U << l))) continue;
+        k = layouts[l].map[c];
+        for (i = 0; i < k->nreach; i++) {
+            nk = k->reach[i];
+            if (nk->active != ACTIVE) continue;
+            for (j = -1; j < nk->lensv; j++) {
+                ch = SYMID(&layouts[l], nk, j);
+                if (cmask[ch] == 0) order[n++] = ch;
+                cmask[ch] |= 1U << l;
+            }
+        }
+    }
+
+    return n;
+}
+
+// id of the character at the beginning of s, -1 if none
+static int findid(symtab *st, const char *s, int *len)
+{
+    int i;
+
+    for (i = 0; i < st->n; i++) {
+        if (memcmp(&st->sym[i], s, st->len[i]) == 0) {
+            *len = st->len[i];
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint64_t multi_dfs(layout *layouts, int nlayouts, const char *startchars, int minlen, int depth, int tag, outbuf **outlen, char *word)
+{
+    mstack s;
+    symtab st;
+    uint32_t *rootmask; // layouts on which a character starts a walk
+    uint32_t *cmask;
+    int *order;
+    int *done; // root characters already walked
+    int *off; // byte offset of each character in word
+    int end = 0; // length of the last visited word
+    int i, j, l, n, curridx, len;
+    int id;
+    uint64_t cnt = 0;
+    struct mstackel *currstack;
+    key *k;
+    int ch;
+
+    assert(layouts != NULL && nlayouts > 0 && nlayouts <= MAXLAYOUTS);
+    assert(startchars != NULL);
+    assert(minlen > 0 && depth >= minlen);
+
+    layout_map(layouts, nlayouts, &st);
+    rootmask = (uint32_t *)calloc(st.n, sizeof(uint32_t));
+    cmask = (uint32_t *)calloc(st.n, sizeof(uint32_t));
+    order = (int *)malloc(st.n * sizeof(int));
+    done = (int *)calloc(st.n, sizeof(int));
+    off = (int *)malloc((depth+1) * sizeof(int));
+    if (rootmask == NULL || cmask == NULL || order == NULL || done == NULL || off == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    off[0] = 0;
+
+    // a string starting with c is generated by layout l if c belongs to one
+    // of the start keys of l
+    for (i = 0; startchars[i] != '\0'; i += len) {
+        if ((id = findid(&st, startchars + i, &len)) < 0) break;
+        for (l = 0; l < nlayouts; l++) {
+            k = layouts[l].map[id];
+            if (k == NULL || k->active != ACTIVE) continue;
+            for (j = -1; j < k->lensv; j++) {
+                rootmask[SYMID(&layouts[l], k, j)] |= 1U << l;
+            }
+        }
+    }
+
+    for (i = 0; startchars[i] != '\0' && !stop_signal; i += len) {
+        if ((id = findid(&st, startchars + i, &len)) < 0) break;
+        // roots for this start key, same order as dfs()
+        n = 0;
+        for (l = 0; l < nlayouts; l++) {
+            k = layouts[l].map[id];
+            if (k == NULL || k->active != ACTIVE) continue;
+            for (j = -1; j < k->lensv; j++) {
+                ch = SYMID(&layouts[l], k, j);
+                if (done[ch] || cmask[ch] != 0) continue;
+                cmask[ch] = 1;
+                order[n++] = ch;
+            }
+        }
+
+        s.pos = -1;
+        for (j = 0; j < n; j++) {
+            cmask[order[j]] = 0;
+            done[order[j]] = 1;
+            mpush(&s, order[j], 0, rootmask[order[j]]);
+        }
+
+        while (s.pos >= 0 && !stop_signal) {
+            currstack = &(s.stack[s.pos]);
+            curridx = currstack->idx;
+
+            if (currstack->visited != 0) {
+                s.pos--;
+                continue;
+            }
+            currstack->visited = 1;
+
+            // exactly off[curridx+1] bytes are written, word is terminated
+            // at the end
+            memcpy(word + off[curridx], &st.sym[currstack->c], MAXSYMLEN);
+            end = off[curridx+1] = off[curridx] + st.len[currstack->c];
+
+            if (curridx+1 >= minlen) {
+                emit(outlen[curridx+1], word, end, currstack->mask, tag);
+                cnt++;
+            }
+
+            if (curridx >= depth-1) {
+                s.pos--;
+                continue;
+            }
+
+            n = children(layouts, nlayouts, currstack->c, currstack->mask, order, cmask);
+            if (s.pos + n >= STACKSIZE) {
+                fprintf(stderr, "reached max stack size\n");
+                exit(1);
+            }
+            // currstack may be overwritten from here
+            for (j = 0; j < n; j++) {
+                mpush(&s, order[j], curridx+1, cmask[order[j]]);
+                cmask[order[j]] = 0;
+            }
+        }
+    }
+
+    word[end] = '\0';
+
+    free(rootmask);
+    free(cmask);
+    free(order);
+    free(done);
+    free(off);
+    layout_unmap(layouts, nlayouts, &st);
+
+    return cnt;
+}
@@ -0,0 +1,43 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWMULTI__
+#define __KBWMULTI__
+
+#include <stdint.h>
+
+#include "keyboard.h"
+#include "output.h"
+
+// max number of keyboard arrangements walked together (bits of a mask)
+#define MAXLAYOUTS 32
+
+typedef struct layout {
+    key *keys; // the keyboard
+    int numkeys;
+    // filled by multi_dfs(), characters of all the layouts are numbered
+    // 0..n-1 so that multi-byte characters can index plain arrays
+    key **map; // key containing each character id, NULL if none
+    int *ids; // id of every character, ids[first[i] + t+1] for keys[i]
+    int *first;
+} layout;
+
+/* *
+ * Walk several keyboards side by side. Every distinct string which is a walk
+ * of length in [minlen, depth] on at least one of the layouts, starting from
+ * one of the keys in startchars, is written exactly once. Each node of the
+ * search is a prefix together with the mask of the layouts on which it is a
+ * valid walk, so prefixes shared by different layouts (e.g. the digit row)
+ * are visited only once.
+ * With a single layout the output is the same as dfs().
+ * If tag != 0 each word is followed by a tab and the comma separated list of
+ * the layouts (1-based, in command line order) it comes from.
+ * word must be at least (depth+1)*MAXSYMLEN+1 bytes long, it holds the last
+ * written word.
+ * Returns the number of written words.
+ * */
+uint64_t multi_dfs(layout *layouts, int nlayouts, const char *startchars, int minlen, int depth, int tag, outbuf **outlen, char *word);
+
+#endif
@@ -0,0 +1,121 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#define _GNU_SOURCE // sched_setaffinity()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <assert.h>
+#ifdef KBW_NUMA
+#include <numa.h>
+#endif
+
+#include "numa.h"
+
+#define SYSFS_NODE "/sys/devices/system/node"
+
+/* *
+ * Parse a sysfs list ("0-3,8,10-11") calling add(i, arg) for each number.
+ * Returns the number of added elements, -1 on a malformed list.
+ * */
+static int parse_list(const char *s, void (*add)(int, void *), void *arg)
+{
+    int lo, hi, n, count = 0;
+    char *end;
+
+    while (*s != '\0' && *s != '\n') {
+        lo = (int)strtol(s, &end, 10);
+        if (end == s || lo < 0) return -1;
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = (int)strtol(s+1, &end, 10);
+            if (end == s+1 || hi < lo) return -1;
+            s = end;
+        }
+        for (n = lo; n <= hi; n++, count++) add(n, arg);
+        if (*s == ',') s++;
+    }
+
+    return count;
+}
+
+// read the first line of a sysfs file, 0 on success
+static int read_line(const char *path, char *buf, int size)
+{
+    FILE *f;
+    int ok;
+
+    if ((f = fopen(path, "r")) == NULL) return -1;
+    ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+
+    return ok ? 0 : -1;
+}
+
+typedef struct nodelist {
+    int *nodes;
+    int max;
+    int n;
+} nodelist;
+
+static void add_node(int node, void *arg)
+{
+    nodelist *l = (nodelist *)arg;
+    if (l->n < l->max) l->nodes[l->n++] = node;
+}
+
+static void add_cpu(int cpu, void *arg)
+{
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+int node_list(int *nodes, int maxnodes)
+{
+    char buf[4096];
+    nodelist l = {nodes, maxnodes, 0};
+#ifdef KBW_NUMA
+    int i;
+#endif
+
+    assert(nodes != NULL && maxnodes > 0);
+
+#ifdef KBW_NUMA
+    if (numa_available() >= 0) {
+        for (i = 0; i <= numa_max_node() && l.n < maxnodes; i++) {
+            if (numa_bitmask_isbitset(numa_all_nodes_ptr, i)) nodes[l.n++] = i;
+        }
+        if (l.n > 0) return l.n;
+    }
+#endif
+    if (read_line(SYSFS_NODE "/online", buf, sizeof(buf)) != 0 || parse_list(buf, add_node, &l) <= 0) {
+        nodes[0] = 0;
+        return 1;
+    }
+
+    return l.n;
+}
+
+int node_bind(int node)
+{
+    char path[256], buf[4096];
+    cpu_set_t set;
+
+    if (node < 0) return -1;
+
+    snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+    CPU_ZERO(&set);
+    if (read_line(path, buf, sizeof(buf)) != 0 || parse_list(buf, add_cpu, &set) <= 0) return -1;
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) return -1;
+
+#ifdef KBW_NUMA
+    // the affinity alone relies on the first touch, make the node the
+    // preferred one for every allocation of the process
+    if (numa_available() >= 0) numa_set_preferred(node);
+#endif
+
+    return 0;
+}
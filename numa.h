@@ -0,0 +1,31 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWNUMA__
+#define __KBWNUMA__
+
+// max number of NUMA nodes handled
+#define MAXNUMANODES 64
+
+// --numa auto: the node is chosen from the shard index
+#define NUMA_AUTO -2
+
+/* *
+ * Fill nodes with the ids of the online NUMA nodes, read from sysfs (or from
+ * libnuma when built with NUMA=1). Returns their number, 1 (node 0) on
+ * systems without NUMA information.
+ * */
+int node_list(int *nodes, int maxnodes);
+
+/* *
+ * Run the calling process on the cpus of node and, with libnuma, prefer its
+ * memory for the allocations. Must be called before the keyboard is parsed
+ * and the threads are started: they inherit the affinity and the memory is
+ * first touched, hence allocated, on the node.
+ * Returns 0 on success, -1 if node doesn't exist or has no cpus.
+ * */
+int node_bind(int node);
+
+#endif
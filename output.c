@@ -0,0 +1,110 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "output.h"
+#include "signals.h"
+
+void out_init(outbuf *o, int fd, size_t cap)
+{
+    assert(o != NULL);
+    assert(cap > 0);
+
+    o->buf = (char *)malloc(cap + OUTBUFSLACK);
+    if (o->buf == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    o->len = 0;
+    o->cap = cap;
+    o->fd = fd;
+    o->cz = NULL;
+    o->dg = NULL;
+    o->sk = NULL;
+    o->so = NULL;
+
+    return;
+}
+
+void out_compress(outbuf *o, czstream *z)
+{
+    assert(o != NULL);
+    o->cz = z;
+}
+
+void out_sort(outbuf *o, sorter *s)
+{
+    assert(o != NULL);
+    o->so = s;
+}
+
+void out_flush(outbuf *o)
+{
+    size_t off = 0;
+    ssize_t ret;
+
+    assert(o != NULL);
+
+    // the buffer only holds complete words
+    if (o->dg != NULL) digest_update(o->dg, o->buf, o->len);
+
+    if (o->cz != NULL) {
+        o->buf = cz_submit(o->cz, o->buf, o->len);
+        o->len = 0;
+        return;
+    }
+
+    if (o->so != NULL) {
+        o->buf = so_submit(o->so, o->buf, o->len);
+        o->len = 0;
+        return;
+    }
+
+    if (o->sk != NULL) {
+        // errors are handled like a failed write(2): the block is dropped
+        sink_write(o->sk, o->buf, o->len);
+        o->len = 0;
+        return;
+    }
+
+    while (off < o->len) {
+        ret = write(o->fd, o->buf + off, o->len - off);
+        // a stop signal interrupted a write to a stalled reader (EINTR or a
+        // short write): give up, and make the next flushes fail instead of
+        // blocking again
+        if (stop_signal && ((ret < 0 && errno == EINTR) || (ret >= 0 && ret < (ssize_t)(o->len - off)))) {
+            fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL) | O_NONBLOCK);
+            break;
+        }
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            // stop writing, the reader went away (EPIPE) or the device is full
+            break;
+        }
+        off += ret;
+    }
+    o->len = 0;
+
+    return;
+}
+
+void out_free(outbuf *o)
+{
+    if (o == NULL || o->buf == NULL) return;
+    out_flush(o);
+    if (o->cz != NULL) {
+        if (cz_close(o->cz) != 0) fprintf(stderr, "Error writing compressed output\n");
+        o->cz = NULL;
+    }
+    free(o->buf);
+    o->buf = NULL;
+    o->cap = 0;
+}
@@ -0,0 +1,63 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWOUTPUT__
+#define __KBWOUTPUT__
+
+#include <stddef.h>
+#include <string.h>
+
+#include "compress.h"
+#include "digest.h"
+#include "sink.h"
+#include "sorted.h"
+
+// default size of the output buffer
+#define OUTBUFSIZE (1 << 20)
+
+// extra bytes always available after the end of the buffer, so that the
+// generator can use full width vector stores without checking the tail
+#define OUTBUFSLACK 64
+
+typedef struct outbuf {
+    char *buf; // buffered words, '\n'-separated
+    size_t len; // number of bytes currently in buf
+    size_t cap; // size of buf (excluding OUTBUFSLACK)
+    int fd; // destination file descriptor
+    czstream *cz; // if != NULL blocks are compressed before reaching fd
+    digest *dg; // if != NULL the words are added to it before being written
+    sink *sk; // if != NULL the blocks are written through it instead of fd
+    sorter *so; // if != NULL the blocks are sorted before reaching fd
+} outbuf;
+
+void out_init(outbuf *o, int fd, size_t cap);
+// send all the output through z, the buffer becomes the compression block
+void out_compress(outbuf *o, czstream *z);
+// send all the output through s, sorted at so_close()
+void out_sort(outbuf *o, sorter *s);
+// write all buffered bytes to o->fd or o->sk (or hand them to the compressor)
+void out_flush(outbuf *o);
+// flush, close the compressed stream and release the buffer
+void out_free(outbuf *o);
+
+// returns a pointer to at least n free bytes (plus OUTBUFSLACK), flushing the
+// buffer if needed. The caller must add the bytes actually written to o->len.
+// n must be <= o->cap
+static inline char *out_reserve(outbuf *o, size_t n)
+{
+    if (o->len + n > o->cap) out_flush(o);
+    return o->buf + o->len;
+}
+
+// append the first len bytes of w followed by a newline
+static inline void out_word(outbuf *o, const char *w, size_t len)
+{
+    char *p = out_reserve(o, len+1);
+    memcpy(p, w, len);
+    p[len] = '\n';
+    o->len += len+1;
+}
+
+#endif
@@ -4,6 +4,12 @@
  * See the LICENSE file for full terms.
  * */
 #include <ctype.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "patterns.h"
 #include "keyboard.h"
@@ -17,219 +23,373 @@ int isemptybuff(char *buff, int len)
     return 1;
 }
 
-void setup_neighbours(key *keys, int numkeys, const char *s)
+// character -> key lookup table, open addressing on the symbol value
+typedef struct symentry {
+    sym_t sym; // 0 if the slot is free (no character encodes to 0)
+    int key; // key index
+    int type; // -1 base character, >= 0 shift variant index
+} symentry;
+
+typedef struct symtable {
+    symentry *slot;
+    uint32_t mask;
+    int bits;
+} symtable;
+
+static uint32_t symhash(const symtable *t, sym_t sym)
+{
+    return (uint32_t)(sym * 2654435761U) >> (32 - t->bits);
+}
+
+// slot of sym, or the free slot where it should go
+static symentry *symslot(const symtable *t, sym_t sym)
+{
+    uint32_t h = symhash(t, sym);
+
+    while (t->slot[h].sym != 0 && t->slot[h].sym != sym) {
+        h = (h + 1) & t->mask;
+    }
+    return &t->slot[h];
+}
+
+// record a parse error, free the keyboard and return NULL
+static key *parse_fail(parse_error *err, key *keys, int line, int col, const char *format, ...)
+{
+    va_list arglist;
+
+    if (keys != NULL) free(keys);
+    err->line = line;
+    err->col = col;
+    va_start(arglist, format);
+    vsnprintf(err->msg, sizeof(err->msg), format, arglist);
+    va_end(arglist);
+    return NULL;
+}
+
+/* *
+ * Index all the characters of keys. dup[i] receives the index of a previous
+ * key sharing a character with keys[i], -1 if none; characters repeated
+ * inside a key are left to validKey().
+ * */
+static int build_table(symtable *t, key *keys, int numkeys, int *dup)
+{
+    size_t n = 0;
+    int i, j;
+    symentry *e;
+
+    for (i = 0; i < numkeys; i++) n += 1 + keys[i].lensv;
+    for (t->bits = 4; ((size_t)1 << t->bits) < 2*n; t->bits++);
+    t->mask = ((uint32_t)1 << t->bits) - 1;
+    t->slot = (symentry *)calloc((size_t)t->mask + 1, sizeof(symentry));
+    if (t->slot == NULL) return -1;
+
+    for (i = 0; i < numkeys; i++) {
+        dup[i] = -1;
+        for (j = 0; j <= keys[i].lensv; j++) {
+            e = symslot(t, keys[i].sym[j]);
+            if (e->sym == 0) {
+                e->sym = keys[i].sym[j];
+                e->key = i;
+                e->type = j-1;
+            } else if (e->key != i && dup[i] < 0) {
+                dup[i] = e->key;
+            }
+        }
+    }
+    return 0;
+}
+
+/* *
+ * Neighbours line "k:neighbours" at s (line number lineno), the key and the
+ * neighbours are base characters resolved through t.
+ * Returns 0 or -1 after filling err.
+ * */
+static int setup_neighbours(key *keys, const symtable *t, char *s, int lineno, int utf8, arena *a, parse_error *err)
 {
     key *curr = NULL;
-    int i = 0, j = 0;
     int nn = 0; //number of neighbours
     int nidx = 0; // neighbour index
+    int len;
+    sym_t sym;
+    symentry *e;
+    char *p;
 
-    if (keys == NULL || s == NULL || *s == 0) {
-        fprintf(stderr, "setup_neighbours: Parameter error\n");
-        exit(1);
+    if (*s == 0) {
+        parse_fail(err, NULL, lineno, 1, "empty neighbours line");
+        return -1;
     }
 
-    //search for the correct key
-    for (i = 0; i < numkeys; i++) {
-        if (keys[i].c == s[0]) {
-            curr = keys+i;
-            break;
-        }
+    len = nextsym(s, utf8, &sym);
+    if (len <= 0 || (nn = symcount(s, utf8)) < 0) {
+        parse_fail(err, NULL, lineno, 1, "Invalid UTF-8 sequence in neighbours line \"%s\"", s);
+        return -1;
     }
 
-    if (curr == NULL) {
-        fprintf(stderr, "Can't find key %c\n", s[0]);
-        exit(1);
+    //search for the correct key
+    e = symslot(t, sym);
+    if (e->sym == 0 || e->type != -1) {
+        parse_fail(err, NULL, lineno, 1, "Can't find key %.*s", len, s);
+        return -1;
     }
+    curr = &keys[e->key];
 
-    nn = strnlen(s, MAXNEIGHBOURS);
-    if (nn <= 2) return;
+    // key and ':' are not neighbours
+    if (nn <= 2) return 0;
+    if (nn-2 > MAXNEIGHBOURS) {
+        parse_fail(err, NULL, lineno, 1, "Too many neighbours for key \"%.*s\", max %d", SYMARG(curr, 0), MAXNEIGHBOURS);
+        return -1;
+    }
 
     if (curr->reach != NULL) {
-        fprintf(stderr, "Found Repeated neighbourhood configuration for key \"%c\"\n", curr->c);
-        exit(1);
+        parse_fail(err, NULL, lineno, 1, "Found Repeated neighbourhood configuration for key \"%.*s\"", SYMARG(curr, 0));
+        return -1;
     }
 
-    neigh_initkey(curr, nn-2);
+    neigh_initkey(curr, nn-2, a);
 
-    // set the neighbours
-    for (i = 2; i < nn; i++) {
-        for (j = 0; j < numkeys; j++) {
-            if (keys[j].c == s[i]) {
-                break;
-            }
-        }
-        if (j == numkeys) {
-            fprintf(stderr, "Can't find key %c\n", s[i]);
-            exit(1);
+    // set the neighbours, skip the key and the separator
+    p = s + len;
+    p += nextsym(p, utf8, &sym);
+    while ((len = nextsym(p, utf8, &sym)) > 0) {
+        e = symslot(t, sym);
+        if (e->sym == 0 || e->type != -1) {
+            parse_fail(err, NULL, lineno, (int)(p - s) + 1, "Can't find key %.*s", len, p);
+            return -1;
         }
-        curr->reach[nidx] = &keys[j];
+        curr->reach[nidx] = &keys[e->key];
         nidx++;
+        p += len;
     }
 
-    return;
+    return 0;
+}
+
+// the shift variants of k as a string (in buf), for the messages
+static const char *shiftvars(const key *k, char *buf)
+{
+    int i, n = 0;
+
+    for (i = 1; i <= k->lensv; i++) {
+        memcpy(buf + n, &k->sym[i], k->symlen[i]);
+        n += k->symlen[i];
+    }
+    buf[n] = '\0';
+    return buf;
 }
 
-key *parseFile(const char *fpath, int *numkeys, int maxdepth)
+// check the keys, line[i] is the line defining keys[i]; NULL on errors
+static key *validate(key *keys, int numkeys, const int *line, const int *dup, parse_error *err)
 {
-    FILE *f = NULL;
-    int ret = 0;
-    size_t len = 0; // getline parameter
-    size_t relen = 0; // string length
-    char *buff = NULL;
+    char buf[MAXNEIGHBOURS * MAXSYMLEN + 1];
+    char sv[2][MAXSHIFTVARS * MAXSYMLEN + 1];
+    int i, j, n, ret;
+
+    for (i = 0; i < numkeys; ++i) {
+        ret = validKey(&keys[i]);
+        switch (ret) {
+            case NULL_KEYERR:
+                return parse_fail(err, keys, line[i], 1, "Invalid NULL key");
+            case BASEINSV_KEYERR:
+                return parse_fail(err, keys, line[i], 1, "Base key %.*s appreas in the set of its shift variants: \"%s\"", SYMARG(&keys[i], 0), shiftvars(&keys[i], sv[0]));
+            case SHIFTVARREP_KEYERR:
+                return parse_fail(err, keys, line[i], 1, "Base key %.*s has some repeated shift variant: \"%s\"", SYMARG(&keys[i], 0), shiftvars(&keys[i], sv[0]));
+            case NEIGHREP_KEYERR:
+                for (j = 0, n = 0; j < keys[i].nreach; ++j) {
+                    memcpy(buf + n, &keys[i].reach[j]->sym[0], keys[i].reach[j]->symlen[0]);
+                    n += keys[i].reach[j]->symlen[0];
+                }
+                buf[n] = '\0';
+                return parse_fail(err, keys, line[i], 1, "Base key %.*s has some repeated neighbour: \"%s\"", SYMARG(&keys[i], 0), buf);
+            case OK_KEY:
+                break; // ok state
+            default:
+                return parse_fail(err, keys, line[i], 1, "CRITICAL - Invalid return value %d", ret);
+        }
+        if ((j = dup[i]) >= 0) {
+            return parse_fail(err, keys, line[i], 1, "Found repeated char in different keys.\n\
+                    k1 base char: %.*s\n\
+                    k1 shift var: %s\n\
+                    k2 base char: %.*s\n\
+                    k2 shift var: %s",
+                    SYMARG(&keys[j], 0), shiftvars(&keys[j], sv[0]), SYMARG(&keys[i], 0), shiftvars(&keys[i], sv[1]));
+        }
+    }
+
+    return keys;
+}
+
+key *parseBuffer(char *buf, size_t len, int *numkeys, int maxdepth, int utf8, parse_error *err)
+{
+    char *s, *e, *end = buf + len;
+    int lineno = 0;
     int state = -1;
     key *keys = NULL;
     int currkey = 0;
     int countsetup = 0;
-    int i, j;
+    int j, llen;
+    arena a;
+    symtable t = {NULL, 0, 0};
+    int *kline = NULL; // line of each key definition
+    int *dup = NULL;
+
+    assert(buf != NULL && numkeys != NULL && err != NULL);
 
+    *numkeys = 0;
+    memset(err, 0, sizeof(*err));
+
+    for (s = buf; s < end; s = e + 1) {
+        lineno++;
+        // terminate the line in place, buf has a spare byte after the end
+        e = memchr(s, '\n', end - s);
+        if (e == NULL) e = end;
+        *e = '\0';
+        llen = e - s;
+
+        if (state == -1) {
+            if (s[0] != '#' && !isemptybuff(s, llen)) state = 0;
+            else continue;
+        }
+        switch (state) {
+            case 0: // first line
+                state++;
+                *numkeys = atoi(s);
+                if (*numkeys <= 0) {
+                    return parse_fail(err, NULL, lineno, 1, "CONFIGURATION FILE ERROR - Invalid number of keys: %d", *numkeys);
+                }
+                if (*numkeys > (int)len) { // each key needs at least one line
+                    return parse_fail(err, NULL, lineno, 1, "CONFIGURATION FILE ERROR - %d keys declared in a %zu bytes file", *numkeys, len);
+                }
+                // every character or neighbour takes at least a byte of
+                // the file
+                arena_init(&a, arena_size(*numkeys, len, len, maxdepth));
+                // the key array is the beginning of the arena
+                keys = (key *)arena_alloc(&a, *numkeys * sizeof(key));
+                kline = (int *)malloc(2 * *numkeys * sizeof(int));
+                if (kline == NULL) {
+                    return parse_fail(err, keys, lineno, 1, "malloc() failed");
+                }
+                dup = kline + *numkeys;
+                break;
+            case 1: // key definition
+                if (isemptybuff(s, llen)) {
+                    if (currkey != *numkeys) {
+                        free(kline);
+                        return parse_fail(err, keys, lineno, 1, "CONFIGURATION FILE ERROR - wrong number of keys - asked for %d, found %d", *numkeys, currkey);
+                    }
+                    if (build_table(&t, keys, *numkeys, dup) != 0) {
+                        free(kline);
+                        return parse_fail(err, keys, lineno, 1, "malloc() failed");
+                    }
+                    state++;
+                    continue;
+                }
+                if (currkey == *numkeys) {
+                    free(kline);
+                    return parse_fail(err, keys, lineno, 1, "CONFIGURATION FILE ERROR - too many keys - asked for %d, found %d", *numkeys, currkey + 1);
+                }
+                if (s[0] != '-') {
+                    free(kline);
+                    return parse_fail(err, keys, lineno, 1, "Key definition should start with '-'");
+                }
+                j = symcount(s+1, utf8);
+                if (j < 0) {
+                    free(kline);
+                    return parse_fail(err, keys, lineno, 2, "Parsing error - invalid UTF-8 sequence in key definition \"%s\"", s);
+                }
+                if (j == 0) {
+                    free(kline);
+                    return parse_fail(err, keys, lineno, 2, "Parsing error - invalid base character");
+                }
+                if (j > MAXSHIFTVARS+1) {
+                    free(kline);
+                    return parse_fail(err, keys, lineno, 2, "Parsing error - too many shift variants in \"%s\"", s);
+                }
+                kline[currkey] = lineno;
+                char_initkey(&keys[currkey], ACTIVE, s+1, utf8, maxdepth, &a);
+                currkey++;
+                break;
+            case 2: // neighbours definition
+                countsetup++;
+                if (countsetup > *numkeys) {
+                    free(kline);
+                    free(t.slot);
+                    return parse_fail(err, keys, lineno, 1, "CONFIGURATION FILE ERROR - too many key configuration lines");
+                }
+                if (setup_neighbours(keys, &t, s, lineno, utf8, &a, err) != 0) {
+                    free(kline);
+                    free(t.slot);
+                    free(keys);
+                    return NULL;
+                }
+                break;
+            default:
+                return parse_fail(err, keys, lineno, 1, "ERROR while reading configuration file - state: %d", state);
+        }
+    }
+
+    if (keys == NULL) {
+        return parse_fail(err, NULL, lineno, 1, "CONFIGURATION FILE ERROR - no keys defined");
+    }
+    if (state == 1) {
+        free(kline);
+        return parse_fail(err, keys, lineno, 1, "CONFIGURATION FILE ERROR - missing neighbours section");
+    }
+
+    free(t.slot);
+    // validation no repeated chars
+    keys = validate(keys, *numkeys, kline, dup, err);
+    free(kline);
+
+    return keys;
+}
+
+key *parseFile(const char *fpath, int *numkeys, int maxdepth, int utf8)
+{
+    int fd;
+    struct stat st;
+    char *buf;
+    size_t len;
+    int mapped = 0;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    parse_error err;
+    key *keys;
 
     if (fpath == NULL || *fpath == 0 || numkeys == NULL) {
         fprintf(stderr, "parseFile parameter error\n");
         exit(1);
     }
 
-    *numkeys = 0;
-
-    if ((f = fopen(fpath, "r")) == NULL) {
+    if ((fd = open(fpath, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
         fprintf(stderr, "Can't open file \"%s\"\n", fpath);
         exit(1);
     }
+    len = st.st_size;
 
-    while (ret >= 0) {
-        ret = getline(&buff, &len, f);
-        if (ret >= 0) {
-            relen = strnlen(buff, MAXLINELEN);
-            // remove newline
-            if (buff[relen-1] == '\n') {
-                buff[relen-1] = '\0';
-                relen--;
-            }
-            if (state == -1) {
-                if (buff[0] != '#' && !isemptybuff(buff, relen)) state = 0;
-                else continue;
-            }
-            switch (state) {
-                case 0: // first line
-                    state++;
-                    *numkeys = atoi(buff);
-                    if (*numkeys <= 0) {
-                        fprintf(stderr, "CONFIGURATION FILE ERROR - Invalid number of keys: %d\n", *numkeys);
-                        exit(1);
-                    }
-                    keys = (key *)calloc(*numkeys, sizeof(key));
-                    if (keys == NULL) {
-                        fprintf(stderr, "malloc() failed\n");
-                        exit(1);
-                    }
-                    break;
-                case 1: // key definition
-                    if (isemptybuff(buff, strnlen(buff, MAXLINELEN))) {
-                        if (currkey != *numkeys) {
-                            fprintf(stderr, "CONFIGURATION FILE ERROR - wrong number of keys - asked for %d, found %d\n", *numkeys, currkey);
-                            exit(1);
-                        }
-                        state++;
-                        continue;
-                    }
-                    if (currkey == *numkeys) {
-                        fprintf(stderr, "CONFIGURATION FILE ERROR - too many keys - asked for %d, found %d\n", *numkeys, currkey + 1);
-                        exit(1);
-                    }
-                    if (buff[0] == '\0') {
-                        fprintf(stderr, "Parsing error - invalid base character\n");
-                        exit(1);
-                    }
-                    if (buff[0] != '-') {
-                        fprintf(stderr, "Key definition should start with '-'\n");
-                        exit(1);
-                    }
-                    char_initkey(&keys[currkey], ACTIVE, buff[1], buff+2, maxdepth);
-                    currkey++;
-                    break;
-                case 2: // neighbours definition
-                    countsetup++;
-                    if (countsetup > *numkeys) {
-                        fprintf(stderr, "CONFIGURATION FILE ERROR - too many key configuration lines\n");
-                        exit(1);
-                    }
-                    setup_neighbours(keys, *numkeys, buff);
-                    break;
-                default:
-                    fprintf(stderr, "ERROR while reading configuration file - state: %d\n", state);
-                    exit(1);
-            }
-        }
+    // private writable mapping: lines are terminated in place, only the
+    // touched pages are copied. The spare byte after the end is in the last
+    // page unless the file fills it, then fall back to a copy
+    if (len > 0 && len % pagesize != 0) {
+        buf = (char *)mmap(NULL, len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) mapped = 1;
     }
-    // reset buffer
-    free(buff);
-    buff = NULL;
-    len = 0;
-
-    // validation no repeated chars
-    ret = validKey(&keys[0]);
-    switch (ret) {
-        case NULL_KEYERR:
-            fprintf(stderr, "Invalid first NULL key\n");
-            exit(1);
-        case BASEINSV_KEYERR:
-            fprintf(stderr, "Base key %c appreas in the set of its shift variants: \"%s\"\n", keys[0].c, keys[0].shiftvar);
-            exit(1);
-        case SHIFTVARREP_KEYERR:
-            fprintf(stderr, "Base key %c has some repeated shift variant: \"%s\"\n", keys[0].c, keys[0].shiftvar);
-            exit(1);
-        case NEIGHREP_KEYERR:
-            fprintf(stderr, "Base key %c has some repeated neighbour: \"", keys[0].c);
-            for (i = 0; i < keys[0].nreach; ++i) {
-                fprintf(stderr, "%c", keys[0].reach[i]->c);
-            }
-            fprintf(stderr, "\"\n");
-            exit(1);
-        case OK_KEY:
-            break; // ok state
-        default:
-            fprintf(stderr, "CRITICAL - Invalid return value %d\n", ret);
+    if (!mapped) {
+        buf = (char *)malloc(len + 1);
+        if (buf == NULL || (len > 0 && pread(fd, buf, len, 0) != (ssize_t)len)) {
+            fprintf(stderr, "Can't read file \"%s\"\n", fpath);
             exit(1);
+        }
     }
+    close(fd);
 
-    for (i = 1; i < *numkeys; ++i) {
-        ret = validKey(&keys[i]);
-        switch (ret) {
-            case NULL_KEYERR:
-                fprintf(stderr, "Invalid NULL key\n");
-                exit(1);
-            case BASEINSV_KEYERR:
-                fprintf(stderr, "Base key %c appreas in the set of its shift variants: \"%s\"\n", keys[i].c, keys[i].shiftvar);
-                exit(1);
-            case SHIFTVARREP_KEYERR:
-                fprintf(stderr, "Base key %c has some repeated shift variant: \"%s\"\n", keys[i].c, keys[i].shiftvar);
-                exit(1);
-            case NEIGHREP_KEYERR:
-                fprintf(stderr, "Base key %c has some repeated neighbour: \"", keys[i].c);
-                for (j = 0; j < keys[i].nreach; ++j) {
-                    fprintf(stderr, "%c", keys[i].reach[j]->c);
-                }
-                fprintf(stderr, "\"\n");
-                exit(1);
-            case OK_KEY:
-                break; // ok state
-            default:
-                fprintf(stderr, "CRITICAL - Invalid return value %d\n", ret);
-                exit(1);
-        }
-        for (j = 0; j < i; ++j) {
-            if (wrongKeys(&keys[i], &keys[j])) {
-                fprintf(stderr, "Found repeated char in different keys.\n\
-                        k1 base char: %c\n\
-                        k1 shift var: %s\n\
-                        k2 base char: %c\n\
-                        k2 shift var: %s\n",
-                        keys[j].c, keys[j].shiftvar, keys[i].c, keys[i].shiftvar);
-                exit(1);
-            }
-        }
+    keys = parseBuffer(buf, len, numkeys, maxdepth, utf8, &err);
+
+    if (mapped) munmap(buf, len + 1);
+    else free(buf);
+
+    if (keys == NULL) {
+        fprintf(stderr, "%s:%d:%d: %s\n", fpath, err.line, err.col, err.msg);
+        exit(1);
     }
 
     return keys;
 }
-
@@ -11,8 +11,26 @@
 
 #include "keyboard.h"
 
-#define MAXLINELEN 1024
+// where and why parsing failed
+typedef struct parse_error {
+    int line; // 1-based line number
+    int col; // 1-based byte offset in the line
+    char msg[512];
+} parse_error;
 
-key *parseFile(const char *fpath, int *numkeys, int maxdepth);
+/* *
+ * Parse the keyboard configuration in buf (len bytes, not necessarily
+ * '\0'-terminated). Lines are terminated in place, buf must have len+1
+ * writable bytes. Lines can have any length.
+ * Returns the keyboard (a single allocation, release it with free()) or NULL
+ * after filling err; it never exits.
+ * */
+key *parseBuffer(char *buf, size_t len, int *numkeys, int maxdepth, int utf8, parse_error *err);
+
+// utf8: the file is UTF-8 encoded, otherwise any 8-bit encoding
+// the keyboard is a single allocation, release it with free()
+// the file is memory mapped and parsed with parseBuffer(), on errors the
+// message is printed as "file:line:column: message" and the process exits
+key *parseFile(const char *fpath, int *numkeys, int maxdepth, int utf8);
 
 #endif
\ No newline at end of file
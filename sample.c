@@ -0,0 +1,301 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "sample.h"
+#include "compress.h"
+#include "signals.h"
+
+typedef struct rng {
+    uint64_t s[4];
+} rng;
+
+// read-only state shared by the threads
+typedef struct sampler {
+    key *keyboard;
+    key **startkeys;
+    int minlen;
+    int depth;
+    int nlen; // lengths in [minlen, depth]
+    double *cum; // cumulative words of (start key i, length minlen+l), at i*nlen+l
+    int ncum;
+    int last; // last entry with words, taken if rounding overshoots
+    // steps + off[i] + (rem-1) * nreach: for the walks that continue with rem
+    // characters after key i, the cumulative probability of each neighbour
+    double *steps;
+    size_t *off;
+    uint64_t seed;
+} sampler;
+
+typedef struct chunk {
+    const sampler *s;
+    uint64_t index; // chunk number, selects the random stream
+    uint64_t n; // words to draw
+    char *out;
+    size_t outlen;
+    size_t outcap;
+} chunk;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void rng_seed(rng *r, uint64_t seed, uint64_t stream)
+{
+    uint64_t x = seed ^ splitmix64(&stream);
+    int i;
+
+    for (i = 0; i < 4; i++) r->s[i] = splitmix64(&x);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**
+static inline uint64_t rng_next(rng *r)
+{
+    uint64_t *s = r->s;
+    uint64_t res = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return res;
+}
+
+// uniform in [0, 1)
+static inline double rng_double(rng *r)
+{
+    return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+// uniform in [0, m) for m <= 2^32
+static inline uint32_t rng_below(rng *r, uint32_t m)
+{
+    return (uint32_t)(((rng_next(r) >> 32) * m) >> 32);
+}
+
+// write one word and its newline at p, return the end
+static char *draw(const sampler *s, rng *r, char *p)
+{
+    double u = rng_double(r) * s->cum[s->ncum-1];
+    const double *c;
+    int lo = 0, hi = s->ncum - 1, mid, len, pos, t, i, j;
+    key *k;
+
+    // first entry whose cumulative count is > u
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (s->cum[mid] > u) hi = mid;
+        else lo = mid + 1;
+    }
+    if (s->cum[lo] <= u) lo = s->last;
+    k = s->startkeys[lo / s->nlen];
+    len = s->minlen + lo % s->nlen;
+
+    for (pos = 0; pos < len - 1; pos++) {
+        // one draw picks the character (every one has the same suffixes)
+        // and, with the remaining fraction, the neighbour
+        u = rng_double(r) * (1 + k->lensv);
+        t = (int)u;
+        if (t > k->lensv) t = k->lensv;
+        u -= t;
+        memcpy(p, &k->sym[t], MAXSYMLEN);
+        p += k->symlen[t];
+
+        c = s->steps + s->off[k - s->keyboard] + (size_t)(len - pos - 2) * k->nreach;
+        // count instead of searching: the neighbour is random, a branch
+        // on it would be mispredicted at every step
+        for (i = 0, j = 0; i < k->nreach; i++) j += u >= c[i];
+        k = k->reach[j];
+    }
+    t = rng_below(r, 1 + k->lensv);
+    memcpy(p, &k->sym[t], MAXSYMLEN);
+    p += k->symlen[t];
+    *p++ = '\n';
+
+    return p;
+}
+
+/* *
+ * Fill the neighbour tables of every key for rem in [1, depth-1]: the
+ * weight of a neighbour is its number of words of rem characters. The last
+ * neighbour with words gets 2, so that a draw in [0, 1) always stops on a
+ * valid one even if the sums are rounded.
+ * */
+static void build_steps(sampler *s, int numkeys)
+{
+    size_t n = 0;
+    double *c, sum, total;
+    int i, j, rem, last;
+    key *k;
+
+    s->off = (size_t *)malloc(numkeys * sizeof(size_t));
+    if (s->off == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0; i < numkeys; i++) {
+        s->off[i] = n;
+        n += (size_t)s->keyboard[i].nreach * (s->depth - 1);
+    }
+    s->steps = (double *)malloc((n + 1) * sizeof(double));
+    if (s->steps == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+
+    for (i = 0; i < numkeys; i++) {
+        k = &s->keyboard[i];
+        for (rem = 1; rem < s->depth; rem++) {
+            c = s->steps + s->off[i] + (size_t)(rem - 1) * k->nreach;
+            for (j = 0, total = 0, last = -1; j < k->nreach; j++) {
+                total += k->reach[j]->counter[rem-1]; // 0 for inactive keys
+                if (k->reach[j]->counter[rem-1] > 0) last = j;
+            }
+            for (j = 0, sum = 0; j < k->nreach; j++) {
+                sum += k->reach[j]->counter[rem-1];
+                c[j] = j >= last ? 2 : sum / total;
+            }
+        }
+    }
+}
+
+static void *sample_chunk(void *arg)
+{
+    chunk *ch = (chunk *)arg;
+    char *p;
+    uint64_t i;
+    rng r;
+    // every character can be copied with MAXSYMLEN bytes
+    size_t need = ch->n * ((size_t)ch->s->depth * MAXSYMLEN + 1) + MAXSYMLEN;
+
+    if (need > ch->outcap) {
+        free(ch->out);
+        ch->outcap = need;
+        ch->out = (char *)malloc(ch->outcap);
+        if (ch->out == NULL) {
+            fprintf(stderr, "malloc() error\n");
+            exit(1);
+        }
+    }
+    rng_seed(&r, ch->s->seed, ch->index);
+    for (i = 0, p = ch->out; i < ch->n; i++) {
+        p = draw(ch->s, &r, p);
+    }
+    ch->outlen = p - ch->out;
+
+    return NULL;
+}
+
+uint64_t sample_words(key *keyboard, int numkeys, key **startkeys, int lenkeys, int minlen, int depth, uint64_t n, uint64_t seed, int nthreads, outbuf *o)
+{
+    sampler s;
+    chunk chunks[CZ_MAXTHREADS];
+    pthread_t tid[CZ_MAXTHREADS];
+    sigset_t set, oldset;
+    uint64_t done = 0, index = 0;
+    size_t w, len;
+    double total = 0;
+    int i, l, nrun;
+    char *p;
+
+    assert(keyboard != NULL && startkeys != NULL && o != NULL);
+    assert(minlen > 0 && minlen <= depth);
+    assert(nthreads > 0 && nthreads <= CZ_MAXTHREADS);
+
+    s.keyboard = keyboard;
+    s.startkeys = startkeys;
+    s.minlen = minlen;
+    s.depth = depth;
+    s.nlen = depth - minlen + 1;
+    s.ncum = lenkeys * s.nlen;
+    s.seed = seed;
+    s.last = 0;
+    s.cum = (double *)malloc(s.ncum * sizeof(double));
+    if (s.cum == NULL && s.ncum > 0) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0; i < lenkeys; i++) {
+        for (l = 0; l < s.nlen; l++) {
+            if (startkeys[i]->counter[minlen+l-1] > 0) s.last = i * s.nlen + l;
+            total += startkeys[i]->counter[minlen+l-1];
+            s.cum[i * s.nlen + l] = total;
+        }
+    }
+    if (total == 0) n = 0;
+    build_steps(&s, numkeys);
+
+    for (i = 0; i < nthreads; i++) {
+        chunks[i].s = &s;
+        chunks[i].out = NULL;
+        chunks[i].outcap = 0;
+    }
+
+    while (done < n && !stop_signal) {
+        for (nrun = 0; nrun < nthreads && done + (uint64_t)nrun * SAMPLECHUNK < n; nrun++) {
+            chunks[nrun].index = index + nrun;
+            chunks[nrun].n = n - done - (uint64_t)nrun * SAMPLECHUNK;
+            if (chunks[nrun].n > SAMPLECHUNK) chunks[nrun].n = SAMPLECHUNK;
+        }
+
+        // the signals are for the main thread
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, &oldset);
+        for (i = 1; i < nrun; i++) {
+            if (pthread_create(&tid[i], NULL, sample_chunk, &chunks[i]) != 0) {
+                fprintf(stderr, "pthread_create() error\n");
+                exit(1);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+        sample_chunk(&chunks[0]);
+        for (i = 1; i < nrun; i++) {
+            pthread_join(tid[i], NULL);
+        }
+
+        // write in chunk order
+        for (i = 0; i < nrun; i++) {
+            for (w = 0; w < chunks[i].outlen; w += len) {
+                len = chunks[i].outlen - w;
+                // a block ends with a complete word
+                if (len > o->cap) {
+                    for (len = o->cap; chunks[i].out[w+len-1] != '\n'; len--);
+                }
+                p = out_reserve(o, len);
+                memcpy(p, chunks[i].out + w, len);
+                o->len += len;
+            }
+            done += chunks[i].n;
+        }
+        index += nrun;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        free(chunks[i].out);
+    }
+    free(s.cum);
+    free(s.steps);
+    free(s.off);
+
+    return done;
+}
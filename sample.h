@@ -0,0 +1,33 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWSAMPLE__
+#define __KBWSAMPLE__
+
+#include <stdint.h>
+
+#include "keyboard.h"
+#include "output.h"
+
+// words drawn from one random stream; the streams are numbered, so the
+// output only depends on the seed and not on the number of threads
+#define SAMPLECHUNK 16384
+
+/* *
+ * Write n words drawn uniformly and independently (with replacement) from
+ * the words of the run with the given start keys, minlen and depth, one per
+ * line. No tree is visited: the start key and the length are chosen with
+ * weights count_words(), then every character of the key uniformly and every
+ * neighbour with weight the number of suffixes of the remaining length from
+ * it (its dry-run counter), so every word has the same probability. The
+ * neighbour weights of every key and remaining length are tabulated first.
+ * The chunks of SAMPLECHUNK words are drawn by nthreads threads, each from
+ * the xoshiro256** stream seeded with (seed, chunk number), and written in
+ * chunk order. dry_run() must have been called with maxdepth >= depth.
+ * Returns the number of words written, less than n if stop_signal was set.
+ * */
+uint64_t sample_words(key *keyboard, int numkeys, key **startkeys, int lenkeys, int minlen, int depth, uint64_t n, uint64_t seed, int nthreads, outbuf *o);
+
+#endif
@@ -0,0 +1,104 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "signals.h"
+#include "logging.h"
+
+volatile sig_atomic_t stop_signal;
+volatile sig_atomic_t progress_signal;
+
+static int logfd = -1; // for SIGSEGV, stdio can't be used in a handler
+
+static const int stopsigs[] = {SIGINT, SIGTERM, SIGALRM, SIGPIPE};
+
+static void sig_handler(int sigvalue)
+{
+    static const char segv[] = "****** RECEIVED SIGSEGV ******\n";
+    ssize_t r;
+
+    switch (sigvalue) {
+        case SIGSEGV:
+            if (logfd >= 0) {
+                r = write(logfd, segv, sizeof(segv)-1);
+                (void)r;
+            }
+            _exit(1);
+        case SIGUSR1:
+            progress_signal = 1;
+            break;
+        default:
+            stop_signal = sigvalue;
+            break;
+    }
+}
+
+const char *signal_name(int sig)
+{
+    switch (sig) {
+        case SIGSEGV: return "SIGSEGV";
+        case SIGINT: return "SIGINT";
+        case SIGTERM: return "SIGTERM";
+        case SIGALRM: return "SIGALRM";
+        case SIGPIPE: return "SIGPIPE";
+        case SIGUSR1: return "SIGUSR1";
+        default: return "unknown signal";
+    }
+}
+
+void install_handlers(FILE *logfile)
+{
+    struct sigaction sa;
+    int err, i;
+    const int sigs[] = {SIGSEGV, SIGINT, SIGTERM, SIGALRM, SIGPIPE, SIGUSR1};
+
+    stop_signal = 0;
+    progress_signal = 0;
+    logfd = fileno(logfile);
+
+    memset(&sa, 0, sizeof(struct sigaction));
+
+    // block all signals when handling
+    if (sigfillset(&sa.sa_mask) != 0) {
+        err = errno;
+        fprintf(stderr, "sigfillset() failed with error %s\n", strerror(err));
+        exit(1);
+    }
+    // no SA_RESTART: a blocking write() or accept() returns EINTR and the
+    // caller checks the flags, the writes give up when stop_signal is set
+    sa.sa_handler = sig_handler;
+
+    for (i = 0; i < (int)(sizeof(sigs)/sizeof(sigs[0])); i++) {
+        if (sigaction(sigs[i], &sa, NULL) != 0) {
+            err = errno;
+            fprintf(stderr, "sigaction() failed with error %s\n", strerror(err));
+            exit(1);
+        }
+        logmessage(LOG_CONT, logfile, "Handler for %s installed\n", signal_name(sigs[i]));
+    }
+}
+
+void wait_stop_signal(void)
+{
+    sigset_t block, old;
+    int i;
+
+    // block the stop signals so that none is lost between the check and
+    // sigsuspend()
+    sigemptyset(&block);
+    for (i = 0; i < (int)(sizeof(stopsigs)/sizeof(stopsigs[0])); i++) {
+        sigaddset(&block, stopsigs[i]);
+    }
+    sigprocmask(SIG_BLOCK, &block, &old);
+    while (stop_signal == 0) {
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
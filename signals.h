@@ -0,0 +1,33 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWSIGNALS__
+#define __KBWSIGNALS__
+
+#include <stdio.h>
+#include <signal.h>
+
+/* *
+ * The handlers only set these flags, the generation loops check them and
+ * stop (or log the progress) at a point where the output can be flushed and
+ * the resume word is known. Nothing else is safe inside a handler.
+ * */
+extern volatile sig_atomic_t stop_signal; // SIGINT, SIGTERM, SIGALRM or SIGPIPE received, 0 if none
+extern volatile sig_atomic_t progress_signal; // SIGUSR1 received, log the progress
+
+/* *
+ * Install the handlers and reset the flags. SIGSEGV writes a fixed message
+ * to logfile with write(2) and terminates with _exit(), the buffered output
+ * is lost since the process state can't be trusted.
+ * */
+void install_handlers(FILE *logfile);
+
+// name of the signals handled by install_handlers()
+const char *signal_name(int sig);
+
+// wait until one of the stop signals is received (--infinite)
+void wait_stop_signal(void);
+
+#endif
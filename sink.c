@@ -0,0 +1,421 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#define _GNU_SOURCE // O_DIRECT, fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+#include "signals.h"
+
+size_t parse_size(const char *s)
+{
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'G': case 'g': v <<= 10; // fallthrough
+        case 'M': case 'm': v <<= 10; // fallthrough
+        case 'K': case 'k': v <<= 10; end++; break;
+        default: break;
+    }
+
+    return *end == '\0' && end != s ? (size_t)v : 0;
+}
+
+// next ",option=value" of spec, NULL-terminated in place
+static int next_option(char **p, char **opt, char **val)
+{
+    char *e;
+
+    if (*p == NULL) return 0;
+    *opt = *p;
+    if ((e = strchr(*p, ',')) != NULL) *e++ = '\0';
+    *p = e;
+    if ((*val = strchr(*opt, '=')) != NULL) *(*val)++ = '\0';
+
+    return 1;
+}
+
+static int open_file(sink *s, int append, char *err, size_t errlen)
+{
+    struct stat st;
+    int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+
+    if (s->direct) flags |= O_DIRECT;
+    if ((s->fd = open(s->path, flags, 0644)) < 0) {
+        snprintf(err, errlen, "Can't open output file \"%s\": %s", s->path, strerror(errno));
+        return -1;
+    }
+    s->written = fstat(s->fd, &st) == 0 ? st.st_size : 0;
+    s->reserved = s->written;
+
+    if (s->direct) {
+        // O_APPEND with O_DIRECT needs an aligned end of file
+        if (s->written % SINK_ALIGN != 0) {
+            snprintf(err, errlen, "\"%s\" can't be appended with direct, its size isn't a multiple of %d", s->path, SINK_ALIGN);
+            return -1;
+        }
+        s->batch = (s->batch + SINK_ALIGN - 1) / SINK_ALIGN * SINK_ALIGN;
+        if (posix_memalign((void **)&s->stage, SINK_ALIGN, s->batch) != 0) {
+            snprintf(err, errlen, "posix_memalign() error");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int open_unix(sink *s, const char *path, size_t sndbuf, char *err, size_t errlen)
+{
+    struct sockaddr_un addr;
+    int v;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        snprintf(err, errlen, "Socket path \"%s\" too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((s->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        snprintf(err, errlen, "Can't connect to \"%s\": %s", path, strerror(errno));
+        return -1;
+    }
+    if (sndbuf > 0) {
+        v = (int)sndbuf;
+        setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &v, sizeof(v));
+    }
+
+    return 0;
+}
+
+static int open_ring(sink *s, size_t size, char *err, size_t errlen)
+{
+    int fd;
+    void *p;
+
+    // a power of 2 keeps the index a mask
+    if (size == 0 || (size & (size - 1)) != 0) {
+        snprintf(err, errlen, "Ring size must be a power of 2");
+        return -1;
+    }
+    if ((fd = shm_open(s->name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        snprintf(err, errlen, "Can't create shared memory \"%s\": %s", s->name, strerror(errno));
+        return -1;
+    }
+    s->maplen = SINK_ALIGN + size;
+    if (ftruncate(fd, s->maplen) != 0 || (p = mmap(NULL, s->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        snprintf(err, errlen, "Can't map shared memory \"%s\": %s", s->name, strerror(errno));
+        close(fd);
+        shm_unlink(s->name);
+        return -1;
+    }
+    close(fd);
+
+    s->ring = (ringhdr *)p;
+    s->data = (char *)p + SINK_ALIGN;
+    s->ring->size = size;
+    atomic_store(&s->ring->head, 0);
+    atomic_store(&s->ring->tail, 0);
+    atomic_store(&s->ring->closed, 0);
+    atomic_store(&s->ring->detached, 0);
+    s->ring->version = RING_VERSION;
+    // the magic is written last, the consumer waits for it
+    atomic_thread_fence(memory_order_release);
+    s->ring->magic = RING_MAGIC;
+
+    return 0;
+}
+
+int sink_open(sink *s, const char *spec, int append, size_t defbatch, char *err, size_t errlen)
+{
+    char *copy, *target, *opts, *opt, *val;
+    size_t ringsize = RING_DEFSIZE, sndbuf = 0, v;
+    int ret = -1;
+
+    assert(s != NULL && spec != NULL && err != NULL);
+
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->batch = defbatch;
+    s->wait = RING_DEFWAIT;
+
+    if ((copy = strdup(spec)) == NULL) {
+        snprintf(err, errlen, "strdup() error");
+        return -1;
+    }
+    if (strncmp(copy, "file:", 5) == 0) {
+        s->type = SINK_FILE;
+        target = copy + 5;
+    } else if (strncmp(copy, "fd:", 3) == 0) {
+        s->type = SINK_FD;
+        target = copy + 3;
+    } else if (strncmp(copy, "unix:", 5) == 0) {
+        s->type = SINK_UNIX;
+        target = copy + 5;
+    } else if (strncmp(copy, "shm:", 4) == 0) {
+        s->type = SINK_SHM;
+        target = copy + 4;
+    } else { // a plain path, no options
+        s->type = SINK_FILE;
+        target = copy;
+    }
+
+    opts = target != copy ? strchr(target, ',') : NULL;
+    if (opts != NULL) *opts++ = '\0';
+    while (next_option(&opts, &opt, &val)) {
+        v = val != NULL ? parse_size(val) : 0;
+        if (strcmp(opt, "batch") == 0 && v > 0) {
+            s->batch = v;
+        } else if (s->type == SINK_FILE && strcmp(opt, "direct") == 0 && val == NULL) {
+            s->direct = 1;
+        } else if (s->type == SINK_FILE && strcmp(opt, "prealloc") == 0 && v > 0) {
+            s->prealloc = v;
+        } else if (s->type == SINK_UNIX && strcmp(opt, "sndbuf") == 0 && v > 0) {
+            sndbuf = v;
+        } else if (s->type == SINK_SHM && strcmp(opt, "size") == 0 && v > 0) {
+            ringsize = v;
+        } else if (s->type == SINK_SHM && strcmp(opt, "wait") == 0 && val != NULL) {
+            s->wait = (unsigned int)strtoul(val, NULL, 10);
+        } else {
+            snprintf(err, errlen, "Unknown or invalid sink option \"%s\" in \"%s\"", opt, spec);
+            goto end;
+        }
+    }
+
+    if (s->batch < SINK_MINBATCH) {
+        snprintf(err, errlen, "Sink batch must be at least %dK", SINK_MINBATCH >> 10);
+        goto end;
+    }
+
+    switch (s->type) {
+        case SINK_FILE:
+            if ((s->path = strdup(target)) == NULL) break;
+            ret = open_file(s, append, err, errlen);
+            break;
+        case SINK_FD:
+            s->fd = (int)strtol(target, &opt, 10);
+            if (*target == '\0' || *opt != '\0' || fcntl(s->fd, F_GETFD) < 0) {
+                snprintf(err, errlen, "\"%s\" is not an open file descriptor", target);
+                break;
+            }
+            ret = 0;
+            break;
+        case SINK_UNIX:
+            ret = open_unix(s, target, sndbuf, err, errlen);
+            break;
+        case SINK_SHM:
+            if ((s->name = strdup(target)) == NULL) break;
+            ret = open_ring(s, ringsize, err, errlen);
+            break;
+    }
+
+end:
+    free(copy);
+    return ret;
+}
+
+// write(2) everything, 0 on success
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, buf, len);
+        // interrupted by a stop signal (EINTR or a short write) while the
+        // reader is stalled: give up and don't block on it again
+        if (stop_signal && ((r < 0 && errno == EINTR) || (r >= 0 && (size_t)r < len))) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            return -1;
+        }
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            // the reader went away (EPIPE) or the device is full
+            return -1;
+        }
+        buf += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+// keep prealloc bytes reserved after the end of the file
+static void reserve(sink *s)
+{
+    if (s->written + (off_t)s->prealloc / 2 <= s->reserved) return;
+    if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->reserved, s->written + s->prealloc - s->reserved) == 0) {
+        s->reserved = s->written + s->prealloc;
+    } else {
+        s->prealloc = 0; // not supported, don't try again
+    }
+}
+
+static int ring_write(sink *s, const char *buf, size_t len)
+{
+    ringhdr *r = s->ring;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail, off;
+    size_t n, chunk;
+
+    while (len > 0) {
+        tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        // backpressure: wait for the consumer to release some space
+        if (head - tail == r->size) {
+            // a reader that's gone, or never came, stops the producer too
+            if (stop_signal || atomic_load_explicit(&r->detached, memory_order_relaxed)) return -1;
+            if (s->wait > 0) usleep(s->wait);
+            else sched_yield();
+            continue;
+        }
+        n = r->size - (head - tail);
+        if (n > len) n = len;
+        off = head & (r->size - 1);
+        chunk = n < r->size - off ? n : r->size - off;
+        memcpy(s->data + off, buf, chunk);
+        memcpy(s->data, buf + chunk, n - chunk);
+        head += n;
+        buf += n;
+        len -= n;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+
+    return 0;
+}
+
+int sink_write(sink *s, const char *buf, size_t len)
+{
+    size_t n;
+
+    assert(s != NULL);
+
+    if (s->type == SINK_SHM) return ring_write(s, buf, len);
+
+    if (s->type == SINK_FILE && s->prealloc > 0) reserve(s);
+    if (!s->direct) {
+        if (write_all(s->fd, buf, len) != 0) return -1;
+        s->written += len;
+        return 0;
+    }
+
+    // O_DIRECT: only full aligned batches leave the staging buffer
+    while (len > 0) {
+        n = s->batch - s->staged < len ? s->batch - s->staged : len;
+        memcpy(s->stage + s->staged, buf, n);
+        s->staged += n;
+        buf += n;
+        len -= n;
+        if (s->staged == s->batch) {
+            if (write_all(s->fd, s->stage, s->staged) != 0) return -1;
+            s->written += s->staged;
+            s->staged = 0;
+        }
+    }
+
+    return 0;
+}
+
+int sink_close(sink *s)
+{
+    struct stat st;
+    int ret = 0;
+
+    if (s == NULL) return 0;
+
+    switch (s->type) {
+        case SINK_FILE:
+            if (s->direct && s->staged > 0) {
+                // the tail isn't aligned, write it through the page cache
+                ret = fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT) != 0 || write_all(s->fd, s->stage, s->staged) != 0 ? -1 : 0;
+                s->written += s->staged;
+            }
+            // give back the space reserved after the end (the compressor
+            // writes to fd directly, so the size comes from the file)
+            if (s->reserved > s->written && fstat(s->fd, &st) == 0 && ftruncate(s->fd, st.st_size) != 0) ret = -1;
+            if (s->fd >= 0 && close(s->fd) != 0) ret = -1;
+            break;
+        case SINK_UNIX:
+            if (s->fd >= 0 && close(s->fd) != 0) ret = -1;
+            break;
+        case SINK_SHM:
+            if (s->ring != NULL) {
+                atomic_store_explicit(&s->ring->closed, 1, memory_order_release);
+                // the reader may not have attached yet: wait for it to
+                // drain the ring, as for a full one
+                while (atomic_load_explicit(&s->ring->tail, memory_order_acquire) != atomic_load_explicit(&s->ring->head, memory_order_relaxed)) {
+                    if (stop_signal || atomic_load_explicit(&s->ring->detached, memory_order_relaxed)) {
+                        ret = -1;
+                        break;
+                    }
+                    if (s->wait > 0) usleep(s->wait);
+                    else sched_yield();
+                }
+                munmap(s->ring, s->maplen);
+            }
+            // the reader unlinks the ring once attached, an unread one would
+            // make the next run fail with EEXIST
+            if (s->name != NULL && shm_unlink(s->name) != 0 && errno != ENOENT) ret = -1;
+            break;
+        default: // an inherited fd stays open
+            break;
+    }
+    free(s->stage);
+    free(s->path);
+    free(s->name);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+
+    return ret;
+}
+
+ringhdr *ring_attach(const char *name, size_t *maplen)
+{
+    struct stat st;
+    ringhdr *r;
+    void *p;
+    int fd;
+
+    assert(name != NULL && maplen != NULL);
+
+    // the producer may not have started yet
+    while ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        if (errno != ENOENT) return NULL;
+        usleep(10000);
+    }
+    do {
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return NULL;
+        }
+    } while (st.st_size <= SINK_ALIGN && usleep(1000) == 0);
+
+    *maplen = st.st_size;
+    p = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    r = (ringhdr *)p;
+    while (((volatile ringhdr *)r)->magic != RING_MAGIC) usleep(1000);
+    atomic_thread_fence(memory_order_acquire);
+    shm_unlink(name);
+
+    if (r->version != RING_VERSION || r->size + SINK_ALIGN != *maplen) {
+        munmap(p, *maplen);
+        return NULL;
+    }
+
+    return r;
+}
@@ -0,0 +1,97 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWSINK__
+#define __KBWSINK__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define SINK_FILE 1 // regular file, optionally O_DIRECT and preallocated
+#define SINK_FD 2 // inherited file descriptor
+#define SINK_UNIX 3 // connected Unix-domain stream socket
+#define SINK_SHM 4 // POSIX shared memory ring buffer
+
+// O_DIRECT writes are multiples of this size, from buffers aligned to it
+#define SINK_ALIGN 4096
+// smallest batch, the generator reserves up to a few KiB at once
+#define SINK_MINBATCH (64 << 10)
+
+#define RING_MAGIC 0x4b425752 // "KBWR"
+#define RING_VERSION 1
+#define RING_DEFSIZE (64 << 20)
+#define RING_DEFWAIT 50 // us between two checks of a full (or empty) ring
+
+/* *
+ * Shared memory ring: one producer (kbw) and one consumer, the data follows
+ * the header at offset SINK_ALIGN. head and tail are byte counters that
+ * never wrap, the data of byte i is at data[i % size]; head and tail are on
+ * different cache lines so that the two sides don't share one. The consumer
+ * reads the words in place and then advances tail.
+ * */
+typedef struct ringhdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // bytes of data, a power of 2
+    char pad0[48];
+    _Atomic uint64_t head; // bytes written by the producer
+    char pad1[56];
+    _Atomic uint64_t tail; // bytes released by the consumer
+    char pad2[56];
+    _Atomic uint32_t closed; // the producer is done, head is final
+    _Atomic uint32_t detached; // the consumer went away, the producer stops waiting
+} ringhdr;
+
+typedef struct sink {
+    int type; // SINK_*
+    int fd; // -1 for SINK_SHM
+    size_t batch; // bytes handed to the sink at once (the output buffer size)
+    char *path; // file path, NULL for the other sinks
+    // SINK_FILE
+    int direct; // O_DIRECT, writes go through the aligned staging buffer
+    char *stage; // aligned staging buffer of batch bytes
+    size_t staged;
+    size_t prealloc; // bytes reserved ahead of the end of the file
+    off_t reserved; // end of the preallocated space
+    off_t written;
+    // SINK_SHM
+    char *name;
+    ringhdr *ring;
+    char *data;
+    size_t maplen;
+    unsigned int wait; // us, 0 to yield instead of sleeping
+} sink;
+
+/* *
+ * Open the sink described by spec, "kind:target[,option=value...]":
+ *   file:PATH (or just PATH)  direct, prealloc=SIZE
+ *   fd:N                      an inherited file descriptor
+ *   unix:PATH                 connect to a listening Unix socket, sndbuf=SIZE
+ *   shm:NAME                  create the ring NAME, size=SIZE, wait=USEC
+ * every kind takes batch=SIZE, sizes accept the K, M and G suffixes.
+ * defbatch is the batch used if not given; a file is appended to if append.
+ * Returns 0, or -1 with a message in err (errlen bytes).
+ * */
+int sink_open(sink *s, const char *spec, int append, size_t defbatch, char *err, size_t errlen);
+
+// "64M" -> 64 << 20 (K, M and G suffixes), 0 on errors
+size_t parse_size(const char *s);
+
+// write all the bytes, waiting for a full ring or socket; -1 on errors
+int sink_write(sink *s, const char *buf, size_t len);
+
+// flush the staged bytes, trim the preallocation and release the sink
+int sink_close(sink *s);
+
+/* *
+ * Consumer side of a ring: attach to the ring created by a producer,
+ * waiting for it to appear; the ring is unlinked, the producer keeps it
+ * mapped. Returns the header or NULL.
+ * */
+ringhdr *ring_attach(const char *name, size_t *maplen);
+
+#endif
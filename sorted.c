@@ -0,0 +1,917 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#define _GNU_SOURCE // copy_file_range()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sorted.h"
+
+// bytes of the write buffers of the segments and of the output ranges
+#define SO_IOBUF (1 << 20)
+
+// runs shorter than this are sorted by insertion
+#define SO_INSERTION 16
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (p == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int cmpline(const char *a, unsigned int alen, const char *b, unsigned int blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c != 0) return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static void seg_path(const sorter *s, int id, const char *ext, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%d.%s", s->dir, id, ext);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* *
+ * Multikey quicksort of the lines of a run: the lines are partitioned on
+ * their character at depth d, the lines equal there are sorted on d+1.
+ * The end of a line ('\n') is smaller than any character, as in memcmp()
+ * order of the words without it.
+ * */
+static inline int ch(const char *t, uint32_t off, int d)
+{
+    unsigned char c = t[off + d];
+    return c == '\n' ? 0 : c + 1;
+}
+
+static void insertion(const char *t, uint32_t *a, size_t n, int d)
+{
+    size_t i, j;
+    uint32_t v;
+    const unsigned char *p, *q;
+
+    for (i = 1; i < n; i++) {
+        v = a[i];
+        for (j = i; j > 0; j--) {
+            p = (const unsigned char *)t + a[j-1] + d;
+            q = (const unsigned char *)t + v + d;
+            while (*p == *q && *p != '\n') {
+                p++;
+                q++;
+            }
+            if ((*p == '\n' ? 0 : *p + 1) <= (*q == '\n' ? 0 : *q + 1)) break;
+            a[j] = a[j-1];
+        }
+        a[j] = v;
+    }
+}
+
+static void mkqsort(const char *t, uint32_t *a, size_t n, int d)
+{
+    size_t lt, gt, i;
+    uint32_t tmp;
+    int v, c, x, y, z;
+
+    while (n > SO_INSERTION) {
+        // median of three pivot
+        x = ch(t, a[0], d);
+        y = ch(t, a[n/2], d);
+        z = ch(t, a[n-1], d);
+        v = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+        lt = 0;
+        gt = n;
+        i = 0;
+        while (i < gt) {
+            c = ch(t, a[i], d);
+            if (c < v) {
+                tmp = a[lt]; a[lt++] = a[i]; a[i++] = tmp;
+            } else if (c > v) {
+                tmp = a[--gt]; a[gt] = a[i]; a[i] = tmp;
+            } else {
+                i++;
+            }
+        }
+        mkqsort(t, a, lt, d);
+        mkqsort(t, a + gt, n - gt, d);
+        // the lines equal up to their end are done
+        if (v == 0) return;
+        a += lt;
+        n = gt - lt;
+        d++;
+    }
+    insertion(t, a, n, d);
+}
+
+/* *
+ * Segment writer: front codes the lines it receives, already sorted, and
+ * drops the repeated ones.
+ * */
+struct sowriter {
+    FILE *f;
+    char *buf;
+    struct sosegment *seg;
+    size_t caprs;
+    uint64_t lastrs; // offset of the last restart
+    char prev[SO_MAXLINE];
+    unsigned int plen;
+    uint64_t dups;
+};
+
+static void put_varint(struct sowriter *w, unsigned int v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((v & 0x7f) | 0x80, w->f);
+        v >>= 7;
+        w->seg->size++;
+    }
+    putc_unlocked(v, w->f);
+    w->seg->size++;
+}
+
+static void sow_open(sorter *s, struct sowriter *w, struct sosegment *seg)
+{
+    char path[sizeof(s->dir) + 32];
+
+    seg_path(s, seg->id, "seg", path, sizeof(path));
+    memset(w, 0, sizeof(*w));
+    w->seg = seg;
+    if ((w->f = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Can't create segment \"%s\": %s\n", path, strerror(errno));
+        exit(1);
+    }
+    w->buf = (char *)xmalloc(SO_IOBUF);
+    setvbuf(w->f, w->buf, _IOFBF, SO_IOBUF);
+}
+
+static void sow_add(struct sowriter *w, const char *line, unsigned int len)
+{
+    struct sosegment *seg = w->seg;
+    struct sorestart *r;
+    unsigned int shared = 0;
+
+    if (seg->nwords > 0) {
+        if (cmpline(line, len, w->prev, w->plen) == 0) {
+            w->dups++;
+            return;
+        }
+        if (seg->size - w->lastrs < SO_RESTARTBYTES) {
+            for (; shared < len && shared < w->plen && line[shared] == w->prev[shared]; shared++);
+        }
+    }
+    if (seg->nwords == 0 || shared == 0) {
+        // a full line, record it
+        if (seg->nrs == w->caprs) {
+            w->caprs = w->caprs > 0 ? 2 * w->caprs : 64;
+            seg->rs = (struct sorestart *)realloc(seg->rs, w->caprs * sizeof(struct sorestart));
+            if (seg->rs == NULL) {
+                fprintf(stderr, "malloc() error\n");
+                exit(1);
+            }
+        }
+        r = &seg->rs[seg->nrs++];
+        r->off = seg->size;
+        r->rank = seg->nwords;
+        r->len = len;
+        r->word = (char *)xmalloc(len + 1);
+        memcpy(r->word, line, len);
+        w->lastrs = seg->size;
+    }
+
+    put_varint(w, shared);
+    put_varint(w, len - shared);
+    fwrite(line + shared, 1, len - shared, w->f);
+    seg->size += len - shared;
+    seg->nwords++;
+    memcpy(w->prev, line, len);
+    w->plen = len;
+}
+
+static int sow_close(struct sowriter *w)
+{
+    int err = ferror(w->f) || fclose(w->f) != 0;
+
+    free(w->buf);
+    return err ? -1 : 0;
+}
+
+/* *
+ * Segment reader, over the mapped file: word always holds the current line,
+ * the lines from hi on are not returned.
+ * */
+struct soreader {
+    const unsigned char *p, *end;
+    char word[SO_MAXLINE];
+    unsigned int len;
+    const char *hi;
+    unsigned int hilen;
+};
+
+static unsigned int get_varint(struct soreader *r)
+{
+    unsigned int v = 0;
+    int shift = 0;
+
+    while (r->p < r->end && (*r->p & 0x80)) {
+        v |= (*r->p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    if (r->p < r->end) v |= *r->p++ << shift;
+    return v;
+}
+
+// next line, 0 at the end of the segment or of the range
+static int sor_next(struct soreader *r)
+{
+    unsigned int shared, n;
+
+    if (r->p >= r->end) return 0;
+    shared = get_varint(r);
+    n = get_varint(r);
+    assert(shared <= r->len && shared + n <= SO_MAXLINE && r->p + n <= r->end);
+    memcpy(r->word + shared, r->p, n);
+    r->p += n;
+    r->len = shared + n;
+    if (r->hi != NULL && cmpline(r->word, r->len, r->hi, r->hilen) >= 0) {
+        r->p = r->end;
+        return 0;
+    }
+    return 1;
+}
+
+/* *
+ * Position r on the first line >= lo (the whole segment if lo is NULL),
+ * starting from the last full line before lo. Returns 0 if there is no line
+ * in [lo, hi).
+ * */
+static int sor_start(struct soreader *r, const struct sosegment *seg, const unsigned char *base, const char *lo, unsigned int lolen, const char *hi, unsigned int hilen)
+{
+    size_t a = 0, b = seg->nrs, m;
+
+    r->p = base;
+    r->end = base + seg->size;
+    r->len = 0;
+    r->hi = hi;
+    r->hilen = hilen;
+    if (lo != NULL && seg->nrs > 0) {
+        // last restart < lo
+        while (b - a > 1) {
+            m = (a + b) / 2;
+            if (cmpline(seg->rs[m].word, seg->rs[m].len, lo, lolen) < 0) a = m;
+            else b = m;
+        }
+        r->p = base + seg->rs[a].off;
+    }
+    while (sor_next(r)) {
+        if (lo == NULL || cmpline(r->word, r->len, lo, lolen) >= 0) return 1;
+    }
+    return 0;
+}
+
+// heap of readers ordered by their current line
+static void sift_down(struct soreader **h, int n, int i)
+{
+    int c;
+    struct soreader *tmp;
+
+    while ((c = 2*i + 1) < n) {
+        if (c + 1 < n && cmpline(h[c+1]->word, h[c+1]->len, h[c]->word, h[c]->len) < 0) c++;
+        if (cmpline(h[i]->word, h[i]->len, h[c]->word, h[c]->len) <= 0) break;
+        tmp = h[i]; h[i] = h[c]; h[c] = tmp;
+        i = c;
+    }
+}
+
+typedef void (*so_emit)(void *ctx, const char *line, unsigned int len);
+
+/* *
+ * k-way merge of the readers positioned with sor_start() (started says
+ * whether each one has a line), each distinct line is passed to emit.
+ * Returns the number of dropped duplicates.
+ * */
+static uint64_t merge(struct soreader *r, const int *started, int n, so_emit emit, void *ctx)
+{
+    struct soreader **h = (struct soreader **)xmalloc((n + 1) * sizeof(struct soreader *));
+    char last[SO_MAXLINE];
+    unsigned int lastlen = 0;
+    int i, nh = 0, first = 1;
+    uint64_t dups = 0;
+
+    for (i = 0; i < n; i++) {
+        if (started[i]) h[nh++] = &r[i];
+    }
+    for (i = nh / 2 - 1; i >= 0; i--) sift_down(h, nh, i);
+
+    while (nh > 0) {
+        if (!first && cmpline(h[0]->word, h[0]->len, last, lastlen) == 0) {
+            dups++;
+        } else {
+            emit(ctx, h[0]->word, h[0]->len);
+            memcpy(last, h[0]->word, h[0]->len);
+            lastlen = h[0]->len;
+            first = 0;
+        }
+        if (!sor_next(h[0])) h[0] = h[--nh];
+        sift_down(h, nh, 0);
+    }
+    free(h);
+
+    return dups;
+}
+
+static const unsigned char *seg_map(sorter *s, const struct sosegment *seg)
+{
+    char path[sizeof(s->dir) + 32];
+    void *p;
+    int fd;
+
+    if (seg->size == 0) return NULL;
+    seg_path(s, seg->id, "seg", path, sizeof(path));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "Can't open segment \"%s\": %s\n", path, strerror(errno));
+        exit(1);
+    }
+    p = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Can't map segment \"%s\": %s\n", path, strerror(errno));
+        exit(1);
+    }
+    madvise(p, seg->size, MADV_SEQUENTIAL);
+    return (const unsigned char *)p;
+}
+
+static void seg_free(sorter *s, struct sosegment *seg)
+{
+    char path[sizeof(s->dir) + 32];
+    size_t i;
+
+    seg_path(s, seg->id, "seg", path, sizeof(path));
+    unlink(path);
+    for (i = 0; i < seg->nrs; i++) free(seg->rs[i].word);
+    free(seg->rs);
+    free(seg);
+}
+
+static struct sosegment *seg_new(sorter *s, int level)
+{
+    struct sosegment *seg = (struct sosegment *)calloc(1, sizeof(struct sosegment));
+
+    if (seg == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&s->lock);
+    seg->id = s->nextid++;
+    pthread_mutex_unlock(&s->lock);
+    seg->level = level;
+    return seg;
+}
+
+// with the lock held
+static void seg_add(sorter *s, struct sosegment *seg)
+{
+    if (s->nsegs == s->capsegs) {
+        s->capsegs = s->capsegs > 0 ? 2 * s->capsegs : 64;
+        s->segs = (struct sosegment **)realloc(s->segs, s->capsegs * sizeof(struct sosegment *));
+        if (s->segs == NULL) {
+            fprintf(stderr, "malloc() error\n");
+            exit(1);
+        }
+    }
+    s->segs[s->nsegs++] = seg;
+}
+
+// sort a run and spill it as a level 0 segment
+static void spill(sorter *s, struct sorun *run)
+{
+    struct sowriter w;
+    struct sosegment *seg;
+    size_t n = 0, i;
+    const char *p, *q, *end = run->text + run->len;
+
+    for (p = run->text; p < end; p = q + 1) {
+        q = (const char *)memchr(p, '\n', end - p);
+        assert(q != NULL); // only complete lines
+        if (q - p >= SO_MAXLINE) {
+            fprintf(stderr, "Line of %zu bytes, longer than %d, can't be sorted\n", (size_t)(q - p), SO_MAXLINE);
+            exit(1);
+        }
+        if (n == run->linecap) {
+            run->linecap = run->linecap > 0 ? 2 * run->linecap : run->len / 8 + 16;
+            run->line = (uint32_t *)realloc(run->line, run->linecap * sizeof(uint32_t));
+            if (run->line == NULL) {
+                fprintf(stderr, "malloc() error\n");
+                exit(1);
+            }
+        }
+        run->line[n++] = p - run->text;
+    }
+    mkqsort(run->text, run->line, n, 0);
+
+    seg = seg_new(s, 0);
+    sow_open(s, &w, seg);
+    for (i = 0; i < n; i++) {
+        p = run->text + run->line[i];
+        q = (const char *)memchr(p, '\n', end - p);
+        sow_add(&w, p, q - p);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (sow_close(&w) != 0) s->error = 1;
+    seg_add(s, seg);
+    s->st.dups += w.dups;
+    s->st.runs++;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *so_worker(void *arg)
+{
+    sorter *s = (sorter *)arg;
+    struct sorun *run;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        for (i = 0; i < s->nruns && s->runs[i].state != SO_READY; i++);
+        if (i < s->nruns) {
+            run = &s->runs[i];
+            run->state = SO_BUSY;
+            pthread_mutex_unlock(&s->lock);
+
+            spill(s, run);
+
+            pthread_mutex_lock(&s->lock);
+            run->len = 0;
+            run->state = SO_EMPTY;
+            pthread_cond_broadcast(&s->cond);
+            continue;
+        }
+        if (s->closing) break;
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void emit_segment(void *ctx, const char *line, unsigned int len)
+{
+    sow_add((struct sowriter *)ctx, line, len);
+}
+
+/* *
+ * Background merges: whenever SO_FANIN segments of the same level are
+ * ready, the oldest ones are merged into one of the next level, so that the
+ * final merge only has a few segments left. No merge is started after
+ * so_close().
+ * */
+static void *so_merger(void *arg)
+{
+    sorter *s = (sorter *)arg;
+    struct sosegment *in[SO_FANIN], *seg;
+    const unsigned char *base[SO_FANIN];
+    struct soreader *r;
+    int started[SO_FANIN];
+    struct sowriter w;
+    int i, j, n, level, cnt[64];
+    uint64_t dups;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->closing) {
+        // the lowest level with enough segments
+        memset(cnt, 0, sizeof(cnt));
+        for (i = 0, level = -1; i < s->nsegs; i++) {
+            if (!s->segs[i]->busy && s->segs[i]->level < 64 && ++cnt[s->segs[i]->level] == SO_FANIN) {
+                if (level < 0 || s->segs[i]->level < level) level = s->segs[i]->level;
+            }
+        }
+        if (level < 0) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        for (i = 0, n = 0; i < s->nsegs && n < SO_FANIN; i++) {
+            if (!s->segs[i]->busy && s->segs[i]->level == level) {
+                in[n++] = s->segs[i];
+                s->segs[i]->busy = 1;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        r = (struct soreader *)xmalloc(n * sizeof(struct soreader));
+        for (i = 0; i < n; i++) {
+            base[i] = seg_map(s, in[i]);
+            started[i] = base[i] != NULL && sor_start(&r[i], in[i], base[i], NULL, 0, NULL, 0);
+        }
+        seg = seg_new(s, level + 1);
+        sow_open(s, &w, seg);
+        dups = merge(r, started, n, emit_segment, &w);
+        for (i = 0; i < n; i++) {
+            if (base[i] != NULL) munmap((void *)base[i], in[i]->size);
+        }
+        free(r);
+
+        pthread_mutex_lock(&s->lock);
+        if (sow_close(&w) != 0) s->error = 1;
+        s->st.dups += dups + w.dups;
+        s->st.merges++;
+        for (i = 0, j = 0; i < s->nsegs; i++) {
+            if (!s->segs[i]->busy) s->segs[j++] = s->segs[i];
+        }
+        s->nsegs = j;
+        seg_add(s, seg);
+        for (i = 0; i < n; i++) seg_free(s, in[i]);
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+sorter *so_open(const char *outpath, int fd, size_t mem, int nthreads, size_t bufsize, char *err, size_t errlen)
+{
+    sorter *s;
+    sigset_t set, oldset;
+    size_t cap;
+    int i;
+
+    assert(outpath != NULL);
+
+    if (nthreads <= 0) nthreads = 1;
+    if (nthreads > SO_MAXTHREADS) nthreads = SO_MAXTHREADS;
+    if (mem < SO_MINMEM) mem = SO_MINMEM;
+
+    s = (sorter *)calloc(1, sizeof(sorter));
+    if (s == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    s->fd = fd;
+    s->nthreads = nthreads;
+    snprintf(s->idxpath, sizeof(s->idxpath), "%s.idx", outpath);
+    // on the same file system as the output, the ranges are moved there
+    snprintf(s->dir, sizeof(s->dir), "%s.segXXXXXX", outpath);
+    if (mkdtemp(s->dir) == NULL) {
+        snprintf(err, errlen, "Can't create the segment directory \"%s\": %s", s->dir, strerror(errno));
+        free(s);
+        return NULL;
+    }
+
+    // one run filled while each thread sorts one, two thirds of the memory
+    // for the text and one third for the line offsets
+    s->nruns = nthreads + 1;
+    cap = mem / s->nruns / 3 * 2;
+    if (cap < 2 * bufsize) cap = 2 * bufsize;
+    if (cap > SO_MAXRUN) cap = SO_MAXRUN;
+    s->runs = (struct sorun *)calloc(s->nruns, sizeof(struct sorun));
+    if (s->runs == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0; i < s->nruns; i++) {
+        s->runs[i].cap = cap;
+        s->runs[i].text = (char *)xmalloc(cap);
+        s->runs[i].state = SO_EMPTY;
+    }
+    s->cur = 0;
+    s->runs[0].state = SO_FILLING;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    // signals are handled by the generator thread only
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&s->threads[i], NULL, so_worker, s) != 0) {
+            fprintf(stderr, "pthread_create() error\n");
+            exit(1);
+        }
+    }
+    if (pthread_create(&s->merger, NULL, so_merger, s) != 0) {
+        fprintf(stderr, "pthread_create() error\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return s;
+}
+
+char *so_submit(sorter *s, char *buf, size_t len)
+{
+    struct sorun *run;
+    int i;
+
+    assert(s != NULL && buf != NULL);
+    if (len == 0) return buf;
+
+    run = &s->runs[s->cur];
+    if (run->len + len > run->cap) {
+        pthread_mutex_lock(&s->lock);
+        run->state = SO_READY;
+        pthread_cond_broadcast(&s->cond);
+        while (1) {
+            for (i = 0; i < s->nruns && s->runs[i].state != SO_EMPTY; i++);
+            if (i < s->nruns) break;
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        s->cur = i;
+        run = &s->runs[i];
+        run->state = SO_FILLING;
+        pthread_mutex_unlock(&s->lock);
+    }
+    // the filling run belongs to the generator
+    assert(len <= run->cap);
+    memcpy(run->text + run->len, buf, len);
+    run->len += len;
+
+    return buf;
+}
+
+/* *
+ * One range of the final merge, [lo, hi) (NULL for no bound). The first
+ * range is written to the output, the others to <dir>/<p>.part and moved
+ * after it; the index entries have offsets relative to the range.
+ * */
+struct sopart {
+    sorter *s;
+    int p;
+    const char *lo, *hi;
+    unsigned int lolen, hilen;
+    const unsigned char **base;
+    int fd;
+    FILE *idx;
+    char *buf;
+    size_t len;
+    uint64_t off; // bytes written
+    uint64_t nextidx;
+    uint64_t words, dups;
+    int error;
+};
+
+static void emit_output(void *ctx, const char *line, unsigned int len)
+{
+    struct sopart *pt = (struct sopart *)ctx;
+
+    if (pt->off + pt->len >= pt->nextidx) {
+        fprintf(pt->idx, "%lu\t%.*s\n", pt->off + pt->len, (int)len, line);
+        pt->nextidx = pt->off + pt->len + SO_INDEXSTEP;
+    }
+    if (pt->len + len + 1 > SO_IOBUF) {
+        if (write_all(pt->fd, pt->buf, pt->len) != 0) pt->error = 1;
+        pt->off += pt->len;
+        pt->len = 0;
+    }
+    memcpy(pt->buf + pt->len, line, len);
+    pt->buf[pt->len + len] = '\n';
+    pt->len += len + 1;
+    pt->words++;
+}
+
+static void *so_part(void *arg)
+{
+    struct sopart *pt = (struct sopart *)arg;
+    sorter *s = pt->s;
+    struct soreader *r = (struct soreader *)xmalloc(s->nsegs * sizeof(struct soreader));
+    int *started = (int *)xmalloc(s->nsegs * sizeof(int));
+    int i;
+
+    for (i = 0; i < s->nsegs; i++) {
+        started[i] = pt->base[i] != NULL && sor_start(&r[i], s->segs[i], pt->base[i], pt->lo, pt->lolen, pt->hi, pt->hilen);
+    }
+    pt->buf = (char *)xmalloc(SO_IOBUF);
+    pt->dups = merge(r, started, s->nsegs, emit_output, pt);
+    if (write_all(pt->fd, pt->buf, pt->len) != 0) pt->error = 1;
+    pt->off += pt->len;
+    free(pt->buf);
+    free(started);
+    free(r);
+
+    return NULL;
+}
+
+static int cmprestart(const void *a, const void *b)
+{
+    const struct sorestart *x = *(const struct sorestart *const *)a, *y = *(const struct sorestart *const *)b;
+    return cmpline(x->word, x->len, y->word, y->len);
+}
+
+/* *
+ * Split the words of the segments in nparts ranges of about the same size:
+ * the full lines of all the segments, sorted, weighted with the lines up to
+ * the next one, give the bounds. split receives nparts-1 of them.
+ * */
+static void choose_splits(sorter *s, struct sorestart **split, int nparts)
+{
+    struct sorestart **all;
+    size_t n = 0, i, j;
+    double total = 0, cum = 0;
+    int p = 1;
+
+    for (i = 0; i < (size_t)s->nsegs; i++) n += s->segs[i]->nrs;
+    all = (struct sorestart **)xmalloc((n + 1) * sizeof(struct sorestart *));
+    for (i = 0, n = 0; i < (size_t)s->nsegs; i++) {
+        for (j = 0; j < s->segs[i]->nrs; j++) {
+            // the rank is replaced by the lines up to the next full one
+            s->segs[i]->rs[j].rank = (j + 1 < s->segs[i]->nrs ? s->segs[i]->rs[j+1].rank : s->segs[i]->nwords) - s->segs[i]->rs[j].rank;
+            all[n++] = &s->segs[i]->rs[j];
+        }
+    }
+    qsort(all, n, sizeof(struct sorestart *), cmprestart);
+    for (i = 0; i < n; i++) total += all[i]->rank;
+    for (i = 0; i < n && p < nparts; i++) {
+        while (p < nparts && cum >= total * p / nparts) split[p++ - 1] = all[i];
+        cum += all[i]->rank;
+    }
+    // not enough full lines: the last ranges are empty
+    while (p < nparts) split[p++ - 1] = n > 0 ? all[n-1] : NULL;
+    free(all);
+}
+
+// append the file in to out, in the kernel if possible
+static int append_file(int out, int in, uint64_t len)
+{
+    char *buf;
+    ssize_t ret = 0;
+
+    while (len > 0) {
+        ret = copy_file_range(in, NULL, out, NULL, len, 0);
+        if (ret <= 0) break;
+        len -= ret;
+    }
+    if (len == 0) return 0;
+    if (ret < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+
+    buf = (char *)xmalloc(SO_IOBUF);
+    while (len > 0) {
+        ret = read(in, buf, len < SO_IOBUF ? len : SO_IOBUF);
+        if (ret <= 0 || write_all(out, buf, ret) != 0) break;
+        len -= ret;
+    }
+    free(buf);
+    return len == 0 ? 0 : -1;
+}
+
+int so_close(sorter *s, sostats *st)
+{
+    struct sopart *parts;
+    struct sorestart **split;
+    const unsigned char **base;
+    pthread_t *threads;
+    sigset_t set, oldset;
+    char path[sizeof(s->dir) + 32];
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    FILE *idx, *f;
+    uint64_t start;
+    int i, nparts, err;
+
+    if (s == NULL) return 0;
+
+    // spill the last run and stop the threads
+    pthread_mutex_lock(&s->lock);
+    if (s->runs[s->cur].len > 0) s->runs[s->cur].state = SO_READY;
+    else s->runs[s->cur].state = SO_EMPTY;
+    s->closing = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nthreads; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+    pthread_join(s->merger, NULL);
+    for (i = 0; i < s->nruns; i++) {
+        free(s->runs[i].text);
+        free(s->runs[i].line);
+    }
+    free(s->runs);
+
+    // the final merge, a range of words for each thread
+    nparts = s->nthreads;
+    parts = (struct sopart *)calloc(nparts, sizeof(struct sopart));
+    split = (struct sorestart **)calloc(nparts, sizeof(struct sorestart *));
+    threads = (pthread_t *)xmalloc(nparts * sizeof(pthread_t));
+    base = (const unsigned char **)xmalloc((s->nsegs + 1) * sizeof(unsigned char *));
+    if (parts == NULL || split == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    for (i = 0; i < s->nsegs; i++) base[i] = seg_map(s, s->segs[i]);
+    choose_splits(s, split, nparts);
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    for (i = 0; i < nparts; i++) {
+        parts[i].s = s;
+        parts[i].p = i;
+        parts[i].base = base;
+        if (i > 0 && split[i-1] != NULL) {
+            parts[i].lo = split[i-1]->word;
+            parts[i].lolen = split[i-1]->len;
+        }
+        if (i < nparts - 1 && split[i] != NULL) {
+            parts[i].hi = split[i]->word;
+            parts[i].hilen = split[i]->len;
+        }
+        if (i == 0) {
+            parts[i].fd = s->fd;
+        } else {
+            seg_path(s, i, "part", path, sizeof(path));
+            if ((parts[i].fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+                fprintf(stderr, "Can't create \"%s\": %s\n", path, strerror(errno));
+                exit(1);
+            }
+        }
+        seg_path(s, i, "idx", path, sizeof(path));
+        if ((parts[i].idx = fopen(path, "w+")) == NULL) {
+            fprintf(stderr, "Can't create \"%s\": %s\n", path, strerror(errno));
+            exit(1);
+        }
+        if (pthread_create(&threads[i], NULL, so_part, &parts[i]) != 0) {
+            fprintf(stderr, "pthread_create() error\n");
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    // the ranges after the first one are moved to the output in order, the
+    // index offsets are made absolute
+    err = s->error;
+    if ((idx = fopen(s->idxpath, "w")) == NULL) {
+        fprintf(stderr, "Can't create index file \"%s\": %s\n", s->idxpath, strerror(errno));
+        err = 1;
+    }
+    start = 0;
+    for (i = 0; i < nparts; i++) {
+        pthread_join(threads[i], NULL);
+        if (parts[i].error) err = 1;
+        if (i > 0) {
+            if (lseek(parts[i].fd, 0, SEEK_SET) != 0 || append_file(s->fd, parts[i].fd, parts[i].off) != 0) err = 1;
+            close(parts[i].fd);
+            seg_path(s, i, "part", path, sizeof(path));
+            unlink(path);
+        }
+        f = parts[i].idx;
+        rewind(f);
+        while (idx != NULL && (n = getline(&line, &cap, f)) > 0) {
+            fprintf(idx, "%lu%s", (unsigned long)(start + strtoull(line, NULL, 10)), strchr(line, '\t'));
+        }
+        fclose(f);
+        seg_path(s, i, "idx", path, sizeof(path));
+        unlink(path);
+        start += parts[i].off;
+        s->st.words += parts[i].words;
+        s->st.dups += parts[i].dups;
+    }
+    if (idx != NULL && fclose(idx) != 0) err = 1;
+    free(line);
+    s->st.parts = nparts;
+
+    for (i = 0; i < s->nsegs; i++) {
+        if (base[i] != NULL) munmap((void *)base[i], s->segs[i]->size);
+        seg_free(s, s->segs[i]);
+    }
+    rmdir(s->dir);
+
+    if (st != NULL) *st = s->st;
+    free(base);
+    free(threads);
+    free(split);
+    free(parts);
+    free(s->segs);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+
+    return err ? -1 : 0;
+}
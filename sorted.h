@@ -0,0 +1,128 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWSORTED__
+#define __KBWSORTED__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cmdlineopts.h"
+
+// max number of sorting and merging threads
+#define SO_MAXTHREADS 64
+
+// segments of the same level merged together while the words are generated
+#define SO_FANIN 16
+
+// a segment restarts with a full word every this many bytes, a merge can
+// start reading it from there
+#define SO_RESTARTBYTES (64 << 10)
+
+// the index has an entry every this many bytes of output
+#define SO_INDEXSTEP (64 << 10)
+
+// longest line (word and tags), in bytes
+#define SO_MAXLINE 4096
+
+// memory for the runs: minimum and default
+#define SO_MINMEM (16 << 20)
+#define SO_DEFMEM (1 << 30)
+
+// line offsets of a run are 32 bits
+#define SO_MAXRUN ((size_t)1 << 31)
+
+// run states
+#define SO_EMPTY 0
+#define SO_FILLING 1 // receiving the blocks of the generator
+#define SO_READY 2 // full, waiting for a thread
+#define SO_BUSY 3 // being sorted and spilled
+
+struct sorun {
+    char *text; // complete lines
+    size_t len;
+    size_t cap;
+    uint32_t *line; // offset of each line in text, sorted in place
+    size_t linecap;
+    int state;
+};
+
+// a full word of a segment
+struct sorestart {
+    uint64_t off; // byte offset in the segment
+    uint64_t rank; // words before it
+    unsigned int len;
+    char *word;
+};
+
+/* *
+ * Sorted segment file: the distinct lines of one or more runs, front coded
+ * (the length of the prefix shared with the previous line and the length
+ * of the rest as varints, then the rest, without the '\n'). Every
+ * SO_RESTARTBYTES bytes a line is written whole and recorded in rs.
+ * */
+struct sosegment {
+    int id; // file <dir>/<id>.seg
+    int level; // 0 for a run, one more than their inputs for a merge
+    int busy; // being merged
+    uint64_t nwords;
+    uint64_t size; // bytes
+    struct sorestart *rs;
+    size_t nrs;
+};
+
+typedef struct sostats {
+    uint64_t words; // distinct lines written
+    uint64_t dups; // duplicated lines dropped
+    uint64_t runs; // runs spilled
+    uint64_t merges; // background merges
+    int parts; // ranges of the final merge
+} sostats;
+
+/* *
+ * Sorted output: the blocks of the output buffer are gathered in runs of
+ * bounded size, the runs are sorted (bytewise, the order of LC_ALL=C sort)
+ * and spilled as segments by a pool of threads while the words are
+ * generated, and a background thread merges every SO_FANIN segments of the
+ * same level. At the end the remaining segments are merged in parallel,
+ * each thread taking a range of words, into the output file without
+ * duplicated lines, with a sparse index (one line every SO_INDEXSTEP bytes:
+ * offset, tab, the line at that offset).
+ * */
+typedef struct sorter {
+    char dir[MAXPATHLEN + 16]; // segments, next to the output
+    char idxpath[MAXPATHLEN + 8];
+    int fd; // output file
+    int nthreads;
+    pthread_t threads[SO_MAXTHREADS];
+    pthread_t merger;
+    int nruns;
+    struct sorun *runs;
+    int cur; // run being filled
+    struct sosegment **segs;
+    int nsegs;
+    int capsegs;
+    int nextid;
+    int closing;
+    int error; // a segment couldn't be written
+    sostats st;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sorter;
+
+// outpath: the output file, fd its descriptor; mem: bytes of the runs
+// (about, the line offsets included); bufsize: the largest block passed to
+// so_submit(). NULL after writing a message in err
+sorter *so_open(const char *outpath, int fd, size_t mem, int nthreads, size_t bufsize, char *err, size_t errlen);
+
+// add a block of complete lines, the buffer is returned to the caller
+char *so_submit(sorter *s, char *buf, size_t len);
+
+// merge everything into the output and the index, remove the segments and
+// release s; st (if not NULL) receives the statistics. 0 on success
+int so_close(sorter *s, sostats *st);
+
+#endif
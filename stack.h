@@ -12,7 +12,7 @@
 struct stackel {
     key *k;
     int idx;
-    int type; // -1 = c, >= 0 shiftvar index
+    int type; // -1 base character, >= 0 shift variant index
     int visited;
 };
 
@@ -0,0 +1,153 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "suffix.h"
+
+// sizes of the blocks of one depth, from the ones of the previous depth
+static void block_sizes(key *keyboard, int numkeys, const double *plines, const double *pbytes, double *lines, double *bytes)
+{
+    int i, j, t;
+    key *k, *n;
+
+    for (i = 0; i < numkeys; i++) {
+        k = &keyboard[i];
+        lines[i] = bytes[i] = 0;
+        if (k->active != ACTIVE) continue;
+        for (j = 0; j < k->nreach; j++) {
+            n = k->reach[j];
+            if (n->active != ACTIVE) continue;
+            // every character of n alone and in front of each suffix of n
+            for (t = 0; t <= n->lensv; t++) {
+                lines[i] += 1 + plines[n - keyboard];
+                bytes[i] += n->symlen[t] + 1 + n->symlen[t] * plines[n - keyboard] + pbytes[n - keyboard];
+            }
+        }
+    }
+}
+
+int sufcache_init(sufcache *c, key *keyboard, int numkeys, int maxdepth, size_t budget)
+{
+    double *lines, *bytes, *plines, *pbytes, *tmp, total;
+    int i, d;
+
+    assert(c != NULL && keyboard != NULL);
+
+    memset(c, 0, sizeof(*c));
+    c->keyboard = keyboard;
+    c->numkeys = numkeys;
+    if (maxdepth > SUFMAXDEPTH) maxdepth = SUFMAXDEPTH;
+
+    lines = (double *)calloc(numkeys, sizeof(double));
+    bytes = (double *)calloc(numkeys, sizeof(double));
+    plines = (double *)calloc(numkeys, sizeof(double));
+    pbytes = (double *)calloc(numkeys, sizeof(double));
+    if (lines == NULL || bytes == NULL || plines == NULL || pbytes == NULL) {
+        fprintf(stderr, "calloc() error\n");
+        exit(1);
+    }
+
+    for (d = 1; d <= maxdepth; d++) {
+        block_sizes(keyboard, numkeys, plines, pbytes, lines, bytes);
+        // text, padding and the two bytes per line of lengths
+        for (i = 0, total = 0; i < numkeys; i++) {
+            total += bytes[i] + SUFLINE + 2 * lines[i];
+        }
+        if (total > budget) break;
+        tmp = plines; plines = lines; lines = tmp;
+        tmp = pbytes; pbytes = bytes; bytes = tmp;
+    }
+    // plines and pbytes hold the sizes for d-1
+    c->depth = d-1 >= 2 ? d-1 : 0;
+
+    if (c->depth > 0) {
+        c->blocks = (sufblock *)calloc(numkeys, sizeof(sufblock));
+        if (c->blocks == NULL) {
+            fprintf(stderr, "calloc() error\n");
+            exit(1);
+        }
+        for (i = 0; i < numkeys; i++) {
+            c->blocks[i].n = (size_t)plines[i];
+            c->blocks[i].size = (size_t)pbytes[i];
+        }
+    }
+
+    free(lines);
+    free(bytes);
+    free(plines);
+    free(pbytes);
+
+    return c->depth;
+}
+
+// append the walks of length 1..d from the neighbours of k to pre
+static void fill(sufblock *b, size_t *pos, size_t *line, char *pre, int plen, int psym, const key *k, int d)
+{
+    int i, t, l;
+    const key *n;
+
+    // same pop order as dfs(): last neighbour first, for each of them the
+    // last shift variant first and the base character last
+    for (i = k->nreach-1; i >= 0; i--) {
+        n = k->reach[i];
+        if (n->active != ACTIVE) continue;
+        for (t = n->lensv; t >= 0; t--) {
+            memcpy(pre + plen, &n->sym[t], MAXSYMLEN);
+            l = plen + n->symlen[t];
+            memcpy(b->text + *pos, pre, l);
+            b->text[*pos + l] = '\n';
+            b->len[*line] = l + 1;
+            b->nsym[*line] = psym + 1;
+            *pos += l + 1;
+            (*line)++;
+            if (d > 1) fill(b, pos, line, pre, l, psym + 1, n, d-1);
+        }
+    }
+}
+
+const sufblock *sufcache_get(sufcache *c, const key *k)
+{
+    sufblock *b;
+    char pre[(SUFMAXDEPTH + 1) * MAXSYMLEN];
+    size_t pos = 0, line = 0;
+
+    assert(c != NULL && c->depth > 0);
+    assert(k >= c->keyboard && k < c->keyboard + c->numkeys);
+
+    b = &c->blocks[k - c->keyboard];
+    if (b->built) return b;
+
+    b->text = (char *)calloc(b->size + SUFLINE, 1);
+    b->len = (unsigned char *)malloc(b->n + 1);
+    b->nsym = (unsigned char *)malloc(b->n + 1);
+    if (b->text == NULL || b->len == NULL || b->nsym == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    fill(b, &pos, &line, pre, 0, 0, k, c->depth);
+    assert(pos == b->size && line == b->n);
+    b->built = 1;
+
+    return b;
+}
+
+void sufcache_free(sufcache *c)
+{
+    int i;
+
+    if (c == NULL || c->blocks == NULL) return;
+    for (i = 0; i < c->numkeys; i++) {
+        free(c->blocks[i].text);
+        free(c->blocks[i].len);
+        free(c->blocks[i].nsym);
+    }
+    free(c->blocks);
+    c->blocks = NULL;
+    c->depth = 0;
+}
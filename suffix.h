@@ -0,0 +1,54 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWSUFFIX__
+#define __KBWSUFFIX__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keyboard.h"
+
+// longest cached suffix, a line (suffix and '\n') fits in SUFLINE bytes
+#define SUFMAXDEPTH 7
+#define SUFLINE 32
+
+/* *
+ * All the suffixes of length 1..depth of the walks from a key, i.e. what
+ * dfs() appends to a prefix ending with any character of the key when depth
+ * characters are left and all of them are printed. The lines are in the order
+ * dfs() writes them.
+ * */
+typedef struct sufblock {
+    char *text; // '\n'-terminated suffixes, SUFLINE readable bytes after each line start
+    unsigned char *len; // bytes of each line, '\n' included
+    unsigned char *nsym; // characters of each line
+    size_t n; // number of lines
+    size_t size; // bytes of text, excluding the padding
+    int built;
+} sufblock;
+
+typedef struct sufcache {
+    int depth; // length of the cached suffixes, 0 if the cache is disabled
+    key *keyboard;
+    int numkeys;
+    sufblock *blocks; // one for each key, built the first time it is used
+} sufcache;
+
+/* *
+ * Choose the longest suffix length <= maxdepth (and <= SUFMAXDEPTH) whose
+ * blocks, for all the keys, fit in budget bytes; the cache is disabled
+ * (depth 0) if not even 2 characters fit, the last level alone is already
+ * written by dfs() without visiting it.
+ * Returns the chosen depth.
+ * */
+int sufcache_init(sufcache *c, key *keyboard, int numkeys, int maxdepth, size_t budget);
+
+// the block of k, built if needed; k must be a key of the cached keyboard
+const sufblock *sufcache_get(sufcache *c, const key *k);
+
+void sufcache_free(sufcache *c);
+
+#endif
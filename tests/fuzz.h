@@ -0,0 +1,33 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#ifndef __KBWFUZZ__
+#define __KBWFUZZ__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* *
+ * Every harness defines the libFuzzer entry point. Built with
+ * -fsanitize=fuzzer (make fuzz) libFuzzer drives it, otherwise it is linked
+ * with fuzzmain.c, which feeds it stdin (AFL), corpus files (replay) or
+ * mutations of them (make check).
+ * */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// a broken invariant is a crash, for the fuzzers and for make check alike
+#define FUZZ_CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            abort(); \
+        } \
+    } while (0)
+
+#endif
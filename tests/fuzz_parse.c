@@ -0,0 +1,95 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../patterns.h"
+#include "../keyboard.h"
+#include "../dryrun.h"
+#include "fuzz.h"
+
+/* *
+ * Parser harness: the input is a .kbwp file, parsed as 8-bit and as UTF-8.
+ * parseBuffer() must either report an error or return a keyboard that holds
+ * to what the generators assume: valid keys, no character on two keys,
+ * neighbours on the keyboard and not repeated, and dry-run counters that
+ * agree with the graph.
+ * */
+
+#define FUZZDEPTH 6
+
+static void check_keyboard(const key *keys, int n, int utf8)
+{
+    int i, j, z, r, type;
+    double acnt;
+    const key *k;
+
+    FUZZ_CHECK(n > 0, "%d keys", n);
+    for (i = 0; i < n; i++) {
+        k = &keys[i];
+        FUZZ_CHECK(validKey(k) == OK_KEY, "key %d: %d", i, validKey(k));
+        FUZZ_CHECK(k->lensv >= 0 && k->lensv <= MAXSHIFTVARS, "key %d: %d shift variants", i, k->lensv);
+        for (z = 0; z <= k->lensv; z++) {
+            FUZZ_CHECK(k->symlen[z] >= 1 && k->symlen[z] <= (utf8 ? MAXSYMLEN : 1), "key %d: symbol %d of %d bytes", i, z, k->symlen[z]);
+            FUZZ_CHECK(getkey((key *)keys, n, k->sym[z], &type) == k && type == z-1, "key %d: symbol %d not found", i, z);
+        }
+        for (j = 0; j < i; j++) {
+            FUZZ_CHECK(wrongKeys(k, &keys[j]) == 0, "keys %d and %d share a character", j, i);
+        }
+        FUZZ_CHECK(k->nreach >= 0 && k->nreach <= MAXNEIGHBOURS, "key %d: %d neighbours", i, k->nreach);
+        for (j = 0; j < k->nreach; j++) {
+            FUZZ_CHECK(k->reach[j] >= keys && k->reach[j] < keys + n, "key %d: neighbour %d off the keyboard", i, j);
+            for (z = 0; z < j; z++) {
+                FUZZ_CHECK(k->reach[z] != k->reach[j], "key %d: neighbour %d repeated", i, j);
+            }
+        }
+    }
+
+    // counter[r] of a key is its characters times the counters of its
+    // neighbours one level up, reachlen the last non zero one
+    dry_run((key *)keys, n, FUZZDEPTH);
+    for (i = 0; i < n; i++) {
+        k = &keys[i];
+        FUZZ_CHECK(k->counter[0] == 1 + k->lensv, "key %d: counter[0] %g", i, k->counter[0]);
+        for (r = 1; r < FUZZDEPTH; r++) {
+            for (j = 0, acnt = 0; j < k->nreach; j++) acnt += k->reach[j]->counter[r-1];
+            FUZZ_CHECK(k->counter[r] == (1 + k->lensv) * acnt, "key %d: counter[%d] %g", i, r, k->counter[r]);
+        }
+        FUZZ_CHECK(k->reachlen >= 1 && k->reachlen <= FUZZDEPTH && k->counter[k->reachlen-1] > 0, "key %d: reachlen %d", i, k->reachlen);
+        for (r = k->reachlen; r < FUZZDEPTH; r++) {
+            FUZZ_CHECK(k->counter[r] == 0, "key %d: counter[%d] %g past reachlen %d", i, r, k->counter[r], k->reachlen);
+        }
+    }
+    FUZZ_CHECK(layout_hash(keys, n) == layout_hash(keys, n), "unstable layout hash");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *buf;
+    key *keys;
+    int n, utf8;
+    parse_error err;
+
+    // the parser terminates the lines in place and needs a spare byte
+    if ((buf = (char *)malloc(size + 1)) == NULL) return 0;
+
+    for (utf8 = 0; utf8 <= 1; utf8++) {
+        memcpy(buf, data, size);
+        memset(&err, 0, sizeof(err));
+        keys = parseBuffer(buf, size, &n, FUZZDEPTH, utf8, &err);
+        if (keys == NULL) {
+            FUZZ_CHECK(err.msg[0] != '\0' && strlen(err.msg) < sizeof(err.msg), "error without a message at %d:%d", err.line, err.col);
+            continue;
+        }
+        check_keyboard(keys, n, utf8);
+        free(keys);
+    }
+
+    free(buf);
+    return 0;
+}
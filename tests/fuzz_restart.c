@@ -0,0 +1,223 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#define _GNU_SOURCE // memfd_create()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../patterns.h"
+#include "../keyboard.h"
+#include "../dryrun.h"
+#include "../output.h"
+#include "../kernel.h"
+#include "../suffix.h"
+#include "../cmdlineopts.h"
+#include "fuzz.h"
+
+/* *
+ * Restart and engine harness. The input picks a built-in layout, an engine
+ * (generic dfs(), specialized kernels or suffix cache), the lengths, the
+ * start key, the disabled keys and a node of the tree. The output of dfs()
+ * from the start key must match a plain recursive walk in the reference
+ * order (neighbours from the last one, shift variants from the last one,
+ * base character last, every word before its subtree), the output restarted
+ * from the node must be the tail of it after the node, and word_rank() of
+ * the node must be the number of words before it.
+ * */
+
+// main.c, built with kbwmain.c
+extern FILE *flog;
+extern outbuf out;
+extern outbuf *outlen[MAXWORDLEN+1];
+extern sufcache suffixes;
+extern kernel kern;
+void dfs(key *start, int minlen, int depth, key *keyboard, int keyboardlen, char *restart);
+
+#define FUZZDEPTH 5
+
+static const struct {
+    const char *text;
+    int utf8;
+} layouts[] = {
+    // mixed number of characters, a key without neighbours
+    { "5\n-aA\n-bB!\n-c\n-dD\n-e\n\na:abc\nb:bad\nc:ce\nd:dab\ne:\n", 0 },
+    // UTF-8, 1 to 4 bytes per character
+    { "5\n-aA\n-\xc3\xa9\xc3\x89\n-\xd0\xb6\n-bB\xe2\x82\xac\n-\xf0\x9d\x84\x9e\n\na:a\xc3\xa9\xf0\x9d\x84\x9e\n\xc3\xa9:\xc3\xa9\xd0\xb6" "b\n\xd0\xb6:\xd0\xb6" "a\nb:b\xc3\xa9\n\xf0\x9d\x84\x9e:a\n", 1 },
+    // two characters per key, the unrolled kernels
+    { "4\n-aA\n-sS\n-dD\n-fF\n\na:asd\ns:sadf\nd:dsf\nf:fa\n", 0 },
+    // one character per key, a ring
+    { "4\n-1\n-2\n-3\n-4\n\n1:12\n2:23\n3:34\n4:41\n", 0 },
+};
+#define NLAYOUTS (int)(sizeof(layouts) / sizeof(layouts[0]))
+
+// the reference walk, optionally stopping to record one node
+typedef struct refwalk {
+    int minlen, depth;
+    char word[FUZZDEPTH * MAXSYMLEN + 1];
+    int wlen;
+    key *path[FUZZDEPTH];
+    int types[FUZZDEPTH];
+    char *out; // the output
+    size_t len, cap;
+    uint64_t nodes, words;
+    uint64_t target; // node to record
+    char tword[FUZZDEPTH * MAXSYMLEN + 1];
+    key *tpath[FUZZDEPTH];
+    int ttypes[FUZZDEPTH];
+    int tlen; // characters of the recorded node
+    size_t toff; // output bytes up to the node included
+    uint64_t trank; // words before the node
+} refwalk;
+
+static void ref_visit(refwalk *w, key *k, int t, int pos)
+{
+    int j, z, plen = w->wlen;
+    key *n;
+
+    memcpy(w->word + plen, &k->sym[t+1], k->symlen[t+1]);
+    w->wlen += k->symlen[t+1];
+    w->word[w->wlen] = '\0';
+    w->path[pos] = k;
+    w->types[pos] = t;
+
+    if (w->nodes == w->target) w->trank = w->words;
+    if (pos + 1 >= w->minlen) {
+        if (w->len + w->wlen + 1 > w->cap) {
+            w->cap = 2 * (w->cap + w->wlen + 1);
+            if ((w->out = (char *)realloc(w->out, w->cap)) == NULL) abort();
+        }
+        memcpy(w->out + w->len, w->word, w->wlen);
+        w->len += w->wlen;
+        w->out[w->len++] = '\n';
+        w->words++;
+    }
+    if (w->nodes == w->target) {
+        memcpy(w->tword, w->word, w->wlen + 1);
+        memcpy(w->tpath, w->path, (pos + 1) * sizeof(key *));
+        memcpy(w->ttypes, w->types, (pos + 1) * sizeof(int));
+        w->tlen = pos + 1;
+        w->toff = w->len;
+    }
+    w->nodes++;
+
+    // the same pruning as dfs(): nothing to write below
+    if (pos + 1 < w->depth) {
+        for (j = k->nreach - 1; j >= 0; j--) {
+            n = k->reach[j];
+            if (n->active != ACTIVE || n->reachlen < w->minlen - pos - 1) continue;
+            for (z = n->lensv - 1; z >= -1; z--) ref_visit(w, n, z, pos + 1);
+        }
+    }
+    w->wlen = plen;
+}
+
+static void ref_run(refwalk *w, key *start)
+{
+    int z;
+
+    w->wlen = 0;
+    w->len = 0;
+    w->nodes = 0;
+    w->words = 0;
+    for (z = start->lensv - 1; z >= -1; z--) ref_visit(w, start, z, 0);
+}
+
+// run dfs() into fd and read back its output
+static char *run_dfs(int fd, size_t cap, key *start, int minlen, int depth, key *keys, int n, char *restart, size_t *len)
+{
+    char *buf;
+    off_t size;
+
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) abort();
+    out_init(&out, fd, cap);
+    dfs(start, minlen, depth, keys, n, restart);
+    out_free(&out);
+    memset(&out, 0, sizeof(out));
+
+    size = lseek(fd, 0, SEEK_END);
+    FUZZ_CHECK(size >= 0, "lseek() failed");
+    if ((buf = (char *)malloc(size + 1)) == NULL) abort();
+    FUZZ_CHECK(pread(fd, buf, size, 0) == size, "short read");
+    *len = size;
+    return buf;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static int fd = -1;
+    uint8_t in[16] = { 0 };
+    char *text, *got;
+    key *keys, *start;
+    int i, n, l, engine, minlen, depth;
+    uint64_t mask, sel;
+    size_t len, cap;
+    parse_error err;
+    refwalk w;
+
+    if (flog == NULL) flog = fopen("/dev/null", "w");
+    // the output of dfs() is read back from memory
+    if (fd < 0) fd = memfd_create("kbw-fuzz", 0);
+    if (flog == NULL || fd < 0) abort();
+
+    memcpy(in, data, size < sizeof(in) ? size : sizeof(in));
+    l = in[0] % NLAYOUTS;
+    engine = in[1] % 3;
+    depth = 1 + in[2] % FUZZDEPTH;
+    minlen = 1 + in[3] % depth;
+    cap = (size_t)64 << (in[5] % 8);
+    mask = in[6];
+    sel = (uint64_t)in[7] | (uint64_t)in[8] << 8 | (uint64_t)in[9] << 16 | (uint64_t)in[10] << 24;
+
+    len = strlen(layouts[l].text);
+    if ((text = (char *)malloc(len + 1)) == NULL) abort();
+    memcpy(text, layouts[l].text, len + 1);
+    keys = parseBuffer(text, len, &n, FUZZDEPTH, layouts[l].utf8, &err);
+    FUZZ_CHECK(keys != NULL, "layout %d: %d:%d: %s", l, err.line, err.col, err.msg);
+    free(text);
+
+    // the keys of the set bits are disabled, as -X does, but not the start key
+    start = &keys[in[4] % n];
+    for (i = 0; i < n; i++) {
+        if ((mask >> i & 1) && &keys[i] != start) keys[i].active = INACTIVE;
+    }
+    dry_run(keys, n, FUZZDEPTH);
+
+    memset(&kern, 0, sizeof(kern));
+    memset(&suffixes, 0, sizeof(suffixes));
+    for (i = 0; i <= MAXWORDLEN; i++) outlen[i] = &out;
+    if (engine == 1) {
+        kernel_select(&kern, keys, n, minlen, depth, outlen);
+    } else if (engine == 2 && depth > 1) {
+        sufcache_init(&suffixes, keys, n, depth - 1, (size_t)1 << (8 + in[11] % 12));
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.minlen = minlen;
+    w.depth = depth;
+    w.target = UINT64_MAX;
+    ref_run(&w, start);
+    FUZZ_CHECK(count_words(start, minlen, depth) == (double)w.words, "dry-run counts %g words, the walk %lu", count_words(start, minlen, depth), (unsigned long)w.words);
+
+    got = run_dfs(fd, cap, start, minlen, depth, keys, n, NULL, &len);
+    FUZZ_CHECK(len == w.len && memcmp(got, w.out, len) == 0, "layout %d engine %d -m %d -M %d from %.*s: %zu bytes, expected %zu", l, engine, minlen, depth, SYMARG(start, 0), len, w.len);
+    free(got);
+
+    // restart from one node of the walk
+    w.target = sel % w.nodes;
+    ref_run(&w, start);
+    FUZZ_CHECK(word_rank(w.tpath, w.ttypes, w.tlen, minlen, depth) == (double)w.trank, "rank of \"%s\": %g, expected %lu", w.tword, word_rank(w.tpath, w.ttypes, w.tlen, minlen, depth), (unsigned long)w.trank);
+    got = run_dfs(fd, cap, start, minlen, depth, keys, n, w.tword, &len);
+    FUZZ_CHECK(len == w.len - w.toff && memcmp(got, w.out + w.toff, len) == 0, "layout %d engine %d -m %d -M %d restart \"%s\": %zu bytes, expected %zu", l, engine, minlen, depth, w.tword, len, w.len - w.toff);
+    free(got);
+
+    sufcache_free(&suffixes);
+    free(w.out);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "fuzz.h"
+
+/* *
+ * Standalone driver of a harness, for builds without libFuzzer:
+ *   harness < input          one input from stdin (AFL, afl-fuzz -- harness)
+ *   harness file...          replay the files, e.g. a corpus or a crash
+ *   harness -n N [-s SEED] [file...]
+ *                            the files, then N inputs obtained mutating them
+ *                            (random bytes without files). The sequence only
+ *                            depends on SEED, a failing input is saved to
+ *                            the -c file (default crash.in)
+ * */
+
+#define MAXINPUT (1 << 16)
+
+static const uint8_t *cur; // input being run, saved if it crashes
+static size_t curlen;
+static const char *crashpath = "crash.in";
+
+static void save_crash(int sig)
+{
+    int fd;
+    ssize_t ret;
+
+    if (cur != NULL && (fd = open(crashpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+        ret = write(fd, cur, curlen);
+        (void)ret;
+        close(fd);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void run(const uint8_t *data, size_t len)
+{
+    cur = data;
+    curlen = len;
+    LLVMFuzzerTestOneInput(data, len);
+    cur = NULL;
+}
+
+// read a whole file (stdin if path is NULL) into a malloc()ed buffer
+static uint8_t *load(const char *path, size_t *len)
+{
+    FILE *f = path != NULL ? fopen(path, "rb") : stdin;
+    uint8_t *buf;
+
+    if (f == NULL) {
+        fprintf(stderr, "Can't open \"%s\"\n", path);
+        exit(1);
+    }
+    if ((buf = (uint8_t *)malloc(MAXINPUT)) == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        exit(1);
+    }
+    *len = fread(buf, 1, MAXINPUT, f);
+    if (path != NULL) fclose(f);
+    return buf;
+}
+
+static uint64_t rng_next(uint64_t *s)
+{
+    // xorshift64*
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+// bytes that take the parsers to their other branches
+static const uint8_t special[] = { '\n', '\r', '-', ':', '#', ' ', '\t', '0', '1', '9', 0x00, 0x7f, 0x80, 0xbf, 0xc3, 0xe2, 0xf0, 0xff };
+
+/* *
+ * A few random edits of src into dst (MAXINPUT bytes): bit flips, special
+ * or random bytes, removed, duplicated or swapped ranges. Half of the inputs
+ * get a single edit, so that most structured ones stay almost valid.
+ * */
+static size_t mutate(uint8_t *dst, const uint8_t *src, size_t len, uint64_t *rng)
+{
+    size_t i, a, b, n;
+    int edits = 1;
+
+    while (edits < 8 && rng_next(rng) % 2) edits++;
+    if (len > 0) memcpy(dst, src, len);
+    while (edits-- > 0) {
+        if (len == 0) {
+            n = 1 + rng_next(rng) % 64;
+            for (i = 0; i < n; i++) dst[i] = (uint8_t)rng_next(rng);
+            len = n;
+            continue;
+        }
+        a = rng_next(rng) % len;
+        b = a + rng_next(rng) % (len - a);
+        switch (rng_next(rng) % 6) {
+            case 0:
+                dst[a] ^= 1 << (rng_next(rng) % 8);
+                break;
+            case 1:
+                dst[a] = special[rng_next(rng) % sizeof(special)];
+                break;
+            case 2:
+                dst[a] = (uint8_t)rng_next(rng);
+                break;
+            case 3: // remove [a, b]
+                memmove(dst + a, dst + b + 1, len - b - 1);
+                len -= b - a + 1;
+                break;
+            case 4: // insert a copy of [a, b] at a
+                n = b - a + 1;
+                if (len + n > MAXINPUT) break;
+                memmove(dst + b + 1, dst + a, len - a);
+                len += n;
+                break;
+            default: // swap the bytes at a and b
+                n = dst[a]; dst[a] = dst[b]; dst[b] = (uint8_t)n;
+                break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, nfiles;
+    unsigned long n = 0, k;
+    uint64_t seed = 1;
+    uint8_t **files, *buf;
+    size_t *lens, len;
+
+    while ((c = getopt(argc, argv, "c:n:s:")) != -1) {
+        switch (c) {
+            case 'c':
+                crashpath = optarg;
+                break;
+            case 'n':
+                n = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n N] [-s SEED] [-c CRASHFILE] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+    signal(SIGABRT, save_crash);
+    signal(SIGSEGV, save_crash);
+    signal(SIGBUS, save_crash);
+    signal(SIGFPE, save_crash);
+
+    nfiles = argc - optind;
+    if (nfiles == 0 && n == 0) {
+        buf = load(NULL, &len);
+        run(buf, len);
+        free(buf);
+        return 0;
+    }
+
+    files = (uint8_t **)malloc((nfiles + 1) * sizeof(uint8_t *));
+    lens = (size_t *)malloc((nfiles + 1) * sizeof(size_t));
+    buf = (uint8_t *)malloc(MAXINPUT);
+    if (files == NULL || lens == NULL || buf == NULL) {
+        fprintf(stderr, "malloc() error\n");
+        return 1;
+    }
+    for (i = 0; i < nfiles; i++) {
+        files[i] = load(argv[optind + i], &lens[i]);
+        run(files[i], lens[i]);
+    }
+
+    seed = seed * 0x9E3779B97F4A7C15ULL + 1; // never 0
+    for (k = 0; k < n; k++) {
+        if (nfiles > 0) {
+            i = rng_next(&seed) % nfiles;
+            len = mutate(buf, files[i], lens[i], &seed);
+        } else {
+            len = mutate(buf, NULL, 0, &seed);
+        }
+        run(buf, len);
+    }
+    fprintf(stderr, "%s: %d files, %lu mutated inputs passed\n", argv[0], nfiles, n);
+
+    for (i = 0; i < nfiles; i++) free(files[i]);
+    free(files);
+    free(lens);
+    free(buf);
+    return 0;
+}
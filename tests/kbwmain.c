@@ -0,0 +1,8 @@
+/* *
+ * MIT License
+ * Copyright (c) 2024 Infosystem Security s.r.l.
+ * See the LICENSE file for full terms.
+ * */
+// main.c without its main(), so that the harnesses can call dfs()
+#define main kbw_main
+#include "../main.c"
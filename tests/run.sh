@@ -0,0 +1,303 @@
+#!/bin/bash
+# MIT License
+# Copyright (c) 2024 Infosystem Security s.r.l.
+# See the LICENSE file for full terms.
+#
+# Regression tests, run from the source directory (make check):
+#  - golden outputs: the md5 of the words of fixed runs on the bundled and
+#    the synthetic layouts (tests/layouts) must not change across versions,
+#    see tests/golden.txt;
+#  - differential tests: every fast path (kernels, suffix cache, split
+#    output, -C, -r, -y, -P, restart, shards, -X, -V/-x), the gzip output,
+#    the counters cache, the -o sinks (read back with kbwread) and a -D
+#    job against the words of kbw-generic, the plain dfs() without kernels
+#    and caches; the -D client is python3, the job is skipped without it;
+#  - fuzz harnesses: the parser corpus and mutations of it, and random
+#    inputs of the restart and engine harness.
+# Usage: tests/run.sh [-u]
+#   -u rewrite the md5 sums of tests/golden.txt with the current outputs,
+#      only after a change of the output that is meant
+# FUZZRUNS (default 20000) sets the number of mutated inputs per harness.
+
+cd "$(dirname "$0")/.." || exit 1
+
+KBW=./kbw
+REF=./kbw-generic
+READER=./kbwread
+GOLDEN=tests/golden.txt
+ITA=arrangements/ISO88591_qwerty_ita_d1.kbwp
+FUZZRUNS=${FUZZRUNS:-20000}
+T=$(mktemp -d "${TMPDIR:-/tmp}/kbw-tests.XXXXXX") || exit 1
+trap 'rm -rf "$T"' EXIT
+LOG=$T/log
+
+passed=0
+failed=0
+
+ok() {
+    passed=$((passed + 1))
+}
+
+fail() {
+    failed=$((failed + 1))
+    echo "FAIL: $*"
+}
+
+# compare two files, $3 names the test
+same() {
+    if cmp -s "$1" "$2"; then ok; else fail "$3"; fi
+}
+
+# ------------------------------------------------------------------ golden
+# each line: md5 name kbw-arguments (paths relative to the source directory)
+update=0
+[ "$1" = "-u" ] && update=1
+: > "$T/golden"
+while IFS= read -r line; do
+    case "$line" in ''|'#'*) echo "$line" >> "$T/golden"; continue ;; esac
+    read -r sum name args <<< "$line"
+    eval "set -- $args"
+    got=$($KBW "$@" -l "$LOG" | md5sum | cut -d' ' -f1)
+    echo "$got $name $args" >> "$T/golden"
+    [ "$update" = 1 ] || [ "$got" = "$sum" ] && ok || fail "golden $name: $got, expected $sum"
+done < "$GOLDEN"
+if [ "$update" = 1 ]; then
+    cp "$T/golden" "$GOLDEN"
+    echo "$GOLDEN updated"
+fi
+
+# ------------------------------------------------------------ differential
+# words of a length, in order (characters counted as UTF-8 with -u)
+bylen() {
+    LC_ALL=C awk -v l="$1" -v u="$2" '{ n = u ? gsub(/[^\200-\277]/, "&") : length($0) } n == l'
+}
+
+# wait (at most 5 seconds) for a listening socket at $1
+wait_sock() {
+    local i
+    for ((i = 0; i < 100; i++)); do
+        [ -S "$1" ] && return 0
+        sleep 0.05
+    done
+    return 1
+}
+
+# diff_run LAYOUT KEYS UTF8 DISABLE MIN MAX, DISABLE is a comma separated
+# list of characters
+diff_run() {
+    local layout=$1 keys=$2 u=$3 dis=$4 min=$5 max=$6
+    local name="$(basename "$layout") -k $keys -m $min -M $max"
+    local a=(-a "$layout" -k "$keys" -m "$min" -M "$max" -l "$LOG")
+    local i n line w
+    [ "$u" = 1 ] && a+=(-u)
+
+    $REF "${a[@]}" > "$T/ref"
+    n=$(wc -l < "$T/ref")
+
+    # kernels and suffix cache
+    $KBW "${a[@]}" > "$T/out"
+    same "$T/ref" "$T/out" "kernels: $name"
+    for b in 1 16 1024; do
+        $KBW "${a[@]}" -b "$b" > "$T/out"
+        same "$T/ref" "$T/out" "suffix cache -b $b: $name"
+    done
+
+    # the dry-run count
+    line=$($KBW "${a[@]}" -d | awk '/^Total:/ { print $2 }')
+    [ "$line" = "$n" ] && ok || fail "dry-run: $name: $line words, $n written"
+
+    # the counters cache: the second run loads the .kbwc of the first one
+    rm -rf "$T/cache"
+    mkdir "$T/cache"
+    $KBW "${a[@]}" -d -c "$T/cache" > /dev/null
+    : > "$LOG"
+    line=$($KBW "${a[@]}" -d -c "$T/cache" | awk '/^Total:/ { print $2 }')
+    [ "$line" = "$n" ] && ls "$T"/cache/*.kbwc > /dev/null 2>&1 && grep -q "loaded from cache" "$LOG" && ok || fail "cache -c: $name: $line words, $n written"
+
+    # gzip members compressed in parallel, on stdout and in a file
+    $KBW "${a[@]}" -z gzip:1 | gzip -dc > "$T/out"
+    same "$T/ref" "$T/out" "gzip -z: $name"
+    $KBW "${a[@]}" -z gzip -j 3 -o "$T/out.gz"
+    gzip -dc "$T/out.gz" > "$T/out"
+    same "$T/ref" "$T/out" "gzip -z -o: $name"
+    rm -f "$T"/out.gz*
+
+    # the sinks of -o
+    $KBW "${a[@]}" -o "file:$T/out,direct,prealloc=1M,batch=64K" 2> /dev/null
+    same "$T/ref" "$T/out" "sink file direct: $name"
+    $KBW "${a[@]}" -o fd:3 3> "$T/out"
+    same "$T/ref" "$T/out" "sink fd: $name"
+    rm -f "$T/sock"
+    $READER -o "$T/out" "unix:$T/sock" 2> /dev/null &
+    wait_sock "$T/sock"
+    $KBW "${a[@]}" -o "unix:$T/sock,sndbuf=64K"
+    wait
+    same "$T/ref" "$T/out" "sink unix: $name"
+    $KBW "${a[@]}" -o "shm:kbw-tests.$$,size=64K" &
+    $READER -o "$T/out" "shm:kbw-tests.$$" 2> /dev/null
+    wait
+    same "$T/ref" "$T/out" "sink shm: $name"
+
+    # a job of the daemon, the words come back on the connection
+    if command -v python3 > /dev/null; then
+        rm -f "$T/sock"
+        $KBW -D "$T/sock" -l "$LOG" &
+        i=$!
+        wait_sock "$T/sock"
+        python3 -c 'import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(sys.argv[2].encode() + b"\n")
+sys.stdout.buffer.write(s.makefile("rb").read())' "$T/sock" "${a[*]}" > "$T/out"
+        kill "$i"
+        wait "$i"
+        same "$T/ref" "$T/out" "daemon -D: $name"
+    else
+        echo "SKIP: daemon -D: $name, python3 not found"
+    fi
+
+    # one file per length
+    $KBW "${a[@]}" -p "$T/split.%d" > /dev/null
+    for ((i = min; i <= max; i++)); do
+        bylen "$i" "$u" < "$T/ref" > "$T/out"
+        [ -f "$T/split.$i" ] || : > "$T/split.$i"
+        same "$T/out" "$T/split.$i" "split length $i: $name"
+    done
+    rm -f "$T"/split.*
+
+    # -C: the index of every word is its line, a missing word is "-"
+    (cat "$T/ref"; echo "$keys$keys$keys$keys$keys$keys") | $KBW "${a[@]}" -C - > "$T/out"
+    LC_ALL=C awk -F'\t' -v n="$n" '(NR <= n && $2 != NR-1) || (NR > n && $2 != "-") { bad = 1 } END { exit bad || NR != n + 1 }' "$T/out" && ok || fail "check -C: $name"
+
+    # -r: every drawn word is generated, the same seed the same words
+    $KBW "${a[@]}" -r 3000:7 > "$T/out"
+    LC_ALL=C sort -u "$T/ref" > "$T/sorted"
+    [ "$(wc -l < "$T/out")" = 3000 ] && [ -z "$(LC_ALL=C sort -u "$T/out" | LC_ALL=C comm -23 - "$T/sorted")" ] && ok || fail "sample -r: $name"
+    $KBW "${a[@]}" -r 3000:7 -j 3 > "$T/out2"
+    same "$T/out" "$T/out2" "sample -r threads: $name"
+
+    # -y: the words sorted without repeats, the index points to its lines
+    $KBW "${a[@]}" -y 16M -j 3 -o "$T/out" 2> /dev/null
+    LC_ALL=C sort -u "$T/ref" > "$T/sorted"
+    same "$T/sorted" "$T/out" "sorted -y: $name"
+    line=
+    while IFS=$'\t' read -r i w; do
+        [ "$(tail -c +"$((i + 1))" "$T/out" | head -n 1)" = "$w" ] || { line=$i; break; }
+    done < "$T/out.idx"
+    [ -z "$line" ] && ok || fail "sorted index -y, offset $line: $name"
+
+    # -P: the product of the walks and the other segments, first one slowest
+    $KBW "${a[@]}" -P 'walk+(!|)+\d' > "$T/out"
+    LC_ALL=C awk '{ for (i = 0; i < 20; i++) print $0 (i < 10 ? "!" : "") (i % 10) }' "$T/ref" > "$T/pattern"
+    same "$T/pattern" "$T/out" "pattern -P: $name"
+    line=$($KBW "${a[@]}" -P 'walk+(!|)+\d' -d | awk '/^Total:/ { print $2 }')
+    [ "$line" = "$((n * 20))" ] && ok || fail "pattern -P dry-run: $name: $line words, $((n * 20)) written"
+    # a dictionary without the last newline, a set with an escape and a
+    # range repeated 0 to 2 times (shortest first, last character fastest)
+    printf 'A\nbc' > "$T/dict"
+    $KBW "${a[@]}" -P "@$T/dict+[\\-x-y]{0,2}+walk" > "$T/out"
+    LC_ALL=C awk 'BEGIN { split("A bc", d, " "); split("- x y", c, " "); m[1] = ""; k = 1
+                          for (i = 1; i <= 3; i++) m[++k] = c[i]
+                          for (i = 1; i <= 3; i++) for (j = 1; j <= 3; j++) m[++k] = c[i] c[j] }
+                  { w[NR] = $0 }
+                  END { for (i = 1; i <= 2; i++) for (j = 1; j <= k; j++) for (l = 1; l <= NR; l++) print d[i] m[j] w[l] }' "$T/ref" > "$T/pattern"
+    same "$T/pattern" "$T/out" "pattern -P @FILE and [SET]{N,M}: $name"
+
+    # restart from a few words: the output goes on after them
+    for i in 1 2 $((n / 3)) $((n / 2)) $((n - 1)) "$n"; do
+        [ "$i" -ge 1 ] || continue
+        w=$(sed -n "${i}p" "$T/ref")
+        for b in 0 64; do
+            # the restarted output appends to an existing file, start empty
+            rm -f "$T/out"
+            $KBW "${a[@]}" -b "$b" -w "$w" -o "$T/out" 2> /dev/null
+            tail -n +"$((i + 1))" "$T/ref" > "$T/tail"
+            same "$T/tail" "$T/out" "restart -w \"$w\" -b $b: $name"
+        done
+    done
+
+    # shards: a partition of the words, digests combined as a single run
+    $KBW "${a[@]}" -V "$T/dall" > /dev/null
+    : > "$T/union"
+    for i in 0 1 2; do
+        $KBW "${a[@]}" -S "$i/3" -V "$T/d$i" >> "$T/union"
+    done
+    LC_ALL=C sort "$T/union" > "$T/out"
+    LC_ALL=C sort "$T/ref" > "$T/sorted"
+    same "$T/sorted" "$T/out" "shards -S: $name"
+    $KBW "${a[@]}" -x "$T/d0" -x "$T/d1" -x "$T/d2" > "$T/out"
+    same "$T/dall" "$T/out" "digests -V/-x: $name"
+
+    # disabled keys: the words without their characters, in order
+    if [ -n "$dis" ]; then
+        $KBW "${a[@]}" -X "${dis//,/}" > "$T/out"
+        LC_ALL=C grep -v -F "${dis//,/$'\n'}" "$T/ref" > "$T/filtered"
+        same "$T/filtered" "$T/out" "disable -X \"$dis\": $name"
+    fi
+}
+
+# pattern_run LAYOUT KEYS UTF8: the walk segments of -P with their own
+# lengths, outside -m and -M
+pattern_run() {
+    local layout=$1 keys=$2 u=$3
+    local name="$(basename "$layout") -k $keys"
+    local a=(-a "$layout" -k "$keys" -l "$LOG")
+    local n line
+    [ "$u" = 1 ] && a+=(-u)
+
+    # two walks with the same lengths share the words of the first one
+    $REF "${a[@]}" -m 1 -M 2 > "$T/ref"
+    $KBW "${a[@]}" -m 1 -M 2 -P 'walk{1,2}+.+walk{1,2}' > "$T/out"
+    LC_ALL=C awk '{ w[NR] = $0 } END { for (i = 1; i <= NR; i++) for (j = 1; j <= NR; j++) print w[i] "." w[j] }' "$T/ref" > "$T/pattern"
+    same "$T/pattern" "$T/out" "pattern -P shared walks: $name"
+
+    # walks longer than -M raise the counted depth
+    $REF "${a[@]}" -m 3 -M 4 > "$T/ref"
+    n=$(wc -l < "$T/ref")
+    $KBW "${a[@]}" -m 1 -M 2 -P 'walk{3,4}+!' > "$T/out"
+    sed 's/$/!/' "$T/ref" > "$T/pattern"
+    same "$T/pattern" "$T/out" "pattern -P walk{3,4} beyond -M: $name"
+    line=$($KBW "${a[@]}" -m 1 -M 2 -P 'walk{3,4}+[\]a]{1,2}' -d | awk '/^Total:/ { print $2 }')
+    [ "$line" = "$((n * 6))" ] && ok || fail "pattern -P dry-run [SET]{1,2}: $name: $line words, $((n * 6)) expected"
+}
+
+# layout, start keys, UTF-8, characters of the disabled keys (all the
+# characters of the keys, "-" for none) and length ranges
+while read -r layout keys u dis ranges; do
+    [ -n "$layout" ] || continue
+    [ "$dis" = "-" ] && dis=
+    pattern_run "$layout" "$keys" "$u"
+    for r in $ranges; do
+        diff_run "$layout" "$keys" "$u" "$dis" "${r%-*}" "${r#*-}"
+    done
+done <<EOF
+tests/layouts/mixed.kbwp abcde 0 b,B,! 1-5 3-6 6-6
+tests/layouts/utf8.kbwp aé 1 ж 1-5 4-6
+tests/layouts/pairs.kbwp asdf 0 d,D 1-4 2-6 5-5
+tests/layouts/ring.kbwp 1234 0 - 1-6 7-7
+$ITA 1qaz2wsx 0 w,W 1-4 5-5
+EOF
+
+# a chain of one key: one word per length, up to the longest allowed (512,
+# MAXWORDLEN), a longer -M is refused
+$REF -a tests/layouts/chain.kbwp -k a -m 1 -M 512 -l "$LOG" > "$T/ref"
+$KBW -a tests/layouts/chain.kbwp -k a -m 1 -M 512 -l "$LOG" > "$T/out"
+[ "$(wc -l < "$T/out")" = 512 ] && same "$T/ref" "$T/out" "chain -M 512" || fail "chain -M 512: $(wc -l < "$T/out") words"
+$KBW -a tests/layouts/chain.kbwp -k a -m 1 -M 513 -l "$LOG" > "$T/out" 2> /dev/null && fail "chain -M 513 accepted" || ok
+
+# -------------------------------------------------------------------- fuzz
+if tests/fuzz_parse -c "$T/crash-parse" -n "$FUZZRUNS" tests/layouts/*.kbwp tests/corpus/parse/*.kbwp arrangements/*.kbwp 2> "$LOG"; then
+    ok
+else
+    cp "$T/crash-parse" crash-parse.in 2> /dev/null
+    fail "fuzz_parse: $(tail -n 1 "$LOG"), input saved to crash-parse.in"
+fi
+if tests/fuzz_restart -c "$T/crash-restart" -n "$FUZZRUNS" 2> "$LOG"; then
+    ok
+else
+    cp "$T/crash-restart" crash-restart.in 2> /dev/null
+    fail "fuzz_restart: $(tail -n 1 "$LOG"), input saved to crash-restart.in"
+fi
+
+echo "$passed passed, $failed failed"
+[ "$failed" = 0 ]